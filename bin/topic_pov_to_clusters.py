@@ -6,7 +6,8 @@ import sys
 def get_clusters(revisions_it):
     clusters = {}
     for line in revisions_it:
-        revision, topic, pov = [int(a) for a in line.split()]
+        # Any page/user name columns after the first three are ignored
+        revision, topic, pov = [int(a) for a in line.split('\t')[0].split()[:3]]
         clusters.setdefault(topic, {}).setdefault(pov, []).append(revision)
     for povs in clusters.itervalues():
         for revisionlist in povs.itervalues():
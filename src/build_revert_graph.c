@@ -0,0 +1,52 @@
+/* Build the revert interaction graph (see revert_graph.h) from the
+   revisions in mmap_directory, and save it to
+   mmap_directory/revert_graph_mmap. If with_pages is 1, the pages of
+   each edge are stored too. The graph depends only on the revisions,
+   not on the assignments, so it only needs to be rebuilt when the
+   revisions change. It can be passed to page_user_stats in place of a
+   user pairs file. */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "parse_mmaps.h"
+#include "revert_graph.h"
+
+int main(int argc, char **argv) {
+  if (argc != 3 && argc != 4) {
+    printf("Usage: %s mmap_directory threads [with_pages]\n", argv[0]);
+    exit(1);
+  }
+  struct mmap_info mmap_info = open_mmaps_readonly(argv[1]);
+  int num_threads = atoi(argv[2]);
+  int with_pages = argc == 4 ? atoi(argv[3]) : 0;
+  assert(num_threads > 0);
+  char* graph_name = full_path(argv[1], REVERT_GRAPH_MMAP_NAME);
+  build_revert_graph(&mmap_info, graph_name, with_pages, num_threads);
+
+  struct revert_graph graph;
+  open_revert_graph(graph_name, &graph);
+  int64_t count_reverters = 0;
+  int64_t count_reverts = 0;
+  for (int64_t user_id = 0; user_id < graph.header->num_users; ++user_id) {
+    int64_t count_edges;
+    const struct revert_edge* edges;
+    get_revert_edges(&graph, user_id, &count_edges, &edges);
+    count_reverters += count_edges > 0;
+    for (int64_t i = 0; i < count_edges; ++i) {
+      count_reverts += edges[i].count;
+    }
+  }
+  printf("%" PRId64 " edges from %" PRId64 " users covering %" PRId64 " reverts",
+	 graph.header->count_edges, count_reverters, count_reverts);
+  if (graph.header->has_pages) {
+    printf(", %" PRId64 " edge pages", graph.header->count_pages);
+  }
+  printf("\n");
+  close_revert_graph(&graph);
+  free(graph_name);
+  close_mmaps(mmap_info);
+  return 0;
+}
@@ -2,26 +2,285 @@
    (roughly the probability that each would POV-revert the other if
    place next to each other on a page). Useful for querying specific
    pairs of users for debugging, but does not average over multiple
-   posterior samples, and is slower for batches of users. See
-   page_user_stats.c for computing batch user statistics across
-   multiple posterior samples. */
+   posterior samples. See page_user_stats.c for computing batch user
+   statistics across multiple posterior samples.
 
-#include <unistd.h>
+   With a pairs file instead of two users, scores every "first_user
+   second_user" line of pairs_file ("-" for standard input) using
+   threads threads, and prints "first_user second_user antagonism"
+   lines in input order (followed by the user names, tab separated, if
+   revisions were stored with string identifiers). Pairs are read and
+   printed in blocks of at most PAIR_BLOCK, so arbitrarily long streams
+   use bounded memory; a block also ends when no more input is ready,
+   so answers to pairs written interactively are not held back. A
+   malformed line is an error. The pairs are scored under
+   saved_assignment: either
+   "_" for the current assignments, a single raw copy of
+   revision_assignment_mmap, or a snapshot store (see snapshots.h), in
+   which case sample (0 based, default the last) is used. */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "parse_mmaps.h"
 #include "comparisons.h"
+#include "index.h"
+#include "sample.h"
+#include "snapshots.h"
+
+#define PAIR_BLOCK 65536
+// Pairs are claimed in chunks of this many from the shared cursor.
+#define PAIR_CHUNK 256
+// Longest pairs file line, and how much input is read at once
+#define PAIR_READ_BYTES 65536
+
+struct scored_pair {
+  int64_t first_user;
+  int64_t second_user;
+  double antagonism;
+};
+
+struct pair_block_args {
+  const struct mmap_info* mmap_info;
+  const struct antagonism_tables* tables;
+  struct scored_pair* pairs;
+  int64_t count_pairs;
+  // Shared by all threads: the next pair to score
+  int64_t* next_pair;
+};
+
+void* score_pairs(void* void_args) {
+  struct pair_block_args* args = void_args;
+  while (1) {
+    int64_t start = __sync_fetch_and_add(args->next_pair, PAIR_CHUNK);
+    if (start >= args->count_pairs) {
+      break;
+    }
+    int64_t end = start + PAIR_CHUNK < args->count_pairs ? start + PAIR_CHUNK : args->count_pairs;
+    for (int64_t i = start; i < end; ++i) {
+      args->pairs[i].antagonism
+	= table_user_antagonism(args->mmap_info, args->tables,
+				args->pairs[i].first_user, args->pairs[i].second_user);
+    }
+  }
+  return NULL;
+}
+
+/* Lines of a pairs file, read directly from its descriptor so that
+   we can tell whether more input is ready without blocking. */
+struct pair_reader {
+  int fd;
+  char buffer[PAIR_READ_BYTES + 1];
+  // Unread input is buffer[start] to buffer[end]
+  int64_t start;
+  int64_t end;
+  int at_eof;
+  int64_t line_number;
+};
+
+void open_pair_reader(struct pair_reader* reader, const char* file_name) {
+  reader->fd = strcmp(file_name, "-") == 0 ? STDIN_FILENO : open(file_name, O_RDONLY);
+  if (reader->fd < 0) {
+    fprintf(stderr, "Could not open %s\n", file_name);
+    exit(1);
+  }
+  reader->start = 0;
+  reader->end = 0;
+  reader->at_eof = 0;
+  reader->line_number = 0;
+}
+
+void close_pair_reader(struct pair_reader* reader) {
+  if (reader->fd != STDIN_FILENO) {
+    close(reader->fd);
+  }
+}
+
+// 1 if reading the next line would not block
+int pair_input_ready(struct pair_reader* reader) {
+  if (reader->start < reader->end || reader->at_eof) {
+    return 1;
+  }
+  struct pollfd poll_fd = {reader->fd, POLLIN, 0};
+  return poll(&poll_fd, 1, 0) > 0;
+}
+
+/* The next line (without its newline, and NUL terminated), or NULL at
+   the end of the input. It is overwritten by the next call. */
+char* next_pair_line(struct pair_reader* reader) {
+  while (1) {
+    char* line = reader->buffer + reader->start;
+    int64_t unread = reader->end - reader->start;
+    char* newline = memchr(line, '\n', unread);
+    if (newline != NULL) {
+      *newline = '\0';
+      reader->start += newline + 1 - line;
+      reader->line_number++;
+      return line;
+    }
+    if (reader->at_eof) {
+      if (unread == 0) {
+	return NULL;
+      }
+      // The last line has no newline
+      line[unread] = '\0';
+      reader->start = reader->end;
+      reader->line_number++;
+      return line;
+    }
+    memmove(reader->buffer, line, unread);
+    reader->end -= reader->start;
+    reader->start = 0;
+    if (reader->end == PAIR_READ_BYTES) {
+      fprintf(stderr, "Line %" PRId64 " of the pairs is too long\n", reader->line_number + 1);
+      exit(1);
+    }
+    ssize_t count_read = read(reader->fd, reader->buffer + reader->end,
+			      PAIR_READ_BYTES - reader->end);
+    if (count_read < 0) {
+      fprintf(stderr, "Could not read the pairs\n");
+      exit(1);
+    }
+    reader->end += count_read;
+    reader->at_eof = (count_read == 0);
+  }
+}
+
+/* Read up to PAIR_BLOCK pairs, checking the user IDs, but stop early
+   (once there is at least one) rather than wait for more input.
+   Blank lines are skipped. Returns the number read (0 at the end of
+   the input). */
+int64_t read_pair_block(struct pair_reader* reader, int64_t num_users,
+			struct scored_pair* pairs) {
+  int64_t count = 0;
+  while (count < PAIR_BLOCK && (count == 0 || pair_input_ready(reader))) {
+    char* line = next_pair_line(reader);
+    if (line == NULL) {
+      break;
+    }
+    char rest;
+    int count_read = sscanf(line, "%" SCNd64 " %" SCNd64 " %c", &(pairs[count].first_user),
+			    &(pairs[count].second_user), &rest);
+    if (count_read == EOF) {
+      // Blank line
+      continue;
+    }
+    if (count_read != 2) {
+      fprintf(stderr, "Bad line %" PRId64 " of the pairs: %s\n", reader->line_number, line);
+      exit(1);
+    }
+    if (pairs[count].first_user < 0 || pairs[count].first_user >= num_users
+	|| pairs[count].second_user < 0 || pairs[count].second_user >= num_users) {
+      fprintf(stderr, "Bad user pair %" PRId64 " %" PRId64 "\n",
+	      pairs[count].first_user, pairs[count].second_user);
+      exit(1);
+    }
+    ++count;
+  }
+  return count;
+}
+
+/* Replace the current assignments (and indexes) with saved_assignment,
+   as described above. */
+void use_saved_assignment(struct mmap_info* mmap_info, int num_threads,
+			  const char* saved_assignment, const char* sample_arg) {
+  if (strcmp(saved_assignment, "_") == 0) {
+    return;
+  }
+  struct sample_threads sample_threads;
+  initialize_threads(&sample_threads, num_threads, mmap_info);
+  if (is_snapshot_file(saved_assignment)) {
+    struct snapshot_reader snapshot_reader;
+    open_snapshot_reader(&snapshot_reader, saved_assignment);
+    int64_t count_samples = snapshot_reader.header->count_samples;
+    int64_t sample_num = sample_arg != NULL ? atoll(sample_arg) : count_samples - 1;
+    if (sample_num < 0 || sample_num >= count_samples) {
+      fprintf(stderr, "%s has %" PRId64 " samples\n", saved_assignment, count_samples);
+      exit(1);
+    }
+    restore_changes(&sample_threads, read_snapshot(&snapshot_reader, sample_num));
+    close_snapshot_reader(&snapshot_reader);
+  } else {
+    int64_t assignment_mmap_size;
+    char* assignments = open_mmap_read(saved_assignment, &assignment_mmap_size);
+    restore_changes(&sample_threads,
+		    (struct revision_assignment*)(assignments
+						  + sizeof(struct revision_assignment_header)));
+    munmap(assignments, assignment_mmap_size);
+  }
+  destroy_threads(&sample_threads);
+}
+
+void compare_pairs(struct mmap_info* mmap_info, struct pair_reader* reader, int num_threads) {
+  const struct user_topic_header* user_topic_header
+    = (const struct user_topic_header*)mmap_info->user_topic_mmap;
+  struct antagonism_tables antagonism_tables;
+  init_antagonism_tables(mmap_info, &antagonism_tables);
+  fill_antagonism_tables(mmap_info, &antagonism_tables);
+  struct scored_pair* pairs = malloc(sizeof(struct scored_pair) * PAIR_BLOCK);
+  assert(pairs != NULL);
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  int64_t count_pairs;
+  while ((count_pairs = read_pair_block(reader, user_topic_header->num_users, pairs)) > 0) {
+    int64_t next_pair = 0;
+    struct pair_block_args args = {mmap_info, &antagonism_tables, pairs, count_pairs,
+				   &next_pair};
+    for (int i = 0; i < num_threads; ++i) {
+      pthread_create(threads + i, NULL, score_pairs, (void*)&args);
+    }
+    void* res;
+    for (int i = 0; i < num_threads; ++i) {
+      pthread_join(threads[i], &res);
+    }
+    for (int64_t i = 0; i < count_pairs; ++i) {
+      printf("%" PRId64 " %" PRId64 " %lf", pairs[i].first_user, pairs[i].second_user,
+	     pairs[i].antagonism);
+      const char* first_name = get_user_name(mmap_info, pairs[i].first_user);
+      const char* second_name = get_user_name(mmap_info, pairs[i].second_user);
+      if (first_name != NULL && second_name != NULL) {
+	printf("\t%s\t%s", first_name, second_name);
+      }
+      printf("\n");
+    }
+    fflush(stdout);
+  }
+  free(threads);
+  free(pairs);
+  free_antagonism_tables(&antagonism_tables);
+}
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    printf("Usage: %s mmap_directory first_user second_user\n",
-           argv[0]);
+  if (argc != 4 && argc != 5 && argc != 6) {
+    printf("Usage: %s mmap_directory first_user second_user\n"
+	   "       %s mmap_directory pairs_file threads saved_assignment [sample]\n",
+	   argv[0], argv[0]);
     exit(1);
   }
   struct mmap_info mmap_info = open_mmaps_readonly(argv[1]);
-  int first_user = atoi(argv[2]);
-  int second_user = atoi(argv[3]);
-  printf("%lf\n", user_antagonism(&mmap_info, first_user, second_user));
+  if (argc == 4) {
+    int first_user = atoi(argv[2]);
+    int second_user = atoi(argv[3]);
+    printf("%lf\n", user_antagonism(&mmap_info, first_user, second_user));
+    close_mmaps(mmap_info);
+    return 0;
+  }
+  int num_threads = atoi(argv[3]);
+  assert(num_threads > 0);
+  use_saved_assignment(&mmap_info, num_threads, argv[4], argc == 6 ? argv[5] : NULL);
+  struct pair_reader* reader = malloc(sizeof(struct pair_reader));
+  assert(reader != NULL);
+  open_pair_reader(reader, argv[2]);
+  compare_pairs(&mmap_info, reader, num_threads);
+  close_pair_reader(reader);
+  free(reader);
   close_mmaps(mmap_info);
+  return 0;
 }
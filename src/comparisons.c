@@ -1,7 +1,8 @@
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
-#include <strings.h>
+#include <string.h>
 
 #include "comparisons.h"
 #include "index.h"
@@ -55,15 +56,51 @@ void init_pov_workspace(const struct mmap_info* mmap_info,
 			struct pov_workspace* pov_workspace) {
   struct revision_assignment_header* revision_assignment_header
     = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
-  pov_workspace->pov_edit_counts = malloc(sizeof(int64_t)
-					  * revision_assignment_header->num_topics
-					  * revision_assignment_header->pov_per_topic);
+  int64_t cells = (int64_t)revision_assignment_header->num_topics
+    * revision_assignment_header->pov_per_topic;
+  pov_workspace->pov_edit_counts = calloc(cells, sizeof(int64_t));
+  pov_workspace->touched_cells = malloc(sizeof(int32_t) * cells);
+  pov_workspace->count_touched = 0;
 }
 
 void free_pov_workspace(struct pov_workspace* pov_workspace) {
   free(pov_workspace->pov_edit_counts);
+  free(pov_workspace->touched_cells);
 }
- 
+
+void count_cell(struct pov_workspace* pov_workspace, int32_t cell) {
+  if (pov_workspace->pov_edit_counts[cell]++ == 0) {
+    pov_workspace->touched_cells[pov_workspace->count_touched++] = cell;
+  }
+}
+
+/* Find the most frequent cell (the first, in topic/POV order, if
+   there is a tie) and the entropy of the counts, then reset them. */
+void finish_cell_counts(struct pov_workspace* pov_workspace, int pov_per_topic,
+			int64_t count_revisions, int64_t* count_on_max,
+			int* max_topic, int* max_pov, double* entropy) {
+  int32_t max_cell = -1;
+  *count_on_max = 0;
+  *entropy = 0.0;
+  for (int32_t i = 0; i < pov_workspace->count_touched; ++i) {
+    int32_t cell = pov_workspace->touched_cells[i];
+    int64_t current_count = pov_workspace->pov_edit_counts[cell];
+    double count_fraction = (double)current_count / (double)count_revisions;
+    *entropy -= count_fraction * log(count_fraction);
+    if (current_count > *count_on_max
+	|| (current_count == *count_on_max && cell < max_cell)) {
+      *count_on_max = current_count;
+      max_cell = cell;
+    }
+    pov_workspace->pov_edit_counts[cell] = 0;
+  }
+  pov_workspace->count_touched = 0;
+  if (max_cell >= 0) {
+    *max_topic = max_cell / pov_per_topic;
+    *max_pov = max_cell % pov_per_topic;
+  }
+}
+
 void edits_on_max_pov(const struct mmap_info* mmap_info, 
 		      struct pov_workspace* pov_workspace,
 		      const int64_t* revision_ids,
@@ -71,35 +108,18 @@ void edits_on_max_pov(const struct mmap_info* mmap_info,
 		      int64_t* count_on_max, 
 		      int* max_topic, int* max_pov,
 		      double* entropy) {
- struct revision_assignment_header* revision_assignment_header
+  struct revision_assignment_header* revision_assignment_header
     = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
-  bzero(pov_workspace->pov_edit_counts, sizeof(int64_t)
-	  * revision_assignment_header->num_topics
-	  * revision_assignment_header->pov_per_topic);
   for (int64_t i = 0; i < count_revisions; ++i) {
     const struct revision_assignment* revision_assignment
       = get_revision_assignment(mmap_info, revision_ids[i]);
-    pov_workspace->pov_edit_counts[revision_assignment->topic
-				   * revision_assignment_header->pov_per_topic
-				   + revision_assignment->pov] += 1;
-  }
-  *count_on_max = 0;
-  *entropy = 0.0;
-  for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
-    for (int pov = 0; pov < revision_assignment_header->pov_per_topic; ++pov) {
-      int64_t current_count
-	= pov_workspace->pov_edit_counts[topic * revision_assignment_header->pov_per_topic + pov];
-      double count_fraction = (double)current_count / (double)count_revisions;
-      if (count_fraction > 0.0) {
-	*entropy -= count_fraction * log(count_fraction);
-      }
-      if (current_count > *count_on_max) {
-	*count_on_max = current_count;
-	*max_topic = topic;
-	*max_pov = pov;
-      }
+    if (revision_assignment->topic >= 0 && revision_assignment->pov >= 0) {
+      count_cell(pov_workspace, revision_assignment->topic
+		 * revision_assignment_header->pov_per_topic + revision_assignment->pov);
     }
   }
+  finish_cell_counts(pov_workspace, revision_assignment_header->pov_per_topic,
+		     count_revisions, count_on_max, max_topic, max_pov, entropy);
 }
 
 double user_antagonism(const struct mmap_info* mmap_info,
@@ -151,6 +171,96 @@ double user_antagonism(const struct mmap_info* mmap_info,
   return total_probability;
 }
 
+void init_antagonism_tables(const struct mmap_info* mmap_info,
+			    struct antagonism_tables* tables) {
+  struct revision_assignment_header* revision_assignment_header
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  const struct user_topic_header* user_topic_header
+    = (const struct user_topic_header*)mmap_info->user_topic_mmap;
+  tables->num_topics = revision_assignment_header->num_topics;
+  tables->pov_per_topic = revision_assignment_header->pov_per_topic;
+  tables->pov_antagonism = malloc(sizeof(double) * tables->num_topics
+				  * tables->pov_per_topic * tables->pov_per_topic);
+  tables->user_normalizers = malloc(sizeof(double) * user_topic_header->num_users);
+  double alpha_total = tables->num_topics * tables->pov_per_topic
+    * revision_assignment_header->alpha;
+  int64_t user_revisions;
+  for (int64_t user_id = 0; user_id < user_topic_header->num_users; ++user_id) {
+    get_user(mmap_info, user_id, &user_revisions, NULL);
+    tables->user_normalizers[user_id] = 1.0 / (user_revisions + alpha_total);
+  }
+}
+
+void free_antagonism_tables(struct antagonism_tables* tables) {
+  free(tables->pov_antagonism);
+  free(tables->user_normalizers);
+}
+
+void fill_antagonism_tables(const struct mmap_info* mmap_info,
+			    struct antagonism_tables* tables) {
+  struct revision_assignment_header* revision_assignment_header
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  int pov_per_topic = tables->pov_per_topic;
+  struct topic_summary* topic_summary;
+  struct pov_summary* pov_summary;
+  for (int topic = 0; topic < tables->num_topics; ++topic) {
+    get_topic_summary(mmap_info, topic, &topic_summary, &pov_summary, NULL);
+    double* matrix = tables->pov_antagonism + topic * pov_per_topic * pov_per_topic;
+    for (int first_pov = 0; first_pov < pov_per_topic; ++first_pov) {
+      matrix[first_pov * pov_per_topic + first_pov] = 0.0;
+      for (int second_pov = 0; second_pov < pov_per_topic; ++second_pov) {
+	if (first_pov == second_pov) {
+	  continue;
+	}
+	const struct pov_summary* first_pov_summary
+	  = get_ant_pov(mmap_info, pov_summary, first_pov, second_pov);
+	const struct pov_summary* second_pov_summary
+	  = get_ant_pov(mmap_info, pov_summary, second_pov, first_pov);
+	matrix[first_pov * pov_per_topic + second_pov]
+	  = 0.5 * (first_pov_summary->revert_count + revision_assignment_header->psi_alpha)
+	  / (first_pov_summary->revert_count + revision_assignment_header->psi_alpha
+	     + first_pov_summary->norevert_count + revision_assignment_header->psi_beta)
+	  + 0.5 * (second_pov_summary->revert_count + revision_assignment_header->psi_alpha)
+	  / (second_pov_summary->revert_count + revision_assignment_header->psi_alpha
+	     + second_pov_summary->norevert_count + revision_assignment_header->psi_beta);
+      }
+    }
+  }
+}
+
+/* The sum over topics of first times the topic's antagonism matrix
+   times second, where first and second are num_topics *
+   pov_per_topic topic/POV vectors. */
+double antagonism_product(const struct antagonism_tables* tables,
+			  const double* first, const double* second) {
+  int pov_per_topic = tables->pov_per_topic;
+  double total_probability = 0.0;
+  for (int topic = 0; topic < tables->num_topics; ++topic) {
+    const double* matrix = tables->pov_antagonism + topic * pov_per_topic * pov_per_topic;
+    const double* first_dist = first + topic * pov_per_topic;
+    const double* second_dist = second + topic * pov_per_topic;
+    for (int first_pov = 0; first_pov < pov_per_topic; ++first_pov) {
+      double row_total = 0.0;
+      for (int second_pov = 0; second_pov < pov_per_topic; ++second_pov) {
+	row_total += matrix[first_pov * pov_per_topic + second_pov] * second_dist[second_pov];
+      }
+      total_probability += first_dist[first_pov] * row_total;
+    }
+  }
+  return total_probability;
+}
+
+double table_user_antagonism(const struct mmap_info* mmap_info,
+			     const struct antagonism_tables* tables,
+			     int64_t first_user, int64_t second_user) {
+  double* first_user_dist;
+  double* second_user_dist;
+  get_user_topics(mmap_info, first_user, &first_user_dist);
+  get_user_topics(mmap_info, second_user, &second_user_dist);
+  return antagonism_product(tables, first_user_dist, second_user_dist)
+    * tables->user_normalizers[first_user] * tables->user_normalizers[second_user];
+}
+
 void count_pov_reverts(const struct mmap_info* mmap_info,
 		       const int64_t* revision_ids,
 		       int64_t count_revisions,
@@ -188,3 +298,326 @@ void count_pov_reverts(const struct mmap_info* mmap_info,
     }
   }
 }
+
+void fill_revision_stats(const struct mmap_info* mmap_info,
+			 int64_t first_revision, int64_t end_revision,
+			 struct revision_stats* revision_stats) {
+  struct revision_assignment_header* revision_assignment_header
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  for (int64_t revision_id = first_revision; revision_id < end_revision; ++revision_id) {
+    const struct revision* revision = get_revision(mmap_info, revision_id);
+    const struct revision_assignment* revision_assignment
+      = get_revision_assignment(mmap_info, revision_id);
+    struct revision_stats* stats = revision_stats + revision_id;
+    if (revision_assignment->topic >= 0 && revision_assignment->pov >= 0) {
+      stats->cell = revision_assignment->topic * revision_assignment_header->pov_per_topic
+	+ revision_assignment->pov;
+    } else {
+      stats->cell = -1;
+    }
+    stats->flags = 0;
+    if (!revision->disagrees) {
+      continue;
+    }
+    // As in count_pov_reverts
+    stats->flags |= REVISION_REVERT;
+    if (revision->parent >= 0) {
+      const struct revision_assignment* parent_assignment
+	= get_revision_assignment(mmap_info, revision->parent);
+      if (parent_assignment->topic == revision_assignment->topic
+	  && parent_assignment->pov != revision_assignment->pov) {
+	stats->flags |= REVISION_POV_REVERT;
+      }
+    }
+    if (revision->child >= 0 && get_revision(mmap_info, revision->child)->disagrees) {
+      const struct revision_assignment* child_assignment
+	= get_revision_assignment(mmap_info, revision->child);
+      if (child_assignment->topic == revision_assignment->topic
+	  && child_assignment->pov != revision_assignment->pov) {
+	stats->flags |= REVISION_POV_REVERTED;
+      }
+    }
+  }
+}
+
+void summarize_revisions(const struct mmap_info* mmap_info,
+			 struct pov_workspace* pov_workspace,
+			 const struct revision_stats* revision_stats,
+			 const int64_t* revision_ids,
+			 int64_t count_revisions,
+			 struct revision_set_stats* set_stats) {
+  struct revision_assignment_header* revision_assignment_header
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  set_stats->num_reverts = 0;
+  set_stats->num_pov_reverts = 0;
+  set_stats->num_pov_reverted = 0;
+  for (int64_t i = 0; i < count_revisions; ++i) {
+    const struct revision_stats* stats = revision_stats + revision_ids[i];
+    if (stats->cell >= 0) {
+      count_cell(pov_workspace, stats->cell);
+    }
+    set_stats->num_reverts += (stats->flags & REVISION_REVERT) != 0;
+    set_stats->num_pov_reverts += (stats->flags & REVISION_POV_REVERT) != 0;
+    set_stats->num_pov_reverted += (stats->flags & REVISION_POV_REVERTED) != 0;
+  }
+  finish_cell_counts(pov_workspace, revision_assignment_header->pov_per_topic,
+		     count_revisions, &(set_stats->count_on_max), &(set_stats->max_topic),
+		     &(set_stats->max_pov), &(set_stats->entropy));
+}
+
+void init_antagonism_search(const struct mmap_info* mmap_info,
+			    const struct antagonism_tables* tables,
+			    struct antagonism_search* search) {
+  const struct user_topic_header* user_topic_header
+    = (const struct user_topic_header*)mmap_info->user_topic_mmap;
+  int cells = tables->num_topics * tables->pov_per_topic;
+  search->tables = tables;
+  search->cells = cells;
+  search->count_groups = cells;
+  search->user_dists = malloc(sizeof(double) * cells * user_topic_header->num_users);
+  search->group_starts = calloc(cells + 1, sizeof(int64_t));
+  search->group_max = calloc(cells * cells, sizeof(double));
+  int* user_groups = malloc(sizeof(int) * user_topic_header->num_users);
+  int64_t user_revisions;
+  double* user_dist;
+  search->count_users = 0;
+  for (int64_t user_id = 0; user_id < user_topic_header->num_users; ++user_id) {
+    user_groups[user_id] = -1;
+    get_user_topics(mmap_info, user_id, &user_dist);
+    double* normalized = search->user_dists + cells * user_id;
+    int dominant = 0;
+    for (int cell = 0; cell < cells; ++cell) {
+      normalized[cell] = user_dist[cell] * tables->user_normalizers[user_id];
+      if (normalized[cell] > normalized[dominant]) {
+	dominant = cell;
+      }
+    }
+    // Users without revisions can still be queried, but are not found
+    get_user(mmap_info, user_id, &user_revisions, NULL);
+    if (user_revisions == 0) {
+      continue;
+    }
+    user_groups[user_id] = dominant;
+    search->group_starts[dominant + 1]++;
+    search->count_users++;
+    double* group_max = search->group_max + cells * dominant;
+    for (int cell = 0; cell < cells; ++cell) {
+      if (normalized[cell] > group_max[cell]) {
+	group_max[cell] = normalized[cell];
+      }
+    }
+  }
+  for (int group = 0; group < cells; ++group) {
+    search->group_starts[group + 1] += search->group_starts[group];
+  }
+  search->group_users = malloc(sizeof(int64_t) * (search->count_users + 1));
+  int64_t* positions = malloc(sizeof(int64_t) * cells);
+  memcpy(positions, search->group_starts, sizeof(int64_t) * cells);
+  for (int64_t user_id = 0; user_id < user_topic_header->num_users; ++user_id) {
+    if (user_groups[user_id] >= 0) {
+      search->group_users[positions[user_groups[user_id]]++] = user_id;
+    }
+  }
+  free(positions);
+  free(user_groups);
+}
+
+void free_antagonism_search(struct antagonism_search* search) {
+  free(search->user_dists);
+  free(search->group_starts);
+  free(search->group_users);
+  free(search->group_max);
+}
+
+/* A min-heap (by antagonism) of the best count (at most k) found. */
+struct top_k {
+  struct antagonist* heap;
+  int64_t count;
+  int64_t k;
+};
+
+// Pairs scoring at most this cannot enter the top k
+double top_k_threshold(const struct top_k* top_k) {
+  return top_k->count < top_k->k ? -1.0 : top_k->heap[0].antagonism;
+}
+
+void offer_top_k(struct top_k* top_k, int64_t first_user, int64_t second_user,
+		 double antagonism) {
+  if (antagonism <= top_k_threshold(top_k)) {
+    return;
+  }
+  int64_t position;
+  if (top_k->count < top_k->k) {
+    // Sift up from the end
+    position = top_k->count++;
+    while (position > 0 && top_k->heap[(position - 1) / 2].antagonism > antagonism) {
+      top_k->heap[position] = top_k->heap[(position - 1) / 2];
+      position = (position - 1) / 2;
+    }
+  } else {
+    // Replace the minimum and sift down
+    position = 0;
+    while (1) {
+      int64_t child = 2 * position + 1;
+      if (child >= top_k->count) {
+	break;
+      }
+      if (child + 1 < top_k->count
+	  && top_k->heap[child + 1].antagonism < top_k->heap[child].antagonism) {
+	++child;
+      }
+      if (top_k->heap[child].antagonism >= antagonism) {
+	break;
+      }
+      top_k->heap[position] = top_k->heap[child];
+      position = child;
+    }
+  }
+  top_k->heap[position].first_user = first_user;
+  top_k->heap[position].second_user = second_user;
+  top_k->heap[position].antagonism = antagonism;
+}
+
+int most_antagonistic_first(const void* first, const void* second) {
+  double difference = ((const struct antagonist*)second)->antagonism
+    - ((const struct antagonist*)first)->antagonism;
+  return (difference > 0) - (difference < 0);
+}
+
+struct group_bound {
+  int first_group;
+  int second_group;
+  double bound;
+};
+
+int largest_bound_first(const void* first, const void* second) {
+  double difference = ((const struct group_bound*)second)->bound
+    - ((const struct group_bound*)first)->bound;
+  return (difference > 0) - (difference < 0);
+}
+
+/* Score user_id against the members of group (those after user_id
+   only, if after is set), skipping the group if its bound cannot
+   beat the current top k. */
+void search_group(const struct antagonism_search* search, int64_t user_id, int group,
+		  int after, struct top_k* top_k) {
+  const double* user_dist = search->user_dists + search->cells * user_id;
+  if (antagonism_product(search->tables, user_dist, search->group_max + search->cells * group)
+      <= top_k_threshold(top_k)) {
+    return;
+  }
+  for (int64_t i = search->group_starts[group]; i < search->group_starts[group + 1]; ++i) {
+    int64_t other_user = search->group_users[i];
+    if (other_user == user_id || (after && other_user < user_id)) {
+      continue;
+    }
+    offer_top_k(top_k, user_id, other_user,
+		antagonism_product(search->tables, user_dist,
+				   search->user_dists + search->cells * other_user));
+  }
+}
+
+int64_t finish_top_k(struct top_k* top_k, struct antagonist* antagonists) {
+  memcpy(antagonists, top_k->heap, sizeof(struct antagonist) * top_k->count);
+  qsort(antagonists, top_k->count, sizeof(struct antagonist), most_antagonistic_first);
+  return top_k->count;
+}
+
+int64_t top_user_antagonists(const struct antagonism_search* search, int64_t user_id,
+			     int64_t k, struct antagonist* antagonists) {
+  struct top_k top_k = {malloc(sizeof(struct antagonist) * k), 0, k};
+  const double* user_dist = search->user_dists + search->cells * user_id;
+  struct group_bound* bounds = malloc(sizeof(struct group_bound) * search->count_groups);
+  for (int group = 0; group < search->count_groups; ++group) {
+    bounds[group].first_group = group;
+    bounds[group].bound = antagonism_product(search->tables, user_dist,
+					     search->group_max + search->cells * group);
+  }
+  qsort(bounds, search->count_groups, sizeof(struct group_bound), largest_bound_first);
+  for (int i = 0; i < search->count_groups && bounds[i].bound > top_k_threshold(&top_k); ++i) {
+    search_group(search, user_id, bounds[i].first_group, 0, &top_k);
+  }
+  int64_t count = finish_top_k(&top_k, antagonists);
+  free(bounds);
+  free(top_k.heap);
+  return count;
+}
+
+struct pair_search_args {
+  const struct antagonism_search* search;
+  const struct group_bound* bounds;
+  int64_t count_bounds;
+  int64_t* next_bound;
+  struct top_k top_k;
+};
+
+void* search_group_pairs(void* void_args) {
+  struct pair_search_args* args = void_args;
+  const struct antagonism_search* search = args->search;
+  int64_t i;
+  while ((i = __sync_fetch_and_add(args->next_bound, 1)) < args->count_bounds) {
+    const struct group_bound* bound = args->bounds + i;
+    // Bounds are sorted, so no later group pair can do better either
+    if (bound->bound <= top_k_threshold(&(args->top_k))) {
+      break;
+    }
+    for (int64_t j = search->group_starts[bound->first_group];
+	 j < search->group_starts[bound->first_group + 1]; ++j) {
+      search_group(search, search->group_users[j], bound->second_group,
+		   bound->first_group == bound->second_group, &(args->top_k));
+    }
+  }
+  return NULL;
+}
+
+int64_t top_antagonist_pairs(const struct antagonism_search* search, int64_t k,
+			     int num_threads, struct antagonist* antagonists) {
+  int64_t count_bounds = 0;
+  struct group_bound* bounds = malloc(sizeof(struct group_bound) * search->count_groups
+				      * (search->count_groups + 1) / 2);
+  for (int first_group = 0; first_group < search->count_groups; ++first_group) {
+    for (int second_group = first_group; second_group < search->count_groups; ++second_group) {
+      if (search->group_starts[first_group] == search->group_starts[first_group + 1]
+	  || search->group_starts[second_group] == search->group_starts[second_group + 1]) {
+	continue;
+      }
+      bounds[count_bounds].first_group = first_group;
+      bounds[count_bounds].second_group = second_group;
+      bounds[count_bounds].bound
+	= antagonism_product(search->tables, search->group_max + search->cells * first_group,
+			     search->group_max + search->cells * second_group);
+      ++count_bounds;
+    }
+  }
+  qsort(bounds, count_bounds, sizeof(struct group_bound), largest_bound_first);
+  int64_t next_bound = 0;
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  struct pair_search_args* args = malloc(sizeof(struct pair_search_args) * num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].search = search;
+    args[i].bounds = bounds;
+    args[i].count_bounds = count_bounds;
+    args[i].next_bound = &next_bound;
+    args[i].top_k.heap = malloc(sizeof(struct antagonist) * k);
+    args[i].top_k.count = 0;
+    args[i].top_k.k = k;
+    pthread_create(threads + i, NULL, search_group_pairs, (void*)(args + i));
+  }
+  void* res;
+  // Each thread's top k is exact for the pairs it saw; merge them
+  struct top_k top_k = {malloc(sizeof(struct antagonist) * k), 0, k};
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], &res);
+    for (int64_t j = 0; j < args[i].top_k.count; ++j) {
+      offer_top_k(&top_k, args[i].top_k.heap[j].first_user, args[i].top_k.heap[j].second_user,
+		  args[i].top_k.heap[j].antagonism);
+    }
+    free(args[i].top_k.heap);
+  }
+  int64_t count = finish_top_k(&top_k, antagonists);
+  free(top_k.heap);
+  free(args);
+  free(threads);
+  free(bounds);
+  return count;
+}
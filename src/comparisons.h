@@ -6,8 +6,38 @@
 
 struct mmap_info;
 
+/* Counts are kept at zero between uses, and only the cells touched
+   (listed in touched_cells) are reset, so small users and pages cost
+   no more than their edits. */
 struct pov_workspace {
   int64_t* pov_edit_counts;
+  int32_t* touched_cells;
+  int32_t count_touched;
+};
+
+#define REVISION_REVERT 1
+#define REVISION_POV_REVERT 2
+#define REVISION_POV_REVERTED 4
+
+/* What page and user statistics need to know about one revision:
+   its (topic, POV) cell, topic * pov_per_topic + pov (-1 if
+   unassigned), and REVISION_* flags as counted by
+   count_pov_reverts. */
+struct revision_stats {
+  int32_t cell;
+  int32_t flags;
+};
+
+/* Statistics over a set of revisions; see edits_on_max_pov and
+   count_pov_reverts. */
+struct revision_set_stats {
+  int64_t count_on_max;
+  int max_topic;
+  int max_pov;
+  double entropy;
+  int64_t num_pov_reverts;
+  int64_t num_pov_reverted;
+  int64_t num_reverts;
 };
 
 /* Compute the level of controversy for this (topic, POV), which is
@@ -26,6 +56,78 @@ void all_pov_controversy(const struct mmap_info* mmap_info,
 double user_antagonism(const struct mmap_info* mmap_info,
 		       int first_user, int second_user);
 
+/* The parts of user_antagonism that do not depend on the users, so
+   that many pairs can be scored against one sample cheaply. */
+struct antagonism_tables {
+  int num_topics;
+  int pov_per_topic;
+  /* For each topic, a pov_per_topic * pov_per_topic symmetric matrix
+     of the average smoothed revert fraction between two POVs (0 on
+     the diagonal). Depends on the sample. */
+  double* pov_antagonism;
+  /* 1 / (revisions + num_topics * pov_per_topic * alpha) for each
+     user, which does not change between samples. */
+  double* user_normalizers;
+};
+
+/* Allocate tables and compute the user normalizers. */
+void init_antagonism_tables(const struct mmap_info* mmap_info,
+			    struct antagonism_tables* tables);
+void free_antagonism_tables(struct antagonism_tables* tables);
+/* Recompute the POV antagonism matrices for the current sample. */
+void fill_antagonism_tables(const struct mmap_info* mmap_info,
+			    struct antagonism_tables* tables);
+/* user_antagonism, using tables filled for the current sample: for
+   each topic, the first user's POV distribution times the topic's
+   matrix times the second user's. */
+double table_user_antagonism(const struct mmap_info* mmap_info,
+			     const struct antagonism_tables* tables,
+			     int64_t first_user, int64_t second_user);
+
+/* Searching for the most antagonistic pairs of users without scoring
+   every pair. Users (with at least one revision) are grouped by their
+   most likely (topic, POV), and each group keeps the largest
+   normalized value of every topic/POV over its members. All terms of
+   the antagonism are nonnegative, so the score of a user against
+   these maxima bounds the score against any member, and groups are
+   searched in decreasing order of bound until no bound can beat the
+   current k-th best score. Results are exact. */
+struct antagonism_search {
+  const struct antagonism_tables* tables;
+  int cells;
+  int64_t count_users;
+  // Each user's topic/POV distribution times their normalizer
+  double* user_dists;
+  int count_groups;
+  /* Members of group g are group_users[group_starts[g]] up to
+     group_users[group_starts[g + 1] - 1]. */
+  int64_t* group_starts;
+  int64_t* group_users;
+  double* group_max;
+};
+
+struct antagonist {
+  int64_t first_user;
+  int64_t second_user;
+  double antagonism;
+};
+
+/* Build the groups for the current sample (tables must be filled). */
+void init_antagonism_search(const struct mmap_info* mmap_info,
+			    const struct antagonism_tables* tables,
+			    struct antagonism_search* search);
+void free_antagonism_search(struct antagonism_search* search);
+/* Find the (at most) k users most antagonistic towards user_id,
+   storing them (most antagonistic first, with first_user = user_id)
+   in antagonists, which must have room for k. Returns the number
+   found. */
+int64_t top_user_antagonists(const struct antagonism_search* search, int64_t user_id,
+			     int64_t k, struct antagonist* antagonists);
+/* Find the (at most) k most antagonistic pairs of distinct users,
+   using num_threads threads. As top_user_antagonists. */
+int64_t top_antagonist_pairs(const struct antagonism_search* search, int64_t k,
+			     int num_threads, struct antagonist* antagonists);
+
 /* Initialize or free a struct which contains allocated memory used
    when computing page and user statistics. */
 void init_pov_workspace(const struct mmap_info* mmap_info,
@@ -60,4 +162,22 @@ void count_pov_reverts(const struct mmap_info* mmap_info,
 		       int64_t* num_pov_reverts,
 		       int64_t* num_pov_reverted,
 		       int64_t* num_reverts);
+
+/* Fill revision_stats[i] for revisions first_revision <= i <
+   end_revision, reading revisions and assignments in storage order
+   (and each revision's parent and child). */
+void fill_revision_stats(const struct mmap_info* mmap_info,
+			 int64_t first_revision, int64_t end_revision,
+			 struct revision_stats* revision_stats);
+
+/* edits_on_max_pov and count_pov_reverts in one pass over the
+   revisions specified by revision_ids, using revision_stats (indexed
+   by revision ID) from fill_revision_stats instead of the
+   revisions and their assignments. */
+void summarize_revisions(const struct mmap_info* mmap_info,
+			 struct pov_workspace* pov_workspace,
+			 const struct revision_stats* revision_stats,
+			 const int64_t* revision_ids,
+			 int64_t count_revisions,
+			 struct revision_set_stats* set_stats);
 #endif
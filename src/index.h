@@ -41,6 +41,16 @@ struct user_index {
   int64_t revisions_offset;
 };
 
+/* String tables, mapping dense integer IDs back to the user names or
+   page titles they were interned from (see store_revisions.c). The
+   header is followed by count_strings + 1 offsets (int64_t, relative
+   to the start of the file); string i is NUL-terminated and starts at
+   offsets[i]. */
+
+struct string_table_header {
+  int64_t count_strings;
+};
+
 /* Topic/POV assignment indexes */
 
 struct revision_assignment_header {
@@ -1,28 +1,315 @@
 /* Perform a fixed number of approximate Gibbs sampling iterations,
    splitting the work between multiple threads. Optionally saves every
-   Nth sample in the mmaps directory (as
-   MMAPS_DIR/saved_assignmentsXXXXX). If compute_likelihood is 0, it
+   Nth sample in the mmaps directory (in the snapshot store
+   MMAPS_DIR/saved_assignments, see snapshots.h). Samples are written
+   by a background thread while sampling continues; the write latency
+   is reported on stderr at the end. If compute_likelihood is 0, it
    does not compute the likelihood of the data under the current
    assignments; this can save some time, but makes it difficult to
-   determine when the algorithm has converged. 
+   determine when the algorithm has converged. If compute_likelihood
+   is 1, the likelihood is computed from scratch after every
+   iteration. If it is N > 1, the likelihood is instead tracked
+   incrementally as assignments change, and only recomputed from
+   scratch every N iterations; the difference between the tracked and
+   recomputed values (accumulated floating point error) is written to
+   stderr.
+
+   If likelihood_threads is given (and compute_likelihood is 1), each
+   iteration's counts are copied and their likelihood is computed by
+   that many background threads while the next iteration is sampled.
+   Output lines are still "iteration log_likelihood", but each is
+   printed once the following iteration finishes. 
+
+   If subsample_fraction (between 0 and 1) is given, the likelihood
+   is instead estimated after every iteration from that fraction of
+   users and pages (chosen once at random, see struct
+   likelihood_subsample), and computed exactly only every
+   compute_likelihood iterations (never if it is 0). Each output line
+   is then "iteration log_likelihood half_width", where half_width is
+   the half width of a 95% confidence interval for the estimate (0 for
+   exact values).
+
+   If convergence_window (an even number, at least 4) is given,
+   iterations is instead an upper bound, and inference stops early
+   once the chain appears to have converged: over the last
+   convergence_window iterations, the likelihood (whenever it is
+   computed), the fraction of revisions whose assignment changed in
+   each sweep, and the total number of revisions assigned to each
+   topic must all show no trend. A series shows no trend when the
+   means of the first and second halves of the window differ by at
+   most CONVERGENCE_Z standard errors. The reason is printed to
+   stderr, and the mmaps are saved as usual.
+
+   If stats_file is given, a tab separated line of sampler counters is
+   appended to it after each sweep (see struct sample_stats), with a
+   header naming the columns. Lock waits are summed over threads, so
+   they can exceed the sweep time. The log_likelihood column is nan
+   when the likelihood was not computed for that iteration (including
+   when it is computed in the background). A stats_file of "-" is the
+   same as none.
+
+   If seed is given, random numbers come from counter-based streams
+   with that seed (see use_counter_rng) rather than being seeded from
+   the time, and the likelihood subsample is chosen using it. Unless
+   deterministic is 0, sweeps then also run in deterministic mode, so
+   that the same seed gives the same assignments whatever the number
+   of threads. A seed of "-" is the same as no seed.
+
+   If chains is more than 1, that many independent chains are run in
+   this process, each with threads threads. They share one copy of the
+   revision, page and user indexes. Chain 0 is the assignments in
+   mmap_directory, and chain N keeps its own assignments and indexes
+   in mmap_directory/chainNN (see open_chain_mmaps). A new chain
+   starts from fresh uniformly random assignments, so chains start far
+   apart. The likelihood of every chain is computed after each
+   sweep. It is printed as "iteration log_likelihood_0 ...
+   log_likelihood_N-1 rhat_log_likelihood max_rhat_topic_totals".
+   Each rhat is the Gelman-Rubin potential scale reduction factor over
+   the latest half of the sweeps. Topics are not labelled consistently
+   between chains, so topic totals are compared after sorting each
+   chain's totals. Chain N uses seed + N. save_every_n,
+   convergence_window, stats_file and posterior_burn_in are rejected
+   in this mode, and the other likelihood options are ignored.
+
+   If posterior_burn_in is given, running posterior sums (see
+   posterior.h) are accumulated in memory from every sample after the
+   first posterior_burn_in iterations of this run, or only every
+   save_every_n-th such sample if save_every_n is not 0. They are
+   written to MMAPS_DIR/posterior_mmap at the end, and no
+   saved_assignments snapshots are written.
 
    Topic and POV assignments must be initialized before inference is
    run for the first time. See initialize.c.*/
 
 #include <assert.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "index.h"
 #include "parse_mmaps.h"
+#include "posterior.h"
+#include "snapshots.h"
 #include "probability.h"
 #include "sample.h"
 
+#define CONVERGENCE_Z 2.0
+
+/* The last window values of a per-iteration series (a ring buffer) */
+struct convergence_series {
+  int window;
+  int64_t count;
+  double* values;
+};
+
+void init_series(struct convergence_series* series, int window) {
+  series->window = window;
+  series->count = 0;
+  series->values = malloc(sizeof(double) * window);
+  assert(series->values != NULL);
+}
+
+void add_to_series(struct convergence_series* series, double value) {
+  series->values[series->count % series->window] = value;
+  series->count++;
+}
+
+double half_window_value(const struct convergence_series* series, int first_half, int i) {
+  int half = series->window / 2;
+  return series->values[(series->count - series->window + i
+			 + (first_half ? 0 : half)) % series->window];
+}
+
+/* Two passes (mean, then squared deviations): log likelihoods are
+   large, so sum_squares - n * mean^2 would cancel catastrophically. */
+void half_window_stats(const struct convergence_series* series, int first_half,
+		       double* mean, double* variance) {
+  int half = series->window / 2;
+  double sum = 0.0;
+  for (int i = 0; i < half; ++i) {
+    sum += half_window_value(series, first_half, i);
+  }
+  *mean = sum / half;
+  double sum_deviations = 0.0;
+  for (int i = 0; i < half; ++i) {
+    double deviation = half_window_value(series, first_half, i) - *mean;
+    sum_deviations += deviation * deviation;
+  }
+  *variance = sum_deviations / (half - 1);
+}
+
+// Returns 1 if the window is full and shows no trend
+int series_stable(const struct convergence_series* series) {
+  if (series->count < series->window) {
+    return 0;
+  }
+  double first_mean, first_variance, second_mean, second_variance;
+  half_window_stats(series, 1, &first_mean, &first_variance);
+  half_window_stats(series, 0, &second_mean, &second_variance);
+  double standard_error = sqrt((first_variance + second_variance) / (series->window / 2));
+  return fabs(second_mean - first_mean) <= CONVERGENCE_Z * standard_error;
+}
+
+struct chain {
+  struct mmap_info mmap_info;
+  struct sample_threads sample_threads;
+  pthread_t thread;
+  int64_t first_iteration;
+  /* For each sweep of this run, the log likelihood followed by the topic totals
+     in increasing order. */
+  double* history;
+};
+
+int compare_doubles(const void* first, const void* second) {
+  double difference = *(const double*)first - *(const double*)second;
+  return (difference > 0) - (difference < 0);
+}
+
+void* chain_sweep(void* void_chain) {
+  struct chain* chain = void_chain;
+  struct revision_assignment_header* revision_assignment_header
+    = (struct revision_assignment_header*)chain->mmap_info.revision_assignment_mmap;
+  resample(&(chain->sample_threads));
+  int64_t iteration = revision_assignment_header->total_iterations++;
+  double* values = chain->history + (iteration - chain->first_iteration)
+    * (1 + revision_assignment_header->num_topics);
+  values[0] = parallel_log_likelihood(&(chain->sample_threads));
+  struct topic_summary* topic_summary;
+  for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
+    get_topic_summary(&(chain->mmap_info), topic, &topic_summary, NULL, NULL);
+    values[1 + topic] = topic_summary->total_revisions;
+  }
+  qsort(values + 1, revision_assignment_header->num_topics, sizeof(double), compare_doubles);
+  return NULL;
+}
+
+/* Gelman-Rubin R-hat for the value at offset in each sweep, using the
+   latest half of sweeps_done sweeps. Needs at least 4 sweeps. */
+double potential_scale_reduction(const struct chain* chains, int num_chains, int sweeps_done,
+				 int width, int offset) {
+  int n = sweeps_done / 2;
+  assert(n >= 2);
+  double within = 0.0;
+  double mean_of_means = 0.0;
+  double* means = malloc(sizeof(double) * num_chains);
+  for (int c = 0; c < num_chains; ++c) {
+    const double* history = chains[c].history;
+    double sum = 0.0;
+    for (int i = sweeps_done - n; i < sweeps_done; ++i) {
+      sum += history[i * width + offset];
+    }
+    means[c] = sum / n;
+    // Squared deviations, as log likelihoods are too large for sum_squares - n * mean^2
+    double sum_deviations = 0.0;
+    for (int i = sweeps_done - n; i < sweeps_done; ++i) {
+      double deviation = history[i * width + offset] - means[c];
+      sum_deviations += deviation * deviation;
+    }
+    within += sum_deviations / (n - 1) / num_chains;
+    mean_of_means += means[c] / num_chains;
+  }
+  double between = 0.0;
+  for (int c = 0; c < num_chains; ++c) {
+    between += n * (means[c] - mean_of_means) * (means[c] - mean_of_means) / (num_chains - 1);
+  }
+  free(means);
+  if (within <= 0.0) {
+    // Every chain is stuck; only agreement between them matters
+    return between <= 0.0 ? 1.0 : HUGE_VAL;
+  }
+  return sqrt(((n - 1.0) / n * within + between / n) / within);
+}
+
+void run_chains(const char* directory, struct mmap_info* shared, int num_chains,
+		int do_iterations, int num_threads, int use_seed, uint64_t seed,
+		int deterministic) {
+  struct revision_assignment_header* revision_assignment_header
+    = (struct revision_assignment_header*)shared->revision_assignment_mmap;
+  int width = 1 + revision_assignment_header->num_topics;
+  struct chain* chains = malloc(sizeof(struct chain) * num_chains);
+  char chain_name[16];
+  for (int c = 0; c < num_chains; ++c) {
+    int created = 0;
+    if (c == 0) {
+      chains[c].mmap_info = *shared;
+    } else {
+      snprintf(chain_name, sizeof(chain_name), "chain%.2d", c);
+      char* chain_directory = full_path(directory, chain_name);
+      chains[c].mmap_info = open_chain_mmaps(shared, chain_directory, &created);
+      free(chain_directory);
+    }
+    struct revision_assignment_header* chain_header
+      = (struct revision_assignment_header*)chains[c].mmap_info.revision_assignment_mmap;
+    if (created) {
+      // Forget the copied assignments (before threads copy the index)
+      memset(chains[c].mmap_info.topic_index_mmap + sizeof(struct topic_summary_header), 0,
+	     chains[c].mmap_info.topic_index_mmap_size - sizeof(struct topic_summary_header));
+      chain_header->total_iterations = 0;
+    }
+    initialize_threads(&(chains[c].sample_threads), num_threads, &(chains[c].mmap_info));
+    if (use_seed) {
+      use_counter_rng(&(chains[c].sample_threads), seed + c, deterministic);
+    } else {
+      offset_thread_seeds(&(chains[c].sample_threads), c);
+    }
+    if (created) {
+      parallel_initialize_user_topics(&(chains[c].sample_threads));
+      resample_null(&(chains[c].sample_threads));
+      resample_uniform(&(chains[c].sample_threads));
+    }
+    chains[c].history = malloc(sizeof(double) * (int64_t)do_iterations * width);
+    assert(chains[c].history != NULL);
+    chains[c].first_iteration = chain_header->total_iterations;
+  }
+
+  for (int it_num = 0; it_num < do_iterations; ++it_num) {
+    for (int c = 0; c < num_chains; ++c) {
+      pthread_create(&(chains[c].thread), NULL, chain_sweep, (void*)(chains + c));
+    }
+    void* res;
+    for (int c = 0; c < num_chains; ++c) {
+      pthread_join(chains[c].thread, &res);
+    }
+    printf("%" PRId64, revision_assignment_header->total_iterations);
+    for (int c = 0; c < num_chains; ++c) {
+      printf(" %lf", chains[c].history[it_num * width]);
+    }
+    if ((it_num + 1) / 2 < 2) {
+      // Too few sweeps for within-chain variances
+      printf(" nan nan\n");
+    } else {
+      double max_topic_rhat = 0.0;
+      for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
+	double rhat = potential_scale_reduction(chains, num_chains, it_num + 1, width, 1 + topic);
+	if (rhat > max_topic_rhat) {
+	  max_topic_rhat = rhat;
+	}
+      }
+      printf(" %lf %lf\n", potential_scale_reduction(chains, num_chains, it_num + 1, width, 0),
+	     max_topic_rhat);
+    }
+    fflush(stdout);
+  }
+
+  for (int c = 0; c < num_chains; ++c) {
+    destroy_threads(&(chains[c].sample_threads));
+    free(chains[c].history);
+    if (c != 0) {
+      close_mmaps(chains[c].mmap_info);
+    }
+  }
+  free(chains);
+}
+
 int main(int argc, char **argv) {
-  if (argc < 4 || argc > 6) {
-    printf("Usage: %s mmap_directory iterations threads [save_every_n] [compute_likelihood]\n",
+  if (argc < 4 || argc > 14) {
+    printf("Usage: %s mmap_directory iterations threads [save_every_n] [compute_likelihood] "
+	   "[likelihood_threads] [subsample_fraction] [convergence_window] [stats_file] "
+	   "[seed] [deterministic] [chains] [posterior_burn_in]\n",
            argv[0]);
     exit(1);
   }
@@ -38,6 +325,69 @@ int main(int argc, char **argv) {
   } else {
     compute_likelihood = 1;
   }
+  int likelihood_threads;
+  if (argc >= 7) {
+    likelihood_threads = atoi(argv[6]);
+  } else {
+    likelihood_threads = 0;
+  }
+  double subsample_fraction;
+  if (argc >= 8) {
+    subsample_fraction = atof(argv[7]);
+  } else {
+    subsample_fraction = 1.0;
+  }
+  if (subsample_fraction <= 0.0 || subsample_fraction > 1.0) {
+    fprintf(stderr, "subsample_fraction must be greater than 0 and at most 1\n");
+    exit(1);
+  }
+  int subsample_likelihood = (subsample_fraction < 1.0);
+  int convergence_window;
+  if (argc >= 9) {
+    convergence_window = atoi(argv[8]);
+  } else {
+    convergence_window = 0;
+  }
+  if (convergence_window != 0 && (convergence_window < 4 || convergence_window % 2 != 0)) {
+    fprintf(stderr, "convergence_window must be 0, or an even number of at least 4\n");
+    exit(1);
+  }
+  int use_stats_file = (argc >= 10 && strcmp(argv[9], "-") != 0);
+  int use_seed = (argc >= 11 && strcmp(argv[10], "-") != 0);
+  uint64_t seed = use_seed ? strtoull(argv[10], NULL, 10) : 0;
+  int num_chains;
+  if (argc >= 13) {
+    num_chains = atoi(argv[12]);
+  } else {
+    num_chains = 1;
+  }
+  if (num_chains > 1) {
+    if (save_every_n != 0 || convergence_window != 0 || use_stats_file || argc >= 14) {
+      fprintf(stderr, "save_every_n, convergence_window, stats_file and posterior_burn_in "
+	      "are not supported with more than one chain\n");
+      exit(1);
+    }
+    struct mmap_info shared = open_mmaps_memory(argv[1]);
+    int deterministic = 1;
+    if (argc >= 12) {
+      deterministic = atoi(argv[11]);
+    }
+    run_chains(argv[1], &shared, num_chains, atoi(argv[2]), atoi(argv[3]),
+	       use_seed, seed, deterministic);
+    close_mmaps(shared);
+    return 0;
+  }
+  FILE* stats_file = NULL;
+  if (use_stats_file) {
+    stats_file = fopen(argv[9], "w");
+    if (stats_file == NULL) {
+      fprintf(stderr, "Could not open stats file %s\n", argv[9]);
+      exit(1);
+    }
+    fprintf(stats_file, "iteration\tseconds\trevisions_per_second\tchanged_fraction\tpages"
+	    "\tuser_lock_seconds\tqueue_lock_seconds\treplayed_updates\tmax_queue_lag"
+	    "\tmin_thread_seconds\tmax_thread_seconds\tlog_likelihood\n");
+  }
   struct mmap_info mmap_info = open_mmaps_memory(argv[1]);
   struct revision_assignment_header* revision_assignment_header
     = (struct revision_assignment_header*)mmap_info.revision_assignment_mmap;
@@ -46,25 +396,201 @@ int main(int argc, char **argv) {
 
   struct sample_threads sample_threads;
   initialize_threads(&sample_threads, num_threads, &mmap_info);
+  sample_threads.time_locks = (stats_file != NULL);
+  if (use_seed) {
+    int deterministic = 1;
+    if (argc >= 12) {
+      deterministic = atoi(argv[11]);
+    }
+    use_counter_rng(&sample_threads, seed, deterministic);
+  }
+
+  struct likelihood_subsample likelihood_subsample;
+  if (subsample_likelihood) {
+    // A seeded run picks the same subsample every time
+    init_likelihood_subsample(&mmap_info, subsample_fraction, use_seed ? seed : time(NULL),
+			      &likelihood_subsample);
+  } else if (compute_likelihood > 1) {
+    start_likelihood_tracking(&sample_threads);
+  }
+  struct likelihood_snapshot likelihood_snapshot;
+  int async_likelihood = (!subsample_likelihood && compute_likelihood == 1
+			  && likelihood_threads > 0);
+  if (async_likelihood) {
+    init_likelihood_snapshot(&likelihood_snapshot, &sample_threads, likelihood_threads);
+  }
+  int64_t likelihood_iteration;
+  double log_likelihood;
+  double half_width;
+  struct convergence_series likelihood_series;
+  struct convergence_series changed_series;
+  struct convergence_series* topic_series = NULL;
+  if (convergence_window > 0) {
+    init_series(&likelihood_series, convergence_window);
+    init_series(&changed_series, convergence_window);
+    topic_series = malloc(sizeof(struct convergence_series)
+			  * revision_assignment_header->num_topics);
+    for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
+      init_series(topic_series + topic, convergence_window);
+    }
+  }
+
+  int posterior_burn_in = -1;
+  char* posterior = NULL;
+  int64_t posterior_size;
+  if (argc >= 14) {
+    posterior_burn_in = atoi(argv[13]);
+    assert(posterior_burn_in >= 0);
+    posterior = create_posterior(&mmap_info, &posterior_size);
+  }
 
-  char* saved_revisions_base = full_path(argv[1], "saved_assignments00000");
-  char* counter_position = saved_revisions_base + strlen(saved_revisions_base) - 5;
+  struct async_snapshot_writer snapshot_writer;
+  int save_snapshots = (posterior == NULL && save_every_n != 0);
+  if (save_snapshots) {
+    char* snapshot_name = full_path(argv[1], "saved_assignments");
+    start_async_snapshot_writer(&snapshot_writer, snapshot_name, &mmap_info,
+				SNAPSHOT_KEYFRAME_INTERVAL, SNAPSHOT_BUFFERS);
+    free(snapshot_name);
+  }
   for (int it_num = 0; it_num < do_iterations; ++it_num) {
     resample(&sample_threads);
     revision_assignment_header->total_iterations++;
-    if (save_every_n != 0 && it_num % save_every_n == 0) {
-      snprintf(counter_position, 6,
-	       "%.5d", it_num / save_every_n);
-      write_file(saved_revisions_base, 
-		 mmap_info.revision_assignment_mmap, 
-		 mmap_info.revision_assignment_mmap_size);
-    }
-    if (compute_likelihood != 0) {
+    double iteration_likelihood = NAN;
+    if (posterior != NULL) {
+      if (it_num >= posterior_burn_in
+	  && (save_every_n == 0 || (it_num - posterior_burn_in) % save_every_n == 0)) {
+	add_posterior_sample(posterior, &mmap_info, num_threads);
+      }
+    } else if (save_snapshots && it_num % save_every_n == 0) {
+      queue_snapshot(&snapshot_writer,
+		     (struct revision_assignment*)(mmap_info.revision_assignment_mmap
+						   + sizeof(struct revision_assignment_header)),
+		     revision_assignment_header->total_iterations);
+    }
+    if (subsample_likelihood) {
+      if (compute_likelihood > 0 && (it_num + 1) % compute_likelihood == 0) {
+	log_likelihood = parallel_log_likelihood(&sample_threads);
+	half_width = 0.0;
+      } else {
+	log_likelihood = estimate_log_likelihood(&sample_threads, &likelihood_subsample,
+						 &half_width);
+      }
+      printf("%" PRId64 " %lf %lf\n", revision_assignment_header->total_iterations, 
+	     log_likelihood, half_width);
+      iteration_likelihood = log_likelihood;
+      if (convergence_window > 0) {
+	add_to_series(&likelihood_series, log_likelihood);
+      }
+    } else if (async_likelihood) {
+      if (finish_async_log_likelihood(&likelihood_snapshot, &likelihood_iteration,
+				      &log_likelihood)) {
+	printf("%" PRId64 " %lf\n", likelihood_iteration, log_likelihood);
+	fflush(stdout);
+	if (convergence_window > 0) {
+	  add_to_series(&likelihood_series, log_likelihood);
+	}
+      }
+      start_async_log_likelihood(&sample_threads, &likelihood_snapshot,
+				 revision_assignment_header->total_iterations);
+    } else if (compute_likelihood == 1) {
+      log_likelihood = parallel_log_likelihood(&sample_threads);
+      printf("%" PRId64 " %lf\n", revision_assignment_header->total_iterations, 
+	     log_likelihood);
+      iteration_likelihood = log_likelihood;
+      if (convergence_window > 0) {
+	add_to_series(&likelihood_series, log_likelihood);
+      }
+    } else if (compute_likelihood > 1) {
+      log_likelihood = tracked_log_likelihood(&sample_threads);
+      if ((it_num + 1) % compute_likelihood == 0) {
+	double tracked = log_likelihood;
+	log_likelihood = start_likelihood_tracking(&sample_threads);
+	fprintf(stderr, "%" PRId64 " tracked %lf exact %lf drift %g\n",
+		revision_assignment_header->total_iterations,
+		tracked, log_likelihood, tracked - log_likelihood);
+      }
       printf("%" PRId64 " %lf\n", revision_assignment_header->total_iterations, 
-	     parallel_log_likelihood(&sample_threads));
+	     log_likelihood);
+      iteration_likelihood = log_likelihood;
+      if (convergence_window > 0) {
+	add_to_series(&likelihood_series, log_likelihood);
+      }
+    }
+    if (stats_file != NULL) {
+      const struct sample_stats* stats = &(sample_threads.stats);
+      fprintf(stats_file, "%" PRId64 "\t%lf\t%lf\t%lf\t%" PRId64 "\t%lf\t%lf\t%" PRId64
+	      "\t%" PRId64 "\t%lf\t%lf\t%lf\n",
+	      revision_assignment_header->total_iterations, sample_threads.sweep_seconds,
+	      stats->revisions / sample_threads.sweep_seconds,
+	      (double)stats->changed_revisions / stats->revisions, stats->pages,
+	      stats->user_lock_seconds, stats->queue_lock_seconds, stats->replayed_updates,
+	      stats->max_queue_lag, stats->min_thread_seconds, stats->max_thread_seconds,
+	      iteration_likelihood);
+      fflush(stats_file);
+    }
+    if (convergence_window > 0) {
+      double changed_fraction = (double)sample_threads.stats.changed_revisions
+	/ revision_assignment_header->count_revisions;
+      add_to_series(&changed_series, changed_fraction);
+      int stable = series_stable(&changed_series);
+      struct topic_summary* topic_summary;
+      for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
+	get_topic_summary(&mmap_info, topic, &topic_summary, NULL, NULL);
+	add_to_series(topic_series + topic, topic_summary->total_revisions);
+	stable = stable && series_stable(topic_series + topic);
+      }
+      int likelihood_computed = (compute_likelihood != 0 || subsample_likelihood);
+      if (likelihood_computed) {
+	stable = stable && series_stable(&likelihood_series);
+      }
+      if (stable) {
+	fprintf(stderr, "Converged after %" PRId64 " iterations: %schanged revision fraction "
+		"(%g) and topic totals show no trend over the last %d iterations\n",
+		revision_assignment_header->total_iterations,
+		likelihood_computed ? "log likelihood, " : "",
+		changed_fraction, convergence_window);
+	break;
+      }
+    }
+  }
+  if (async_likelihood) {
+    if (finish_async_log_likelihood(&likelihood_snapshot, &likelihood_iteration,
+				    &log_likelihood)) {
+      printf("%" PRId64 " %lf\n", likelihood_iteration, log_likelihood);
+    }
+    destroy_likelihood_snapshot(&likelihood_snapshot);
+  }
+  if (subsample_likelihood) {
+    free_likelihood_subsample(&likelihood_subsample);
+  }
+  if (convergence_window > 0) {
+    free(likelihood_series.values);
+    free(changed_series.values);
+    for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
+      free(topic_series[topic].values);
+    }
+    free(topic_series);
+  }
+  if (stats_file != NULL) {
+    fclose(stats_file);
+  }
+  if (posterior != NULL) {
+    char* posterior_name = full_path(argv[1], "posterior_mmap");
+    write_file(posterior_name, posterior, posterior_size);
+    fprintf(stderr, "Wrote %" PRId64 " posterior samples to %s\n",
+	    ((struct posterior_header*)posterior)->samples, posterior_name);
+    free(posterior_name);
+    free(posterior);
+  }
+  if (save_snapshots) {
+    finish_async_snapshot_writer(&snapshot_writer);
+    if (snapshot_writer.written > 0) {
+      fprintf(stderr, "Wrote %" PRId64 " snapshots: mean latency %lf s, max %lf s, "
+	      "sampling blocked %lf s\n", snapshot_writer.written,
+	      snapshot_writer.total_latency / snapshot_writer.written,
+	      snapshot_writer.max_latency, snapshot_writer.blocked_seconds);
     }
   }
-  free(saved_revisions_base);
   destroy_threads(&sample_threads);
   close_mmaps(mmap_info);
 }
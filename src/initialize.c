@@ -1,6 +1,9 @@
 /* Initialize topic and POV assignments uniformly at random, and set
    various hyper-parameters needed for inference. Assignments must be
-   initialized before doing inference for the first time. */
+   initialized before doing inference for the first time. If seed is
+   given, assignments are drawn from counter-based random streams
+   with that seed (see use_counter_rng), so they do not depend on the
+   time or the number of threads. */
 
 #include <assert.h>
 #include <gsl/gsl_rng.h>
@@ -13,9 +16,9 @@
 #include "sample.h"
 
 int main(int argc, char **argv) {
-  if (argc != 11) {
+  if (argc != 11 && argc != 12) {
     printf("Usage: %s mmap_directory num_topics pov_per_topic num_threads psi_alpha "
-	   "psi_beta gamma_alpha gamma_beta beta alpha\n",
+	   "psi_beta gamma_alpha gamma_beta beta alpha [seed]\n",
            argv[0]);
     exit(1);
   }
@@ -42,6 +45,9 @@ int main(int argc, char **argv) {
 
   struct sample_threads sample_threads;
   initialize_threads(&sample_threads, num_threads, &mmap_info);
+  if (argc >= 12) {
+    use_counter_rng(&sample_threads, strtoull(argv[11], &endptr, 10), 0);
+  }
   resample_null(&sample_threads);
   resample_uniform(&sample_threads);
 
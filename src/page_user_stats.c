@@ -2,8 +2,16 @@
    across one or more posterior samples. These are saved to
    pages_stats.txt, users_stats.txt, and user_comparisons.txt in the
    current directory. Typically the assignments (posterior samples)
-   will come those saved using inference.c. Does not modify the
-   current mmaps.*/
+   will come those saved using inference.c: each saved_assignment
+   argument may be a snapshot store (see snapshots.h), all of whose
+   samples are used, or a single raw copy of revision_assignment_mmap.
+   If the first is "_", the current assignments are used as one
+   sample. user_pairs_file is either a text file of "first_user
+   second_user" lines, or a revert graph built by build_revert_graph,
+   in which case every edge (reverting user, reverted user) is scored.
+   Does not modify the current mmaps. If revisions were stored with
+   string identifiers, user names and page titles are appended to each
+   line (tab separated).*/
 
 #include <assert.h>
 #include <inttypes.h>
@@ -17,9 +25,14 @@
 #include "index.h"
 #include "parse_mmaps.h"
 #include "probability.h"
+#include "revert_graph.h"
 #include "sample.h"
+#include "snapshots.h"
 
 #define NON_VAR_ARGS 4
+// Revisions per work item when filling revision stats
+#define REVISION_BLOCK 4096
+#define CHUNKS_PER_THREAD 16
 
 struct user_pair_stats {
   int64_t first_user;
@@ -44,49 +57,144 @@ struct page_user_stats {
   double entropy;
 };
 
+/* Shared by the passes over one sample: revision stats are filled in
+   storage order, then users (indexes below num_users) and pages
+   (num_users and above) are summarized from them in one pass. */
+struct sample_stats_data {
+  struct revision_stats* revision_stats;
+  int64_t count_revisions;
+  struct page_user_stats* user_stats;
+  struct page_user_stats* page_stats;
+  int64_t num_users;
+};
+
+/* A division of indexes 0..max_val-1 into chunks of roughly equal
+   total weight (such as revision counts), about CHUNKS_PER_THREAD per
+   thread. An item heavier than that gets a chunk to itself. Chunks
+   are handed out heaviest first from a shared cursor, so a thread
+   that draws a power editor simply takes fewer chunks. Built once per
+   phase and reused for every sample; busy and wall clock time are
+   summed over calls to report utilization. */
+struct work_schedule {
+  const char* name;
+  // Chunk i covers indexes chunk_starts[i] to chunk_ends[i] - 1
+  int64_t* chunk_starts;
+  int64_t* chunk_ends;
+  int64_t count_chunks;
+  double wall_seconds;
+  double busy_seconds;
+};
+
+struct pair_stats_data {
+  struct user_pair_stats* user_pair_stats;
+  const struct antagonism_tables* antagonism_tables;
+};
+
 struct thread_args {
   struct mmap_info* mmap_info;
   struct pov_workspace* pov_workspace;
   double* controversy_by_pov;
   void* data;
-  int64_t max_val;
-  int thread_num;
-  int num_threads;
+  const struct work_schedule* schedule;
+  // Shared position of the next chunk to take
+  int64_t* next_chunk;
+  double busy_seconds;
   void (*worker)(struct mmap_info* mmap_info, 
 		 struct pov_workspace* pov_workspace, 
 		 double* controversy_by_pov, 
 		 void* data, int64_t index);
 };
 
+struct chunk_weight {
+  int64_t start;
+  int64_t end;
+  int64_t weight;
+};
+
+int heavier_chunk_first(const void* first, const void* second) {
+  int64_t difference = ((const struct chunk_weight*)second)->weight
+    - ((const struct chunk_weight*)first)->weight;
+  return (difference > 0) - (difference < 0);
+}
+
+/* If weight is NULL, every index has weight 1. */
+void init_schedule(struct work_schedule* schedule, const char* name,
+		   const struct mmap_info* mmap_info, void* data,
+		   int64_t max_val, int num_threads,
+		   int64_t (*weight)(const struct mmap_info* mmap_info, void* data, int64_t index)) {
+  schedule->name = name;
+  schedule->wall_seconds = 0.0;
+  schedule->busy_seconds = 0.0;
+  int64_t* weights = malloc(sizeof(int64_t) * (max_val + 1));
+  int64_t total_weight = 0;
+  for (int64_t i = 0; i < max_val; ++i) {
+    weights[i] = (weight == NULL) ? 1 : weight(mmap_info, data, i);
+    total_weight += weights[i];
+  }
+  int64_t target = total_weight / ((int64_t)num_threads * CHUNKS_PER_THREAD) + 1;
+  struct chunk_weight* chunks = malloc(sizeof(struct chunk_weight) * (max_val + 1));
+  schedule->count_chunks = 0;
+  for (int64_t i = 0; i < max_val;) {
+    struct chunk_weight* chunk = chunks + schedule->count_chunks++;
+    chunk->start = i;
+    chunk->weight = 0;
+    while (i < max_val && (chunk->weight == 0 || chunk->weight + weights[i] <= target)) {
+      chunk->weight += weights[i++];
+    }
+    chunk->end = i;
+  }
+  qsort(chunks, schedule->count_chunks, sizeof(struct chunk_weight), heavier_chunk_first);
+  schedule->chunk_starts = malloc(sizeof(int64_t) * (schedule->count_chunks + 1));
+  schedule->chunk_ends = malloc(sizeof(int64_t) * (schedule->count_chunks + 1));
+  for (int64_t chunk = 0; chunk < schedule->count_chunks; ++chunk) {
+    schedule->chunk_starts[chunk] = chunks[chunk].start;
+    schedule->chunk_ends[chunk] = chunks[chunk].end;
+  }
+  free(chunks);
+  free(weights);
+}
+
+void free_schedule(struct work_schedule* schedule) {
+  free(schedule->chunk_starts);
+  free(schedule->chunk_ends);
+}
+
 void update_stats(const struct mmap_info* mmap_info, 
 		  struct pov_workspace* pov_workspace,
 		  const double* controversy_by_pov,
+		  const struct revision_stats* revision_stats,
 		  void (*get_revisions)(const struct mmap_info*, int64_t, int64_t*, const int64_t**),
 		  int64_t user_page_id,
 		  struct page_user_stats* stats);
 
 void* do_thread_work(void* args) {
   struct thread_args* thread_args = args;
-  for (int64_t i = thread_args->thread_num; 
-       i < thread_args->max_val;
-       i += thread_args->num_threads) {
-    thread_args->worker(thread_args->mmap_info,
-			thread_args->pov_workspace,
-			thread_args->controversy_by_pov,
-			thread_args->data, i);
+  const struct work_schedule* schedule = thread_args->schedule;
+  double start = monotonic_seconds();
+  int64_t chunk;
+  while ((chunk = __sync_fetch_and_add(thread_args->next_chunk, 1)) < schedule->count_chunks) {
+    for (int64_t i = schedule->chunk_starts[chunk]; i < schedule->chunk_ends[chunk]; ++i) {
+      thread_args->worker(thread_args->mmap_info,
+			  thread_args->pov_workspace,
+			  thread_args->controversy_by_pov,
+			  thread_args->data, i);
+    }
   }
+  thread_args->busy_seconds = monotonic_seconds() - start;
   return NULL;
 }
 
 void parallel_work(struct mmap_info* mmap_info, 
 		   struct pov_workspace* pov_workspaces, 
 		   double* controversy_by_pov, 
-		   void* data, int64_t max_val,
+		   void* data, struct work_schedule* schedule,
 		   int num_threads,
 		   void (*worker)(struct mmap_info* mmap_info, 
 				  struct pov_workspace* pov_workspace, 
 				  double* controversy_by_pov, 
 				  void* data, int64_t index)) {
+  double start = monotonic_seconds();
+  int64_t next_chunk = 0;
   pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
   struct thread_args* thread_args = calloc(num_threads, sizeof(struct thread_args));
   for (int thread_num = 0; thread_num < num_threads; ++thread_num) {
@@ -94,9 +202,8 @@ void parallel_work(struct mmap_info* mmap_info,
     thread_args[thread_num].pov_workspace = pov_workspaces + thread_num;
     thread_args[thread_num].controversy_by_pov = controversy_by_pov;
     thread_args[thread_num].data = data;
-    thread_args[thread_num].max_val = max_val;
-    thread_args[thread_num].thread_num = thread_num;
-    thread_args[thread_num].num_threads = num_threads;
+    thread_args[thread_num].schedule = schedule;
+    thread_args[thread_num].next_chunk = &next_chunk;
     thread_args[thread_num].worker = worker;
     pthread_create(threads + thread_num, NULL, 
 		   do_thread_work, (void*)(thread_args + thread_num));
@@ -104,7 +211,9 @@ void parallel_work(struct mmap_info* mmap_info,
   void* res;
   for (int thread_num = 0; thread_num < num_threads; ++thread_num) {
     pthread_join(threads[thread_num], &res);
+    schedule->busy_seconds += thread_args[thread_num].busy_seconds;
   }
+  schedule->wall_seconds += monotonic_seconds() - start;
   free(threads);
   free(thread_args);
 }
@@ -113,34 +222,59 @@ void update_user_antagonism(struct mmap_info* mmap_info,
 			    struct pov_workspace* pov_workspace, 
 			    double* controversy_by_pov, 
 			    void* data, int64_t index) {
-  struct user_pair_stats* user_pair_stats = data;
-  user_pair_stats[index].antagonism
-    += user_antagonism(mmap_info, user_pair_stats[index].first_user,
-		       user_pair_stats[index].second_user);
+  struct pair_stats_data* pair_stats_data = data;
+  struct user_pair_stats* user_pair_stats = pair_stats_data->user_pair_stats + index;
+  user_pair_stats->antagonism
+    += table_user_antagonism(mmap_info, pair_stats_data->antagonism_tables,
+			     user_pair_stats->first_user, user_pair_stats->second_user);
 }
 
-void update_user_stats(struct mmap_info* mmap_info, 
-		       struct pov_workspace* pov_workspace, 
-		       double* controversy_by_pov, 
-		       void* data, int64_t index) {
-  struct page_user_stats* page_user_stats = data;
-  update_stats(mmap_info, pov_workspace, 
-	       controversy_by_pov, get_user, 
-	       index, page_user_stats + index);
+void update_revision_stats(struct mmap_info* mmap_info, 
+			   struct pov_workspace* pov_workspace, 
+			   double* controversy_by_pov, 
+			   void* data, int64_t index) {
+  struct sample_stats_data* sample_stats_data = data;
+  int64_t end_revision = (index + 1) * REVISION_BLOCK;
+  if (end_revision > sample_stats_data->count_revisions) {
+    end_revision = sample_stats_data->count_revisions;
+  }
+  fill_revision_stats(mmap_info, index * REVISION_BLOCK, end_revision,
+		      sample_stats_data->revision_stats);
 }
 
-void update_page_stats(struct mmap_info* mmap_info, 
-		       struct pov_workspace* pov_workspace, 
-		       double* controversy_by_pov, 
-		       void* data, int64_t index) {
-  struct page_user_stats* page_user_stats = data;
-  update_stats(mmap_info, pov_workspace, 
-	       controversy_by_pov, get_page, 
-	       index, page_user_stats + index);
+int64_t user_page_weight(const struct mmap_info* mmap_info, void* data, int64_t index) {
+  struct sample_stats_data* sample_stats_data = data;
+  int64_t count_revisions;
+  const int64_t* revision_ids;
+  if (index < sample_stats_data->num_users) {
+    get_user(mmap_info, index, &count_revisions, &revision_ids);
+  } else {
+    get_page(mmap_info, index - sample_stats_data->num_users, &count_revisions, &revision_ids);
+  }
+  // Plus the fixed cost of an entity
+  return count_revisions + 1;
 }
 
-void print_stats(struct page_user_stats* stats, int64_t id, int samples, FILE* out) {
-  fprintf(out, "%"PRId64" %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",
+void update_user_page_stats(struct mmap_info* mmap_info, 
+			    struct pov_workspace* pov_workspace, 
+			    double* controversy_by_pov, 
+			    void* data, int64_t index) {
+  struct sample_stats_data* sample_stats_data = data;
+  if (index < sample_stats_data->num_users) {
+    update_stats(mmap_info, pov_workspace, controversy_by_pov,
+		 sample_stats_data->revision_stats, get_user, 
+		 index, sample_stats_data->user_stats + index);
+  } else {
+    index -= sample_stats_data->num_users;
+    update_stats(mmap_info, pov_workspace, controversy_by_pov,
+		 sample_stats_data->revision_stats, get_page, 
+		 index, sample_stats_data->page_stats + index);
+  }
+}
+
+void print_stats(struct page_user_stats* stats, int64_t id, const char* name,
+		 int samples, FILE* out) {
+  fprintf(out, "%"PRId64" %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf",
 	  id,
 	  stats->pov_revert_revert_fraction / samples,
 	  stats->pov_revert_edit_fraction / samples,
@@ -156,11 +290,16 @@ void print_stats(struct page_user_stats* stats, int64_t id, int samples, FILE* o
 	  stats->max_topic_rv_topic / samples,
 	  stats->edits_on_max_pov / samples,
 	  stats->entropy / samples);
+  if (name != NULL) {
+    fprintf(out, "\t%s", name);
+  }
+  fprintf(out, "\n");
 }
 
 void update_stats(const struct mmap_info* mmap_info, 
 		  struct pov_workspace* pov_workspace,
 		  const double* controversy_by_pov,
+		  const struct revision_stats* revision_stats,
 		  void (*get_revisions)(const struct mmap_info*, int64_t, int64_t*, const int64_t**),
 		  int64_t user_page_id,
 		  struct page_user_stats* stats) {
@@ -170,13 +309,13 @@ void update_stats(const struct mmap_info* mmap_info,
   if (count_revisions == 0) {
     return;
   }
-  int64_t count_on_max;
-  int max_topic;
-  int max_pov;
-  double entropy;
-  edits_on_max_pov(mmap_info, pov_workspace, revision_ids, count_revisions,
-		   &count_on_max, &max_topic, &max_pov, &entropy);
-  stats->entropy += entropy;
+  struct revision_set_stats set_stats;
+  summarize_revisions(mmap_info, pov_workspace, revision_stats, revision_ids,
+		      count_revisions, &set_stats);
+  int64_t count_on_max = set_stats.count_on_max;
+  int max_topic = set_stats.max_topic;
+  int max_pov = set_stats.max_pov;
+  stats->entropy += set_stats.entropy;
   stats->edit_fraction_on_max_pov += (double)count_on_max / (double)count_revisions;
   stats->edits_on_max_pov += (double)count_on_max;
   struct revision_assignment_header* revision_assignment_header
@@ -203,11 +342,9 @@ void update_stats(const struct mmap_info* mmap_info,
   stats->max_topic_rv_topic += (double)(max_topic_summary->revert_topic_count) 
     / (double)(max_topic_summary->norevert_topic_count + max_topic_summary->revert_topic_count);
 
-  int64_t num_pov_reverts;
-  int64_t num_pov_reverted;
-  int64_t num_reverts;
-  count_pov_reverts(mmap_info, revision_ids, count_revisions,
-		    &num_pov_reverts, &num_pov_reverted, &num_reverts);
+  int64_t num_pov_reverts = set_stats.num_pov_reverts;
+  int64_t num_pov_reverted = set_stats.num_pov_reverted;
+  int64_t num_reverts = set_stats.num_reverts;
   if (num_reverts != 0) {
     stats->pov_revert_revert_fraction += (double)num_pov_reverts / (double)num_reverts;
   }
@@ -217,7 +354,26 @@ void update_stats(const struct mmap_info* mmap_info,
   stats->edits += (double)count_revisions;
 }
 
+struct user_pair_stats* read_graph_pairs(const char* file_name, int64_t* count_pairs) {
+  struct revert_graph graph;
+  open_revert_graph(file_name, &graph);
+  *count_pairs = graph.header->count_edges;
+  struct user_pair_stats* ret = calloc(*count_pairs + 1, sizeof(struct user_pair_stats));
+  for (int64_t user_id = 0; user_id < graph.header->num_users; ++user_id) {
+    for (int64_t edge = graph.row_offsets[user_id]; edge < graph.row_offsets[user_id + 1];
+	 ++edge) {
+      ret[edge].first_user = user_id;
+      ret[edge].second_user = graph.edges[edge].user;
+    }
+  }
+  close_revert_graph(&graph);
+  return ret;
+}
+
 struct user_pair_stats* read_user_pairs(const char* file_name, int64_t* count_pairs) {
+  if (is_revert_graph_file(file_name)) {
+    return read_graph_pairs(file_name, count_pairs);
+  }
   FILE* user_pairs_in = fopen(file_name, "r");
   int64_t first_user;
   int64_t second_user;
@@ -253,7 +409,6 @@ int main(int argc, char **argv) {
   struct user_topic_header* user_topic_header
     = (struct user_topic_header*)mmap_info.user_topic_mmap;
   int num_threads = atoi(argv[2]);
-  int count_assignments = argc - NON_VAR_ARGS;
   int64_t count_pairs;
   struct user_pair_stats* user_pair_stats = read_user_pairs(argv[3], &count_pairs);
   struct sample_threads sample_threads;
@@ -265,32 +420,71 @@ int main(int argc, char **argv) {
     = calloc(topic_summary_header->num_pages, sizeof(struct page_user_stats));
   struct page_user_stats* user_stats
     = calloc(user_topic_header->num_users, sizeof(struct page_user_stats));
+  struct sample_stats_data sample_stats_data;
+  sample_stats_data.count_revisions = revision_assignment_header->count_revisions;
+  sample_stats_data.revision_stats = malloc(sizeof(struct revision_stats)
+					    * sample_stats_data.count_revisions);
+  assert(sample_stats_data.revision_stats != NULL);
+  sample_stats_data.user_stats = user_stats;
+  sample_stats_data.page_stats = page_stats;
+  sample_stats_data.num_users = user_topic_header->num_users;
   struct pov_workspace* pov_workspaces = calloc(num_threads, sizeof(struct pov_workspace));
   for (int i = 0; i < num_threads; ++i) {
     init_pov_workspace(&mmap_info, pov_workspaces + i);
   }
-  for (int assignment_n = 0; assignment_n < count_assignments; ++assignment_n) {
-    const char* assignment_file = argv[NON_VAR_ARGS + assignment_n];
+  struct antagonism_tables antagonism_tables;
+  init_antagonism_tables(&mmap_info, &antagonism_tables);
+  struct pair_stats_data pair_stats_data;
+  pair_stats_data.user_pair_stats = user_pair_stats;
+  pair_stats_data.antagonism_tables = &antagonism_tables;
+  struct work_schedule revision_schedule;
+  struct work_schedule user_page_schedule;
+  struct work_schedule pair_schedule;
+  init_schedule(&revision_schedule, "revisions", &mmap_info, &sample_stats_data,
+		(sample_stats_data.count_revisions + REVISION_BLOCK - 1) / REVISION_BLOCK,
+		num_threads, NULL);
+  init_schedule(&user_page_schedule, "users and pages", &mmap_info, &sample_stats_data,
+		user_topic_header->num_users + topic_summary_header->num_pages,
+		num_threads, user_page_weight);
+  // Every pair costs the same (num_topics * pov_per_topic^2)
+  init_schedule(&pair_schedule, "user pairs", &mmap_info, user_pair_stats, count_pairs,
+		num_threads, NULL);
+  int count_assignments = 0;
+  struct snapshot_reader snapshot_reader;
+  for (int arg_n = NON_VAR_ARGS; arg_n < argc; ++arg_n) {
+    const char* assignment_file = argv[arg_n];
     int64_t assignment_mmap_size;
-    char* assignments;
-    if (assignment_n == 0 && strlen(assignment_file) == 1 && assignment_file[0] == '_') {
-      assignment_mmap_size = -1;
-      assignments = NULL;
-    } else {
+    char* assignments = NULL;
+    int64_t count_samples = 1;
+    int snapshots = is_snapshot_file(assignment_file);
+    if (snapshots) {
+      open_snapshot_reader(&snapshot_reader, assignment_file);
+      count_samples = snapshot_reader.header->count_samples;
+    } else if (arg_n != NON_VAR_ARGS || strcmp(assignment_file, "_") != 0) {
       assignments = open_mmap_read(assignment_file, &assignment_mmap_size);
-      resample_restore(&sample_threads, 
-		       (struct revision_assignment*)(assignments + sizeof(struct revision_assignment_header)));
+      restore_changes(&sample_threads, 
+		      (struct revision_assignment*)(assignments + sizeof(struct revision_assignment_header)));
+    }
+    for (int64_t sample_num = 0; sample_num < count_samples; ++sample_num) {
+      if (snapshots) {
+	restore_changes(&sample_threads, read_snapshot(&snapshot_reader, sample_num));
+      }
+      all_pov_controversy(&mmap_info, controversy_by_pov);
+      fill_antagonism_tables(&mmap_info, &antagonism_tables);
+      parallel_work(&mmap_info, pov_workspaces, controversy_by_pov,
+		    &sample_stats_data, &revision_schedule,
+		    num_threads, update_revision_stats);
+      parallel_work(&mmap_info, pov_workspaces, controversy_by_pov,
+		    &sample_stats_data, &user_page_schedule,
+		    num_threads, update_user_page_stats);
+      parallel_work(&mmap_info, pov_workspaces, controversy_by_pov,
+		    &pair_stats_data, &pair_schedule, num_threads,
+		    update_user_antagonism);
+      ++count_assignments;
+    }
+    if (snapshots) {
+      close_snapshot_reader(&snapshot_reader);
     }
-    all_pov_controversy(&mmap_info, controversy_by_pov);
-    parallel_work(&mmap_info, pov_workspaces, controversy_by_pov,
-		  user_stats, user_topic_header->num_users, num_threads,
-		  update_user_stats);
-    parallel_work(&mmap_info, pov_workspaces, controversy_by_pov,
-		  page_stats, topic_summary_header->num_pages, num_threads,
-		  update_page_stats);
-    parallel_work(&mmap_info, pov_workspaces, controversy_by_pov,
-		  user_pair_stats, count_pairs, num_threads,
-		  update_user_antagonism);
     if (assignments != NULL) {
       munmap(assignments, assignment_mmap_size);
     }
@@ -299,17 +493,25 @@ int main(int argc, char **argv) {
   FILE* pages_file = fopen("pages_stats.txt", "w");
   FILE* user_comparisons_out = fopen("user_comparisons.txt", "w");
   for (int64_t userid = 0; userid < user_topic_header->num_users; ++userid) {
-    print_stats(user_stats + userid, userid, count_assignments, users_file);
+    print_stats(user_stats + userid, userid, get_user_name(&mmap_info, userid),
+		count_assignments, users_file);
   }
   for (int64_t pageid = 0; pageid < topic_summary_header->num_pages; ++pageid) {
-    print_stats(page_stats + pageid, pageid, count_assignments, pages_file);
+    print_stats(page_stats + pageid, pageid, get_page_name(&mmap_info, pageid),
+		count_assignments, pages_file);
   }
   for (int64_t pair_num = 0; pair_num < count_pairs; ++pair_num) {
     fprintf(user_comparisons_out,
-	    "%"PRId64" %"PRId64" %lf\n", 
+	    "%"PRId64" %"PRId64" %lf", 
 	    user_pair_stats[pair_num].first_user,
 	    user_pair_stats[pair_num].second_user,
 	    user_pair_stats[pair_num].antagonism / count_assignments);
+    const char* first_name = get_user_name(&mmap_info, user_pair_stats[pair_num].first_user);
+    const char* second_name = get_user_name(&mmap_info, user_pair_stats[pair_num].second_user);
+    if (first_name != NULL && second_name != NULL) {
+      fprintf(user_comparisons_out, "\t%s\t%s", first_name, second_name);
+    }
+    fprintf(user_comparisons_out, "\n");
   }
   fclose(user_comparisons_out);
   fclose(users_file);
@@ -317,6 +519,18 @@ int main(int argc, char **argv) {
   for (int i = 0; i < num_threads; ++i) {
     free_pov_workspace(pov_workspaces + i);
   }
+  struct work_schedule* schedules[3] = {&revision_schedule, &user_page_schedule,
+					&pair_schedule};
+  for (int i = 0; i < 3; ++i) {
+    if (schedules[i]->wall_seconds > 0.0) {
+      fprintf(stderr, "%s: %lf s, %" PRId64 " chunks, utilization %lf\n",
+	      schedules[i]->name, schedules[i]->wall_seconds, schedules[i]->count_chunks,
+	      schedules[i]->busy_seconds / (num_threads * schedules[i]->wall_seconds));
+    }
+    free_schedule(schedules[i]);
+  }
+  free_antagonism_tables(&antagonism_tables);
+  free(sample_stats_data.revision_stats);
   free(controversy_by_pov);
   free(user_pair_stats);
   destroy_threads(&sample_threads);
@@ -1,6 +1,9 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +22,8 @@ const char* REVISIONS_MMAP_NAME = "revisions_mmap";
 const char* REVISION_ASSIGNMENT_MMAP_NAME = "revision_assignment_mmap";
 const char* TOPIC_INDEX_MMAP_NAME = "topic_index_mmap";
 const char* USER_TOPIC_MMAP_NAME = "user_topic_mmap";
+const char* USER_NAMES_MMAP_NAME = "user_names_mmap";
+const char* PAGE_NAMES_MMAP_NAME = "page_names_mmap";
 
 struct mmap_info open_mmaps_internal(const char* directory,
 				     int rw_mmaps_inmem,
@@ -157,13 +162,19 @@ struct mmap_info open_mmaps_internal(const char* directory,
   ret.revisions_mmap_name = full_path(directory, REVISIONS_MMAP_NAME);
   ret.user_mmap_name = full_path(directory, USER_INDEX_MMAP_NAME);
   ret.page_mmap_name = full_path(directory, PAGE_INDEX_MMAP_NAME);
+  ret.user_names_mmap_name = full_path(directory, USER_NAMES_MMAP_NAME);
+  ret.page_names_mmap_name = full_path(directory, PAGE_NAMES_MMAP_NAME);
   ret.revision_assignment_mmap_name = full_path(directory, REVISION_ASSIGNMENT_MMAP_NAME);
   ret.topic_index_mmap_name = full_path(directory, TOPIC_INDEX_MMAP_NAME);
   ret.user_topic_mmap_name = full_path(directory, USER_TOPIC_MMAP_NAME);
   ret.rw_mmaps_inmem = rw_mmaps_inmem;
+  ret.shared_data = 0;
+  ret.discard_changes = 0;
   ret.revision_mmap = open_mmap_read(ret.revisions_mmap_name, &(ret.revision_mmap_size));
   ret.user_mmap = open_mmap_read(ret.user_mmap_name, &(ret.user_mmap_size));
   ret.page_mmap = open_mmap_read(ret.page_mmap_name, &(ret.page_mmap_size));
+  ret.user_names_mmap = open_mmap_read(ret.user_names_mmap_name, &(ret.user_names_mmap_size));
+  ret.page_names_mmap = open_mmap_read(ret.page_names_mmap_name, &(ret.page_names_mmap_size));
 
   if (exclude_inference) {
     ret.revision_assignment_mmap = NULL;
@@ -209,7 +220,89 @@ struct mmap_info open_mmaps_internal(const char* directory,
   return ret;
 }
 
+char* copy_or_read_file(const char* file_name, const char* source, int64_t length,
+			int64_t* read_length, int exists) {
+  if (exists) {
+    return read_file(file_name, read_length);
+  }
+  char* ret = malloc(length);
+  assert(ret != NULL);
+  memcpy(ret, source, length);
+  *read_length = length;
+  return ret;
+}
+
+/* An mmap_info reusing shared's data mmaps, with its assignments and
+   indexes read into memory from the named files if exists is set, or
+   otherwise copied from shared's. Takes ownership of the names (which
+   may be NULL if nothing will be written back). */
+struct mmap_info share_data_mmaps(const struct mmap_info* shared,
+				  char* revision_assignment_mmap_name,
+				  char* topic_index_mmap_name,
+				  char* user_topic_mmap_name,
+				  int exists) {
+  assert(shared->revision_assignment_mmap != NULL);
+  struct mmap_info ret = *shared;
+  ret.shared_data = 1;
+  ret.discard_changes = 0;
+  ret.rw_mmaps_inmem = 1;
+  ret.revisions_mmap_name = strdup(shared->revisions_mmap_name);
+  ret.user_mmap_name = strdup(shared->user_mmap_name);
+  ret.page_mmap_name = strdup(shared->page_mmap_name);
+  ret.user_names_mmap_name = strdup(shared->user_names_mmap_name);
+  ret.page_names_mmap_name = strdup(shared->page_names_mmap_name);
+  ret.revision_assignment_mmap_name = revision_assignment_mmap_name;
+  ret.topic_index_mmap_name = topic_index_mmap_name;
+  ret.user_topic_mmap_name = user_topic_mmap_name;
+  ret.revision_assignment_mmap
+    = copy_or_read_file(ret.revision_assignment_mmap_name, shared->revision_assignment_mmap,
+			shared->revision_assignment_mmap_size,
+			&(ret.revision_assignment_mmap_size), exists);
+  ret.topic_index_mmap
+    = copy_or_read_file(ret.topic_index_mmap_name, shared->topic_index_mmap,
+			shared->topic_index_mmap_size, &(ret.topic_index_mmap_size), exists);
+  ret.user_topic_mmap
+    = copy_or_read_file(ret.user_topic_mmap_name, shared->user_topic_mmap,
+			shared->user_topic_mmap_size, &(ret.user_topic_mmap_size), exists);
+  ret.topic_index_pages_mmap = ret.topic_index_mmap
+    + (shared->topic_index_pages_mmap - shared->topic_index_mmap);
+  return ret;
+}
+
+struct mmap_info open_chain_mmaps(const struct mmap_info* shared, const char* chain_directory,
+				  int* created) {
+  char* revision_assignment_mmap_name
+    = full_path(chain_directory, REVISION_ASSIGNMENT_MMAP_NAME);
+  char* topic_index_mmap_name = full_path(chain_directory, TOPIC_INDEX_MMAP_NAME);
+  char* user_topic_mmap_name = full_path(chain_directory, USER_TOPIC_MMAP_NAME);
+  if (mkdir(chain_directory, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0
+      && errno != EEXIST) {
+    fprintf(stderr, "Could not create directory %s\n", chain_directory);
+    exit(1);
+  }
+  int exists = (access(revision_assignment_mmap_name, F_OK) == 0
+		&& access(topic_index_mmap_name, F_OK) == 0
+		&& access(user_topic_mmap_name, F_OK) == 0);
+  *created = !exists;
+  return share_data_mmaps(shared, revision_assignment_mmap_name, topic_index_mmap_name,
+			  user_topic_mmap_name, exists);
+}
+
+struct mmap_info copy_model_mmaps(const struct mmap_info* shared) {
+  struct mmap_info ret = share_data_mmaps(shared, NULL, NULL, NULL, 0);
+  ret.discard_changes = 1;
+  return ret;
+}
+
 void close_mmaps(struct mmap_info mmap_info) {
+  if (mmap_info.shared_data) {
+    // Leave the data mmaps to their owner
+    mmap_info.revision_mmap = NULL;
+    mmap_info.user_mmap = NULL;
+    mmap_info.page_mmap = NULL;
+    mmap_info.user_names_mmap = NULL;
+    mmap_info.page_names_mmap = NULL;
+  }
   if (mmap_info.revision_mmap != NULL) {
     assert(munmap((void*)(mmap_info.revision_mmap), mmap_info.revision_mmap_size)
 	   == 0);
@@ -222,16 +315,26 @@ void close_mmaps(struct mmap_info mmap_info) {
     assert(munmap((void*)(mmap_info.page_mmap), mmap_info.page_mmap_size)
 	   == 0);
   }
+  if (mmap_info.user_names_mmap != NULL) {
+    assert(munmap((void*)(mmap_info.user_names_mmap), mmap_info.user_names_mmap_size)
+	   == 0);
+  }
+  if (mmap_info.page_names_mmap != NULL) {
+    assert(munmap((void*)(mmap_info.page_names_mmap), mmap_info.page_names_mmap_size)
+	   == 0);
+  }
   if (mmap_info.rw_mmaps_inmem) {
-    write_file(mmap_info.revision_assignment_mmap_name, 
-	       mmap_info.revision_assignment_mmap,
-	       mmap_info.revision_assignment_mmap_size);
-    write_file(mmap_info.topic_index_mmap_name,
-	       mmap_info.topic_index_mmap,
-	       mmap_info.topic_index_mmap_size);
-    write_file(mmap_info.user_topic_mmap_name,
-	       mmap_info.user_topic_mmap,
-	       mmap_info.user_topic_mmap_size);
+    if (!mmap_info.discard_changes) {
+      write_file(mmap_info.revision_assignment_mmap_name, 
+		 mmap_info.revision_assignment_mmap,
+		 mmap_info.revision_assignment_mmap_size);
+      write_file(mmap_info.topic_index_mmap_name,
+		 mmap_info.topic_index_mmap,
+		 mmap_info.topic_index_mmap_size);
+      write_file(mmap_info.user_topic_mmap_name,
+		 mmap_info.user_topic_mmap,
+		 mmap_info.user_topic_mmap_size);
+    }
     free(mmap_info.revision_assignment_mmap);
     free(mmap_info.topic_index_mmap);
     free(mmap_info.user_topic_mmap);
@@ -253,6 +356,8 @@ void close_mmaps(struct mmap_info mmap_info) {
   free(mmap_info.revisions_mmap_name);
   free(mmap_info.user_mmap_name);
   free(mmap_info.page_mmap_name);
+  free(mmap_info.user_names_mmap_name);
+  free(mmap_info.page_names_mmap_name);
   free(mmap_info.revision_assignment_mmap_name);
   free(mmap_info.topic_index_mmap_name);
   free(mmap_info.user_topic_mmap_name);
@@ -283,6 +388,27 @@ void get_user(const struct mmap_info* mmap_info, int64_t user_id, int64_t* count
   }
 }
 
+const char* get_string(const char* string_table, int64_t id) {
+  if (string_table == NULL) {
+    return NULL;
+  }
+  const struct string_table_header* string_table_header
+    = (const struct string_table_header*)string_table;
+  if (id < 0 || id >= string_table_header->count_strings) {
+    return NULL;
+  }
+  const int64_t* offsets = (const int64_t*)(string_table + sizeof(struct string_table_header));
+  return string_table + offsets[id];
+}
+
+const char* get_user_name(const struct mmap_info* mmap_info, int64_t user_id) {
+  return get_string(mmap_info->user_names_mmap, user_id);
+}
+
+const char* get_page_name(const struct mmap_info* mmap_info, int64_t page_id) {
+  return get_string(mmap_info->page_names_mmap, page_id);
+}
+
 void initialize_user_topics(const struct mmap_info* mmap_info, int sample, int modn) {
   const struct user_topic_header* user_topic_header
     = (const struct user_topic_header*)mmap_info->user_topic_mmap;
@@ -299,6 +425,22 @@ void initialize_user_topics(const struct mmap_info* mmap_info, int sample, int m
   }
 }
 
+void round_user_topics(const struct mmap_info* mmap_info, int sample, int modn) {
+  const struct user_topic_header* user_topic_header
+    = (const struct user_topic_header*)mmap_info->user_topic_mmap;
+  const struct revision_assignment_header* revision_assignment_header
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  int64_t dist_size = user_topic_header->num_topics * user_topic_header->pov_per_topic;
+  for (int64_t user_id = sample; user_id < user_topic_header->num_users; user_id += modn) {
+    double* topic_pov_dist = (double*)(mmap_info->user_topic_mmap + sizeof(struct user_topic_header))
+      + user_id * dist_size;
+    for (int64_t i = 0; i < dist_size; ++i) {
+      topic_pov_dist[i] = revision_assignment_header->alpha
+	+ (double)llround(topic_pov_dist[i] - revision_assignment_header->alpha);
+    }
+  }
+}
+
 void get_user_topics(const struct mmap_info* mmap_info, int64_t user_id, double** topic_pov_dist) {
   const struct user_topic_header* user_topic_header
     = (const struct user_topic_header*)mmap_info->user_topic_mmap;
@@ -410,6 +552,168 @@ void change_indexes(const struct mmap_info* mmap_info, int64_t revision_id, int3
   }
 }
 
+struct rebuild_args {
+  /* A copy of the mmap_info being rebuilt, with topic_index_mmap
+     pointing at this thread's partial topic summary counts. */
+  struct mmap_info mmap_info;
+  const struct mmap_info* target;
+  int sample;
+  int modn;
+  const struct rebuild_args* all_args;
+};
+
+int64_t summary_counts_size(const struct mmap_info* mmap_info) {
+  return mmap_info->topic_index_pages_mmap - mmap_info->topic_index_mmap;
+}
+
+/* Add a revision to the topic summary counts. As in change_indexes,
+   except that a parent with no assignment counts as no parent, as in
+   the sampler's index updates. */
+void count_revision_summary(const struct mmap_info* mmap_info, int64_t revision_id,
+			    const struct revision_assignment* revision_assignment) {
+  struct topic_summary* topic_summary;
+  struct pov_summary* pov_dist;
+  get_topic_summary(mmap_info, revision_assignment->topic, &topic_summary, &pov_dist, NULL);
+  topic_summary->total_revisions++;
+  const struct revision* revision = get_revision(mmap_info, revision_id);
+  if (revision->parent < 0) {
+    return;
+  }
+  const struct revision_assignment* parent_assignment
+    = get_revision_assignment(mmap_info, revision->parent);
+  if (parent_assignment->topic < 0 || parent_assignment->pov < 0) {
+    return;
+  }
+  if (parent_assignment->topic != revision_assignment->topic) {
+    if (revision->disagrees) {
+      topic_summary->revert_general_count++;
+    } else {
+      topic_summary->norevert_general_count++;
+    }
+  } else if (parent_assignment->pov == revision_assignment->pov) {
+    if (revision->disagrees) {
+      topic_summary->revert_topic_count++;
+    } else {
+      topic_summary->norevert_topic_count++;
+    }
+  } else {
+    struct pov_summary* pov_summary = get_ant_pov(mmap_info, pov_dist, revision_assignment->pov,
+						  parent_assignment->pov);
+    if (revision->disagrees) {
+      pov_summary->revert_count++;
+    } else {
+      pov_summary->norevert_count++;
+    }
+  }
+}
+
+void* count_indexes_modn(void* void_args) {
+  struct rebuild_args* args = void_args;
+  const struct mmap_info* target = args->target;
+  const struct topic_summary_header* topic_summary_header
+    = (const struct topic_summary_header*)target->topic_index_mmap;
+  const struct user_topic_header* user_topic_header
+    = (const struct user_topic_header*)target->user_topic_mmap;
+  int64_t count_revisions;
+  struct revision_assignment* revision_assignments;
+  get_revision_assignment_array(target, &count_revisions, &revision_assignments);
+  for (int64_t revision_id = args->sample; revision_id < count_revisions;
+       revision_id += args->modn) {
+    if (revision_assignments[revision_id].topic >= 0
+	&& revision_assignments[revision_id].pov >= 0) {
+      count_revision_summary(&(args->mmap_info), revision_id, revision_assignments + revision_id);
+    }
+  }
+  int64_t count_page_revisions;
+  const int64_t* revision_ids;
+  int64_t* page_dist;
+  for (int64_t page_id = args->sample; page_id < topic_summary_header->num_pages;
+       page_id += args->modn) {
+    for (int topic = 0; topic < topic_summary_header->num_topics; ++topic) {
+      get_topic_summary(target, topic, NULL, NULL, &page_dist);
+      page_dist[page_id] = 0;
+    }
+    get_page(target, page_id, &count_page_revisions, &revision_ids);
+    for (int64_t i = 0; i < count_page_revisions; ++i) {
+      const struct revision_assignment* assignment = revision_assignments + revision_ids[i];
+      if (assignment->topic >= 0 && assignment->pov >= 0) {
+	get_topic_summary(target, assignment->topic, NULL, NULL, &page_dist);
+	page_dist[page_id]++;
+      }
+    }
+  }
+  initialize_user_topics(target, args->sample, args->modn);
+  int64_t count_user_revisions;
+  double* topic_pov_dist;
+  for (int64_t user_id = args->sample; user_id < user_topic_header->num_users;
+       user_id += args->modn) {
+    get_user_topics(target, user_id, &topic_pov_dist);
+    get_user(target, user_id, &count_user_revisions, &revision_ids);
+    for (int64_t i = 0; i < count_user_revisions; ++i) {
+      const struct revision_assignment* assignment = revision_assignments + revision_ids[i];
+      if (assignment->topic >= 0 && assignment->pov >= 0) {
+	topic_pov_dist[assignment->topic * user_topic_header->pov_per_topic
+		       + assignment->pov] += 1.0;
+      }
+    }
+  }
+  return NULL;
+}
+
+void* reduce_summary_counts(void* void_args) {
+  struct rebuild_args* args = void_args;
+  // Counters after the header, split into contiguous ranges
+  int64_t first = sizeof(struct topic_summary_header) / sizeof(int64_t);
+  int64_t count = summary_counts_size(args->target) / sizeof(int64_t) - first;
+  int64_t start = first + count * args->sample / args->modn;
+  int64_t end = first + count * (args->sample + 1) / args->modn;
+  int64_t* summary = (int64_t*)args->target->topic_index_mmap;
+  for (int64_t counter = start; counter < end; ++counter) {
+    int64_t total = 0;
+    for (int thread = 0; thread < args->modn; ++thread) {
+      total += ((const int64_t*)args->all_args[thread].mmap_info.topic_index_mmap)[counter];
+    }
+    summary[counter] = total;
+  }
+  return NULL;
+}
+
+void run_rebuild_threads(struct rebuild_args* args, int num_threads, void* (*work)(void*)) {
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_create(threads + i, NULL, work, (void*)(args + i));
+  }
+  void* res;
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], &res);
+  }
+  free(threads);
+}
+
+void rebuild_indexes(const struct mmap_info* mmap_info, int num_threads) {
+  assert(num_threads > 0);
+  int64_t summary_size = summary_counts_size(mmap_info);
+  struct rebuild_args* args = malloc(sizeof(struct rebuild_args) * num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].mmap_info = *mmap_info;
+    args[i].mmap_info.topic_index_mmap = calloc(summary_size, 1);
+    assert(args[i].mmap_info.topic_index_mmap != NULL);
+    // The header is needed to find counters
+    memcpy(args[i].mmap_info.topic_index_mmap, mmap_info->topic_index_mmap,
+	   sizeof(struct topic_summary_header));
+    args[i].target = mmap_info;
+    args[i].sample = i;
+    args[i].modn = num_threads;
+    args[i].all_args = args;
+  }
+  run_rebuild_threads(args, num_threads, count_indexes_modn);
+  run_rebuild_threads(args, num_threads, reduce_summary_counts);
+  for (int i = 0; i < num_threads; ++i) {
+    free(args[i].mmap_info.topic_index_mmap);
+  }
+  free(args);
+}
+
 void change_revision_assignment(const struct mmap_info* mmap_info, int64_t revision,
 				int32_t new_topic, int32_t new_pov) {
   int64_t count_revisions;
@@ -431,6 +735,12 @@ void change_revision_assignment(const struct mmap_info* mmap_info, int64_t revis
   }
 }
 
+int64_t string_table_mmap_size(int64_t count_strings, int64_t total_string_length) {
+  // One NUL terminator per string
+  return sizeof(struct string_table_header) + sizeof(int64_t) * (count_strings + 1)
+    + total_string_length + count_strings;
+}
+
 int64_t revision_assignment_mmap_size(int64_t count_revisions) {
   return sizeof(struct revision_assignment_header) + sizeof(struct revision_assignment) * count_revisions;
 }
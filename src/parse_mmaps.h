@@ -7,12 +7,14 @@
 
 /* Standard mmap names (within the mmap_dir). Defined in
    parse_mmaps.c. */
-const char* USER_INDEX_MMAP_NAME;
-const char* PAGE_INDEX_MMAP_NAME;
-const char* REVISIONS_MMAP_NAME;
-const char* REVISION_ASSIGNMENT_MMAP_NAME;
-const char* TOPIC_INDEX_MMAP_NAME;
-const char* USER_TOPIC_MMAP_NAME;
+extern const char* USER_INDEX_MMAP_NAME;
+extern const char* PAGE_INDEX_MMAP_NAME;
+extern const char* REVISIONS_MMAP_NAME;
+extern const char* REVISION_ASSIGNMENT_MMAP_NAME;
+extern const char* TOPIC_INDEX_MMAP_NAME;
+extern const char* USER_TOPIC_MMAP_NAME;
+extern const char* USER_NAMES_MMAP_NAME;
+extern const char* PAGE_NAMES_MMAP_NAME;
 
 /* Keeps track of open mmaps, and how they were opened (read/write
    mmap, read-only mmap, read into memory) */
@@ -23,6 +25,11 @@ struct mmap_info {
   int64_t user_mmap_size;
   const char* page_mmap;
   int64_t page_mmap_size;
+  // NULL unless revisions were stored with string identifiers
+  const char* user_names_mmap;
+  int64_t user_names_mmap_size;
+  const char* page_names_mmap;
+  int64_t page_names_mmap_size;
 
   char* revision_assignment_mmap;
   int64_t revision_assignment_mmap_size;
@@ -35,11 +42,20 @@ struct mmap_info {
   char* revisions_mmap_name;
   char* user_mmap_name;
   char* page_mmap_name;
+  char* user_names_mmap_name;
+  char* page_names_mmap_name;
   char* revision_assignment_mmap_name;
   char* topic_index_mmap_name;
   char* user_topic_mmap_name;
 
   int rw_mmaps_inmem;
+  /* Set if the data mmaps (revisions, user and page indexes, and
+     names) belong to another mmap_info, which must be closed after
+     this one. See open_chain_mmaps. */
+  int shared_data;
+  /* Set for in-memory copies whose changes are discarded on close
+     (see copy_model_mmaps). */
+  int discard_changes;
 };
 
 struct revision;
@@ -67,6 +83,21 @@ struct mmap_info open_mmaps_readonly(const char* directory);
 struct mmap_info open_mmaps_memory(const char* directory);
 struct mmap_info open_mmaps_mmap(const char* directory);
 
+/* Open a separate set of assignments and indexes (for example, for
+   another Markov chain) in chain_directory, reusing the data mmaps of
+   shared. The assignments and indexes are read into memory (as with
+   open_mmaps_memory) if they exist in chain_directory; otherwise the
+   directory is created, shared's current assignments and indexes are
+   copied, and created is set to 1 (0 if they existed). */
+struct mmap_info open_chain_mmaps(const struct mmap_info* shared, const char* chain_directory,
+				  int* created);
+
+/* Private in-memory copies of shared's current assignments and
+   indexes, reusing its data mmaps (as with open_chain_mmaps), for
+   example to run several samplers from the same state at once.
+   Nothing is written to disk, and close_mmaps discards the copies. */
+struct mmap_info copy_model_mmaps(const struct mmap_info* shared);
+
 /* Unmap memory, close files. If files were opened with
    open_mmaps_memory, this commits changes back to disk. */
 void close_mmaps(struct mmap_info);
@@ -92,6 +123,13 @@ void get_page(const struct mmap_info* mmap_info, int64_t page_id,
 void get_user(const struct mmap_info* mmap_info, int64_t user_id, int64_t* count_revisions, 
 	      const int64_t** revision_ids);
 
+/* Get the user name or page title that a user or page ID was
+   interned from. Returns NULL if revisions were stored with integer
+   identifiers (there is no string table), or the ID has no name. The
+   mmap retains ownership of the returned string. */
+const char* get_user_name(const struct mmap_info* mmap_info, int64_t user_id);
+const char* get_page_name(const struct mmap_info* mmap_info, int64_t page_id);
+
 /* Get a pointer the topic/POV distribution (a num_topic * num_pov
    array) for this user. The pointer is stored in the pointer pointed
    to by topic_pov_dist, which then points into the memory map. The
@@ -128,6 +166,10 @@ void get_revision_assignment_array(const struct mmap_info* mmap_info, int64_t* c
    that userid % modn == sample. Useful for initializing user
    distributions in parallel. */
 void initialize_user_topics(const struct mmap_info* mmap_info, int sample, int modn);
+/* Round the user topic/POV dist entries (for users such that userid
+   % modn == sample) to alpha plus a whole count, removing the rounding
+   error left by adding and subtracting 1.0 in varying orders. */
+void round_user_topics(const struct mmap_info* mmap_info, int sample, int modn);
 
 // Change the revision's assignments, updating indexes automatically.
 void change_revision_assignment(const struct mmap_info* mmap_info, int64_t revision,
@@ -136,6 +178,16 @@ void change_revision_assignment(const struct mmap_info* mmap_info, int64_t revis
 // Manually change indexes for revision_id by the amount specified.
 void change_indexes(const struct mmap_info* mmap_info, int64_t revision_id, int32_t change_by);
 
+/* Recompute every topic, page and user count (and reset user
+   distributions to alpha) from the current revision assignments,
+   using num_threads threads. Each thread counts its share of
+   revisions into private topic summary counts, which are then summed
+   in parallel; pages and users are split mod num_threads, so there is
+   no locking. Revisions with no assignment (topic or POV -1) are not
+   counted, and neither is an edit's relationship to a parent with no
+   assignment. */
+void rebuild_indexes(const struct mmap_info* mmap_info, int num_threads);
+
 /* Miscellaneous utility functions related to data storage */
 
 /* Allocate memory for and copy revision assignments into an array,
@@ -160,6 +212,7 @@ char* open_mmap_read(const char* file_name, int64_t* mmap_size);
 char *create_mmap(const char *file_name, int64_t length);
 
 // Compute the size of mmap files
+int64_t string_table_mmap_size(int64_t count_strings, int64_t total_string_length);
 int64_t revision_assignment_mmap_size(int64_t count_revisions);
 int64_t topic_summary_mmap_size(int32_t num_topics, int32_t pov_per_topic, int64_t num_pages);
 int64_t user_topic_mmap_size(int64_t num_users, int32_t num_topics, int32_t pov_per_topic);
@@ -0,0 +1,56 @@
+#include <stdint.h>
+
+#include "philox.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t output[4]) {
+  uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (int round = 0; round < PHILOX_ROUNDS; ++round) {
+    uint64_t product0 = (uint64_t)PHILOX_M0 * c0;
+    uint64_t product1 = (uint64_t)PHILOX_M1 * c2;
+    c0 = (uint32_t)(product1 >> 32) ^ c1 ^ k0;
+    c1 = (uint32_t)product1;
+    c2 = (uint32_t)(product0 >> 32) ^ c3 ^ k1;
+    c3 = (uint32_t)product0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  output[0] = c0;
+  output[1] = c1;
+  output[2] = c2;
+  output[3] = c3;
+}
+
+// 53 bits from two words, scaled to [0, 1)
+double words_to_uniform(uint32_t high, uint32_t low) {
+  return (((uint64_t)high << 21) ^ (low >> 11)) * (1.0 / 9007199254740992.0);
+}
+
+void philox_uniform_pair(uint64_t seed, uint64_t first, uint64_t second,
+			 double* uniforms) {
+  uint32_t counter[4] = {(uint32_t)first, (uint32_t)(first >> 32),
+			 (uint32_t)second, (uint32_t)(second >> 32)};
+  uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+  uint32_t output[4];
+  philox4x32(counter, key, output);
+  uniforms[0] = words_to_uniform(output[0], output[1]);
+  uniforms[1] = words_to_uniform(output[2], output[3]);
+}
+
+void philox_uniforms(uint64_t seed, const int64_t* ids, int64_t count, uint64_t second,
+		     double* uniforms) {
+  uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+  for (int64_t i = 0; i < count; ++i) {
+    uint32_t counter[4] = {(uint32_t)ids[i], (uint32_t)((uint64_t)ids[i] >> 32),
+			   (uint32_t)second, (uint32_t)(second >> 32)};
+    uint32_t output[4];
+    philox4x32(counter, key, output);
+    uniforms[i] = words_to_uniform(output[0], output[1]);
+  }
+}
@@ -0,0 +1,32 @@
+/* Philox4x32-10, a counter-based random number generator. For
+   details, see:
+
+   Salmon, J. K., Moraes, M. A., Dror, R. O., and Shaw, D. E. 2011.
+   Parallel random numbers: as easy as 1, 2, 3. Proceedings of the
+   International Conference for High Performance Computing,
+   Networking, Storage and Analysis (SC11).
+
+   Each output block is a pure function of a 128-bit counter and a
+   64-bit key, so random numbers can be drawn for any (seed, position)
+   without any generator state, in any order and on any thread. */
+
+#ifndef __PHILOX_H__
+#define __PHILOX_H__
+
+#include <stdint.h>
+
+/* Compute the four 32-bit output words for counter under key. */
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t output[4]);
+
+/* Two uniform doubles in [0, 1) (53 random bits each) for the
+   counter (first, second) under seed. */
+void philox_uniform_pair(uint64_t seed, uint64_t first, uint64_t second,
+			 double* uniforms);
+
+/* For each of count ids, the first uniform of
+   philox_uniform_pair(seed, ids[i], second), stored in uniforms[i].
+   The blocks are independent, so the loop vectorizes. */
+void philox_uniforms(uint64_t seed, const int64_t* ids, int64_t count, uint64_t second,
+		     double* uniforms);
+
+#endif
@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "index.h"
+#include "parse_mmaps.h"
+#include "posterior.h"
+
+struct posterior_thread_args {
+  char* posterior;
+  const struct mmap_info* mmap_info;
+  int sample;
+  int modn;
+};
+
+int64_t posterior_mmap_size(int32_t num_topics, int32_t pov_per_topic, int64_t count_revisions,
+			    int64_t num_users, int64_t num_pages) {
+  int64_t cells = (int64_t)num_topics * pov_per_topic;
+  return sizeof(struct posterior_header)
+    + sizeof(int32_t) * cells * count_revisions
+    + sizeof(double) * cells * (num_users + num_pages)
+    + sizeof(struct posterior_revert) * cells * pov_per_topic;
+}
+
+char* create_posterior(const struct mmap_info* mmap_info, int64_t* posterior_size) {
+  const struct revision_assignment_header* revision_assignment_header
+    = (const struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  const struct topic_summary_header* topic_summary_header
+    = (const struct topic_summary_header*)mmap_info->topic_index_mmap;
+  const struct user_topic_header* user_topic_header
+    = (const struct user_topic_header*)mmap_info->user_topic_mmap;
+  *posterior_size = posterior_mmap_size(revision_assignment_header->num_topics,
+					revision_assignment_header->pov_per_topic,
+					revision_assignment_header->count_revisions,
+					user_topic_header->num_users,
+					topic_summary_header->num_pages);
+  char* posterior = calloc(*posterior_size, 1);
+  if (posterior == NULL) {
+    fprintf(stderr, "Could not allocate %" PRId64 " bytes for posterior sums\n",
+	    *posterior_size);
+    exit(1);
+  }
+  struct posterior_header* header = (struct posterior_header*)posterior;
+  header->num_topics = revision_assignment_header->num_topics;
+  header->pov_per_topic = revision_assignment_header->pov_per_topic;
+  header->count_revisions = revision_assignment_header->count_revisions;
+  header->num_users = user_topic_header->num_users;
+  header->num_pages = topic_summary_header->num_pages;
+  return posterior;
+}
+
+int64_t posterior_cells(const char* posterior) {
+  const struct posterior_header* header = (const struct posterior_header*)posterior;
+  return (int64_t)header->num_topics * header->pov_per_topic;
+}
+
+int32_t* posterior_revision_counts(const char* posterior, int64_t revision_id) {
+  return (int32_t*)(posterior + sizeof(struct posterior_header))
+    + posterior_cells(posterior) * revision_id;
+}
+
+double* posterior_user_mass(const char* posterior, int64_t user_id) {
+  const struct posterior_header* header = (const struct posterior_header*)posterior;
+  return (double*)posterior_revision_counts(posterior, header->count_revisions)
+    + posterior_cells(posterior) * user_id;
+}
+
+double* posterior_page_mass(const char* posterior, int64_t page_id) {
+  const struct posterior_header* header = (const struct posterior_header*)posterior;
+  return posterior_user_mass(posterior, header->num_users)
+    + posterior_cells(posterior) * page_id;
+}
+
+struct posterior_revert* posterior_reverts(const char* posterior, int32_t topic) {
+  const struct posterior_header* header = (const struct posterior_header*)posterior;
+  return (struct posterior_revert*)posterior_page_mass(posterior, header->num_pages)
+    + (int64_t)header->pov_per_topic * header->pov_per_topic * topic;
+}
+
+void* add_posterior_sample_modn(void* void_args) {
+  struct posterior_thread_args* args = void_args;
+  const struct posterior_header* header = (const struct posterior_header*)args->posterior;
+  int pov_per_topic = header->pov_per_topic;
+  int64_t cells = posterior_cells(args->posterior);
+  const struct revision_assignment* assignment;
+  for (int64_t revision_id = args->sample; revision_id < header->count_revisions;
+       revision_id += args->modn) {
+    assignment = get_revision_assignment(args->mmap_info, revision_id);
+    if (assignment->topic >= 0 && assignment->pov >= 0) {
+      posterior_revision_counts(args->posterior, revision_id)
+	[assignment->topic * pov_per_topic + assignment->pov] += 1;
+    }
+  }
+  double* topic_pov_dist;
+  for (int64_t user_id = args->sample; user_id < header->num_users; user_id += args->modn) {
+    double* mass = posterior_user_mass(args->posterior, user_id);
+    get_user_topics(args->mmap_info, user_id, &topic_pov_dist);
+    for (int64_t cell = 0; cell < cells; ++cell) {
+      mass[cell] += topic_pov_dist[cell];
+    }
+  }
+  int64_t count_revisions;
+  const int64_t* revision_ids;
+  for (int64_t page_id = args->sample; page_id < header->num_pages; page_id += args->modn) {
+    double* mass = posterior_page_mass(args->posterior, page_id);
+    get_page(args->mmap_info, page_id, &count_revisions, &revision_ids);
+    for (int64_t i = 0; i < count_revisions; ++i) {
+      assignment = get_revision_assignment(args->mmap_info, revision_ids[i]);
+      if (assignment->topic >= 0 && assignment->pov >= 0) {
+	mass[assignment->topic * pov_per_topic + assignment->pov] += 1.0;
+      }
+    }
+  }
+  struct topic_summary* topic_summary;
+  struct pov_summary* pov_dist;
+  for (int topic = args->sample; topic < header->num_topics; topic += args->modn) {
+    struct posterior_revert* reverts = posterior_reverts(args->posterior, topic);
+    get_topic_summary(args->mmap_info, topic, &topic_summary, &pov_dist, NULL);
+    for (int pov = 0; pov < pov_per_topic; ++pov) {
+      for (int ant_pov = 0; ant_pov < pov_per_topic; ++ant_pov) {
+	struct posterior_revert* revert = reverts + pov * pov_per_topic + ant_pov;
+	if (pov == ant_pov) {
+	  revert->revert_count += topic_summary->revert_topic_count;
+	  revert->norevert_count += topic_summary->norevert_topic_count;
+	} else {
+	  struct pov_summary* pov_summary = get_ant_pov(args->mmap_info, pov_dist, pov, ant_pov);
+	  revert->revert_count += pov_summary->revert_count;
+	  revert->norevert_count += pov_summary->norevert_count;
+	}
+      }
+    }
+  }
+  return NULL;
+}
+
+void add_posterior_sample(char* posterior, const struct mmap_info* mmap_info,
+			  int num_threads) {
+  struct posterior_header* header = (struct posterior_header*)posterior;
+  const struct revision_assignment_header* revision_assignment_header
+    = (const struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  assert(header->count_revisions == revision_assignment_header->count_revisions);
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  struct posterior_thread_args* args
+    = malloc(sizeof(struct posterior_thread_args) * num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].posterior = posterior;
+    args[i].mmap_info = mmap_info;
+    args[i].sample = i;
+    args[i].modn = num_threads;
+    pthread_create(threads + i, NULL, add_posterior_sample_modn, (void*)(args + i));
+  }
+  void* res;
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], &res);
+  }
+  free(threads);
+  free(args);
+  if (header->samples == 0) {
+    header->first_iteration = revision_assignment_header->total_iterations;
+  }
+  header->last_iteration = revision_assignment_header->total_iterations;
+  header->samples++;
+}
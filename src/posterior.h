@@ -0,0 +1,74 @@
+/* Running sums over posterior samples, accumulated in memory by
+   inference.c and written once at the end (as
+   MMAPS_DIR/posterior_mmap), so that averages over many samples do
+   not need a saved assignment file per sample.
+
+   The file is a struct posterior_header, followed by:
+
+     revision counts: for each revision, a num_topics * pov_per_topic
+     array (int32_t) counting the samples in which it was assigned to
+     each topic and POV;
+
+     user mass: for each user, a num_topics * pov_per_topic array
+     (double) summing the user's topic/POV distribution (including
+     the alpha smoothing) over samples;
+
+     page mass: for each page, a num_topics * pov_per_topic array
+     (double) summing the number of the page's revisions assigned to
+     each topic and POV;
+
+     reverts: for each topic, a pov_per_topic * pov_per_topic array of
+     struct posterior_revert summing the revert and non-revert counts
+     of revisions with each POV (first index) whose parent has each
+     POV (second index) on that topic. Same-POV counts (the diagonal)
+     are the topic's revert_topic_count and norevert_topic_count.
+
+   Dividing any of these by samples gives the posterior mean. The
+   revision counts alone take count_revisions * num_topics *
+   pov_per_topic * 4 bytes. */
+
+#ifndef __POSTERIOR_H__
+#define __POSTERIOR_H__
+
+#include <stdint.h>
+
+#include "parse_mmaps.h"
+
+struct posterior_header {
+  int32_t num_topics;
+  int32_t pov_per_topic;
+  int64_t count_revisions;
+  int64_t num_users;
+  int64_t num_pages;
+  int64_t samples;
+  // total_iterations of the first and last samples added
+  int64_t first_iteration;
+  int64_t last_iteration;
+};
+
+struct posterior_revert {
+  double revert_count;
+  double norevert_count;
+};
+
+int64_t posterior_mmap_size(int32_t num_topics, int32_t pov_per_topic, int64_t count_revisions,
+			    int64_t num_users, int64_t num_pages);
+
+/* Allocate zeroed sums (in memory) for the model in mmap_info. The
+   caller takes ownership, and should free() the result. */
+char* create_posterior(const struct mmap_info* mmap_info, int64_t* posterior_size);
+
+/* Add the current assignments and indexes in mmap_info as one more
+   sample, using num_threads threads. Every thread owns the revisions,
+   users and pages equal to its number mod num_threads, so no locking
+   is needed. The indexes must be up to date (not mid sweep). */
+void add_posterior_sample(char* posterior, const struct mmap_info* mmap_info,
+			  int num_threads);
+
+/* Pointers to the sums for one revision, user, page, or topic. */
+int32_t* posterior_revision_counts(const char* posterior, int64_t revision_id);
+double* posterior_user_mass(const char* posterior, int64_t user_id);
+double* posterior_page_mass(const char* posterior, int64_t page_id);
+struct posterior_revert* posterior_reverts(const char* posterior, int32_t topic);
+
+#endif
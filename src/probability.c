@@ -1,8 +1,11 @@
 #include <assert.h>
+#include <gsl/gsl_rng.h>
 #include <gsl/gsl_sf_gamma.h>
 #include <inttypes.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "index.h"
 #include "parse_mmaps.h"
@@ -234,29 +237,122 @@ void fill_index_patch(const struct mmap_info* mmap_info,
   }
 }
 
-double users_pages_probability_modn(const struct mmap_info* mmap_info, int sample, int modn) {
+#define LGAMMA_TABLE_SIZE 65536
+
+void init_lgamma_table(struct lgamma_table* table, double offset) {
+  table->offset = offset;
+  table->size = LGAMMA_TABLE_SIZE;
+  table->values = malloc(sizeof(double) * table->size);
+  for (int64_t count = 0; count < table->size; ++count) {
+    table->values[count] = gsl_sf_lngamma(count + offset);
+  }
+}
+
+void init_lgamma_tables(const struct mmap_info* mmap_info, struct lgamma_tables* lgamma_tables) {
+  struct revision_assignment_header* revision_assignment_header 
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  struct topic_summary_header* topic_summary_header
+    = (struct topic_summary_header*)mmap_info->topic_index_mmap;
+  init_lgamma_table(&(lgamma_tables->alpha), revision_assignment_header->alpha);
+  init_lgamma_table(&(lgamma_tables->user_total), revision_assignment_header->alpha
+		    * revision_assignment_header->num_topics
+		    * revision_assignment_header->pov_per_topic);
+  init_lgamma_table(&(lgamma_tables->beta), revision_assignment_header->beta);
+  init_lgamma_table(&(lgamma_tables->topic_total), revision_assignment_header->beta
+		    * topic_summary_header->num_pages);
+  init_lgamma_table(&(lgamma_tables->gamma_alpha), revision_assignment_header->gamma_alpha);
+  init_lgamma_table(&(lgamma_tables->gamma_beta), revision_assignment_header->gamma_beta);
+  init_lgamma_table(&(lgamma_tables->gamma_total), revision_assignment_header->gamma_alpha
+		    + revision_assignment_header->gamma_beta);
+  init_lgamma_table(&(lgamma_tables->psi_alpha), revision_assignment_header->psi_alpha);
+  init_lgamma_table(&(lgamma_tables->psi_beta), revision_assignment_header->psi_beta);
+  init_lgamma_table(&(lgamma_tables->psi_total), revision_assignment_header->psi_alpha
+		    + revision_assignment_header->psi_beta);
+}
+
+void free_lgamma_tables(struct lgamma_tables* lgamma_tables) {
+  free(lgamma_tables->alpha.values);
+  free(lgamma_tables->user_total.values);
+  free(lgamma_tables->beta.values);
+  free(lgamma_tables->topic_total.values);
+  free(lgamma_tables->gamma_alpha.values);
+  free(lgamma_tables->gamma_beta.values);
+  free(lgamma_tables->gamma_total.values);
+  free(lgamma_tables->psi_alpha.values);
+  free(lgamma_tables->psi_beta.values);
+  free(lgamma_tables->psi_total.values);
+}
+
+/* Stirling's series. Only used for x > LGAMMA_TABLE_SIZE, where the
+   truncation error is far below double precision. */
+double stirling_lngamma(double x) {
+  double inverse = 1.0 / x;
+  double inverse_squared = inverse * inverse;
+  return (x - 0.5) * log(x) - x + 0.91893853320467274178
+    + inverse * (1.0 / 12.0 - inverse_squared * (1.0 / 360.0 - inverse_squared / 1260.0));
+}
+
+double table_lngamma(const struct lgamma_table* table, double count) {
+  if (count >= table->size) {
+    return stirling_lngamma(count + table->offset);
+  }
+  if (count >= -0.5) {
+    // Counts stored as doubles may have picked up rounding error
+    int64_t index = (int64_t)(count + 0.5);
+    if (fabs(count - (double)index) < 1e-6) {
+      return table->values[index];
+    }
+  }
+  return gsl_sf_lngamma(count + table->offset);
+}
+
+double sum_table_lngamma(const struct lgamma_table* table, const double* values, int64_t count) {
+  double ret = 0.0;
+  for (int64_t i = 0; i < count; ++i) {
+    ret += table_lngamma(table, values[i] - table->offset);
+  }
+  return ret;
+}
+
+double user_probability(const struct mmap_info* mmap_info, int64_t user_num,
+			const struct lgamma_tables* lgamma_tables) {
   struct revision_assignment_header* revision_assignment_header 
     = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
-  struct user_topic_header* user_topic_header = (struct user_topic_header*)mmap_info->user_topic_mmap;
-  double log_likelihood = 0.0;
   int64_t user_edits;
   double* user_topic_pov_dist;
-  int topic_pov_count
-    = revision_assignment_header->num_topics * revision_assignment_header->pov_per_topic;
+  get_user(mmap_info, user_num, &user_edits, NULL);
+  if (user_edits <= 0) {
+    // This user does not actually exist
+    return 0.0;
+  }
+  get_user_topics(mmap_info, user_num, &user_topic_pov_dist);
+  return sum_table_lngamma(&(lgamma_tables->alpha), user_topic_pov_dist,
+			   revision_assignment_header->num_topics
+			   * revision_assignment_header->pov_per_topic)
+    - table_lngamma(&(lgamma_tables->user_total), user_edits);
+}
+
+double page_probability(const struct mmap_info* mmap_info, int64_t page,
+			const struct lgamma_tables* lgamma_tables) {
+  struct revision_assignment_header* revision_assignment_header 
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  double log_likelihood = 0.0;
+  int64_t* page_dist;
+  for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
+    get_topic_summary(mmap_info, topic, NULL, NULL, &page_dist);
+    log_likelihood += table_lngamma(&(lgamma_tables->beta), page_dist[page]);
+  }
+  return log_likelihood;
+}
+
+double users_pages_probability_modn(const struct mmap_info* mmap_info, int sample, int modn,
+				    const struct lgamma_tables* lgamma_tables) {
+  struct revision_assignment_header* revision_assignment_header 
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  struct user_topic_header* user_topic_header = (struct user_topic_header*)mmap_info->user_topic_mmap;
+  double log_likelihood = 0.0;
   for (int64_t user_num = sample; user_num < user_topic_header->num_users; user_num += modn) {
-    get_user(mmap_info, user_num, &user_edits, NULL);
-    get_user_topics(mmap_info, user_num, &user_topic_pov_dist);
-    if (user_edits <= 0) {
-      // This user does not actually exist
-      continue;
-    }
-    log_likelihood -= gsl_sf_lngamma(user_edits + revision_assignment_header->alpha * topic_pov_count);
-    for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
-      for (int pov = 0; pov < revision_assignment_header->pov_per_topic; ++pov) {
-	log_likelihood += gsl_sf_lngamma(user_topic_pov_dist[topic * revision_assignment_header->pov_per_topic
-							     + pov]);
-      }
-    }
+    log_likelihood += user_probability(mmap_info, user_num, lgamma_tables);
   }
   struct topic_summary_header* topic_summary_header
     = (struct topic_summary_header*)mmap_info->topic_index_mmap;
@@ -264,17 +360,68 @@ double users_pages_probability_modn(const struct mmap_info* mmap_info, int sampl
   for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
     get_topic_summary(mmap_info, topic, NULL, NULL, &page_dist);
     for (int64_t page = sample; page < topic_summary_header->num_pages; page += modn) {
-      log_likelihood += gsl_sf_lngamma(page_dist[page] + revision_assignment_header->beta);
+      log_likelihood += table_lngamma(&(lgamma_tables->beta), page_dist[page]);
     }
   }
   return log_likelihood;
 }
 
 double log_likelihood(const struct mmap_info* mmap_info) {
-  return log_likelihood_gamma(mmap_info, 1);
+  struct lgamma_tables lgamma_tables;
+  init_lgamma_tables(mmap_info, &lgamma_tables);
+  double ret = log_likelihood_gamma(mmap_info, 1, &lgamma_tables);
+  free_lgamma_tables(&lgamma_tables);
+  return ret;
+}
+
+double topic_pov_probability_modn(const struct mmap_info* mmap_info, int sample, int modn,
+				  const struct lgamma_tables* lgamma_tables) {
+  struct revision_assignment_header* revision_assignment_header 
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  struct topic_summary* topic_summary;
+  struct pov_summary* pov_dist;
+  struct pov_summary* pov_summary;
+  double log_likelihood = 0.0;
+  int topic_pov_count
+    = revision_assignment_header->num_topics * revision_assignment_header->pov_per_topic;
+  for (int topic_pov = sample; topic_pov < topic_pov_count; topic_pov += modn) {
+    int topic = topic_pov / revision_assignment_header->pov_per_topic;
+    int pov = topic_pov % revision_assignment_header->pov_per_topic;
+    get_topic_summary(mmap_info, topic, &topic_summary, &pov_dist, NULL);
+    if (pov == 0) {
+      log_likelihood -= table_lngamma(&(lgamma_tables->topic_total), topic_summary->total_revisions);
+      // General reverts
+      log_likelihood += table_lngamma(&(lgamma_tables->gamma_alpha),
+				      topic_summary->revert_general_count);
+      log_likelihood += table_lngamma(&(lgamma_tables->gamma_beta),
+				      topic_summary->norevert_general_count);
+      log_likelihood -= table_lngamma(&(lgamma_tables->gamma_total),
+				      topic_summary->revert_general_count
+				      + topic_summary->norevert_general_count);
+      // Topic reverts
+      log_likelihood += table_lngamma(&(lgamma_tables->gamma_alpha),
+				      topic_summary->revert_topic_count);
+      log_likelihood += table_lngamma(&(lgamma_tables->gamma_beta),
+				      topic_summary->norevert_topic_count);
+      log_likelihood -= table_lngamma(&(lgamma_tables->gamma_total),
+				      topic_summary->revert_topic_count
+				      + topic_summary->norevert_topic_count);
+    }
+    // POV reverts
+    for (int ant_pov = 0; ant_pov < revision_assignment_header->pov_per_topic - 1; ++ant_pov) {
+      pov_summary = pov_dist + pov * (revision_assignment_header->pov_per_topic - 1) + ant_pov;
+      log_likelihood += table_lngamma(&(lgamma_tables->psi_alpha), pov_summary->revert_count);
+      log_likelihood += table_lngamma(&(lgamma_tables->psi_beta), pov_summary->norevert_count);
+      log_likelihood -= table_lngamma(&(lgamma_tables->psi_total),
+				      pov_summary->revert_count
+				      + pov_summary->norevert_count);
+    }
+  }
+  return log_likelihood;
 }
 
-double log_likelihood_gamma(const struct mmap_info* mmap_info, int include_users_pages) {
+double log_likelihood_gamma(const struct mmap_info* mmap_info, int include_modn_terms,
+			    const struct lgamma_tables* lgamma_tables) {
   struct user_topic_header* user_topic_header = (struct user_topic_header*)mmap_info->user_topic_mmap;
   struct revision_assignment_header* revision_assignment_header 
     = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
@@ -285,57 +432,17 @@ double log_likelihood_gamma(const struct mmap_info* mmap_info, int include_users
     * gsl_sf_lngamma(revision_assignment_header->alpha * topic_pov_count);
   log_likelihood -= user_topic_header->num_users * topic_pov_count
     * gsl_sf_lngamma(revision_assignment_header->alpha);
-  if (include_users_pages) {
-    log_likelihood += users_pages_probability_modn(mmap_info, 0, 1);
+  if (include_modn_terms) {
+    log_likelihood += users_pages_probability_modn(mmap_info, 0, 1, lgamma_tables);
+    log_likelihood += topic_pov_probability_modn(mmap_info, 0, 1, lgamma_tables);
   }
   
   struct topic_summary_header* topic_summary_header
     = (struct topic_summary_header*)mmap_info->topic_index_mmap;
-  struct topic_summary* topic_summary;
-  struct pov_summary* pov_dist;
-  struct pov_summary* pov_summary;
   log_likelihood += revision_assignment_header->num_topics 
     * gsl_sf_lngamma(revision_assignment_header->beta * topic_summary_header->num_pages);
   log_likelihood -= revision_assignment_header->num_topics * topic_summary_header->num_pages
     * gsl_sf_lngamma(revision_assignment_header->beta);
-  for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
-    get_topic_summary(mmap_info, topic, &topic_summary, &pov_dist, NULL);
-    log_likelihood -= gsl_sf_lngamma(topic_summary->total_revisions + revision_assignment_header->beta
-				     * topic_summary_header->num_pages);
-    // General reverts
-    log_likelihood += gsl_sf_lngamma(topic_summary->revert_general_count
-				     + revision_assignment_header->gamma_alpha);
-    log_likelihood += gsl_sf_lngamma(topic_summary->norevert_general_count
-				     + revision_assignment_header->gamma_beta);
-    log_likelihood -= gsl_sf_lngamma(topic_summary->revert_general_count
-				     + topic_summary->norevert_general_count
-				     + revision_assignment_header->gamma_alpha
-				     + revision_assignment_header->gamma_beta);
-    // Topic reverts
-    log_likelihood += gsl_sf_lngamma(topic_summary->revert_topic_count
-				     + revision_assignment_header->gamma_alpha);
-    log_likelihood += gsl_sf_lngamma(topic_summary->norevert_topic_count
-				     + revision_assignment_header->gamma_beta);
-    log_likelihood -= gsl_sf_lngamma(topic_summary->revert_topic_count
-				     + topic_summary->norevert_topic_count
-				     + revision_assignment_header->gamma_alpha
-				     + revision_assignment_header->gamma_beta);
-    
-    // POV reverts
-    for (int pov = 0; pov < revision_assignment_header->pov_per_topic; ++pov) {
-      for (int ant_pov = 0; ant_pov < revision_assignment_header->pov_per_topic - 1; ++ant_pov) {
-	pov_summary = pov_dist + pov * (revision_assignment_header->pov_per_topic - 1) + ant_pov;
-	log_likelihood += gsl_sf_lngamma(pov_summary->revert_count
-					 + revision_assignment_header->psi_alpha);
-	log_likelihood += gsl_sf_lngamma(pov_summary->norevert_count
-					 + revision_assignment_header->psi_beta);
-	log_likelihood -= gsl_sf_lngamma(pov_summary->revert_count
-					 + pov_summary->norevert_count
-					 + revision_assignment_header->psi_alpha
-					 + revision_assignment_header->psi_beta);
-      }
-    }
-  }
   log_likelihood += 2 * revision_assignment_header->num_topics
     * gsl_sf_lngamma(revision_assignment_header->gamma_alpha + revision_assignment_header->gamma_beta);
   log_likelihood -= 2 * revision_assignment_header->num_topics 
@@ -358,3 +465,200 @@ double log_likelihood_gamma(const struct mmap_info* mmap_info, int include_users
 
   return log_likelihood;
 }
+
+/* Choose count of the ids [0, population) uniformly without
+   replacement, in increasing order (Knuth's selection sampling). */
+int64_t* select_ids(int64_t population, int64_t count, gsl_rng* rand_gen) {
+  int64_t* ids = malloc(sizeof(int64_t) * (count > 0 ? count : 1));
+  assert(ids != NULL);
+  int64_t chosen = 0;
+  for (int64_t id = 0; id < population && chosen < count; ++id) {
+    if ((population - id) * gsl_rng_uniform(rand_gen) < count - chosen) {
+      ids[chosen++] = id;
+    }
+  }
+  assert(chosen == count);
+  return ids;
+}
+
+void init_likelihood_subsample(const struct mmap_info* mmap_info, double fraction,
+			       unsigned long int seed,
+			       struct likelihood_subsample* subsample) {
+  assert(fraction > 0.0 && fraction <= 1.0);
+  struct user_topic_header* user_topic_header = (struct user_topic_header*)mmap_info->user_topic_mmap;
+  struct topic_summary_header* topic_summary_header
+    = (struct topic_summary_header*)mmap_info->topic_index_mmap;
+  subsample->num_users = user_topic_header->num_users;
+  subsample->num_pages = topic_summary_header->num_pages;
+  subsample->count_users = ceil(fraction * subsample->num_users);
+  subsample->count_pages = ceil(fraction * subsample->num_pages);
+  gsl_rng* rand_gen = gsl_rng_alloc(gsl_rng_default);
+  gsl_rng_set(rand_gen, seed);
+  subsample->users = select_ids(subsample->num_users, subsample->count_users, rand_gen);
+  subsample->pages = select_ids(subsample->num_pages, subsample->count_pages, rand_gen);
+  gsl_rng_free(rand_gen);
+  subsample->user_terms = malloc(sizeof(double) * (subsample->count_users > 0
+						    ? subsample->count_users : 1));
+  subsample->page_terms = malloc(sizeof(double) * (subsample->count_pages > 0
+						    ? subsample->count_pages : 1));
+  assert(subsample->user_terms != NULL && subsample->page_terms != NULL);
+}
+
+void free_likelihood_subsample(struct likelihood_subsample* subsample) {
+  free(subsample->users);
+  free(subsample->pages);
+  free(subsample->user_terms);
+  free(subsample->page_terms);
+  subsample->users = NULL;
+  subsample->pages = NULL;
+  subsample->user_terms = NULL;
+  subsample->page_terms = NULL;
+}
+
+void subsample_probability_modn(const struct mmap_info* mmap_info,
+				const struct likelihood_subsample* subsample,
+				int sample, int modn,
+				const struct lgamma_tables* lgamma_tables) {
+  for (int64_t i = sample; i < subsample->count_users; i += modn) {
+    subsample->user_terms[i] = user_probability(mmap_info, subsample->users[i], lgamma_tables);
+  }
+  for (int64_t i = sample; i < subsample->count_pages; i += modn) {
+    subsample->page_terms[i] = page_probability(mmap_info, subsample->pages[i], lgamma_tables);
+  }
+}
+
+/* Scale the mean term of a simple random sample of count out of
+   population up to the population total, adding the variance of that
+   estimate (with finite population correction) to *variance. */
+double estimate_total(const double* terms, int64_t count, int64_t population,
+		      double* variance) {
+  if (count <= 0) {
+    return 0.0;
+  }
+  double sum = 0.0;
+  for (int64_t i = 0; i < count; ++i) {
+    sum += terms[i];
+  }
+  double mean = sum / count;
+  if (count > 1 && count < population) {
+    // Deviations from the mean, since the terms are large and close together
+    double sum_squares = 0.0;
+    for (int64_t i = 0; i < count; ++i) {
+      sum_squares += (terms[i] - mean) * (terms[i] - mean);
+    }
+    *variance += (double)population * population * (1.0 - (double)count / population)
+      * sum_squares / (count - 1) / count;
+  }
+  return mean * population;
+}
+
+double subsample_estimate(const struct likelihood_subsample* subsample,
+			  double* half_width) {
+  double variance = 0.0;
+  double estimate = estimate_total(subsample->user_terms, subsample->count_users,
+				   subsample->num_users, &variance)
+    + estimate_total(subsample->page_terms, subsample->count_pages,
+		     subsample->num_pages, &variance);
+  if (half_width != NULL) {
+    // 95% normal interval
+    *half_width = 1.96 * sqrt(variance);
+  }
+  return estimate;
+}
+
+/* Change in lngamma(count + own_prior) + lngamma(other_count + other_prior)
+   - lngamma(count + other_count + own_prior + other_prior) when count
+   changes by change_by. */
+double count_pair_delta(int64_t count, int64_t other_count,
+			double own_prior, double other_prior, int change_by) {
+  if (change_by > 0) {
+    return log((double)count + own_prior)
+      - log((double)(count + other_count) + own_prior + other_prior);
+  } else {
+    return log((double)(count - 1 + other_count) + own_prior + other_prior)
+      - log((double)(count - 1) + own_prior);
+  }
+}
+
+double topic_index_counter_delta(const struct mmap_info* mmap_info, int64_t location,
+				 int change_by) {
+  if (location < (int64_t)sizeof(struct topic_summary_header)) {
+    return 0.0;
+  }
+  struct revision_assignment_header* revision_assignment_header 
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  struct topic_summary_header* topic_summary_header
+    = (struct topic_summary_header*)mmap_info->topic_index_mmap;
+  int64_t pov_size = sizeof(struct pov_summary) * topic_summary_header->pov_per_topic 
+    * (topic_summary_header->pov_per_topic - 1);
+  int64_t topic_size = pov_size + sizeof(struct topic_summary);
+  int64_t relative = location - sizeof(struct topic_summary_header);
+  int64_t within_topic = relative % topic_size;
+  char* base = mmap_info->topic_index_mmap + sizeof(struct topic_summary_header)
+    + (relative / topic_size) * topic_size;
+  if (within_topic < (int64_t)sizeof(struct topic_summary)) {
+    struct topic_summary* topic_summary = (struct topic_summary*)base;
+    double beta_total = revision_assignment_header->beta * topic_summary_header->num_pages;
+    switch (within_topic) {
+    case offsetof(struct topic_summary, total_revisions):
+      // Enters the likelihood as -lngamma(total_revisions + beta * num_pages)
+      if (change_by > 0) {
+	return -log((double)topic_summary->total_revisions + beta_total);
+      } else {
+	return log((double)(topic_summary->total_revisions - 1) + beta_total);
+      }
+    case offsetof(struct topic_summary, revert_general_count):
+      return count_pair_delta(topic_summary->revert_general_count,
+			      topic_summary->norevert_general_count,
+			      revision_assignment_header->gamma_alpha,
+			      revision_assignment_header->gamma_beta, change_by);
+    case offsetof(struct topic_summary, norevert_general_count):
+      return count_pair_delta(topic_summary->norevert_general_count,
+			      topic_summary->revert_general_count,
+			      revision_assignment_header->gamma_beta,
+			      revision_assignment_header->gamma_alpha, change_by);
+    case offsetof(struct topic_summary, revert_topic_count):
+      return count_pair_delta(topic_summary->revert_topic_count,
+			      topic_summary->norevert_topic_count,
+			      revision_assignment_header->gamma_alpha,
+			      revision_assignment_header->gamma_beta, change_by);
+    case offsetof(struct topic_summary, norevert_topic_count):
+      return count_pair_delta(topic_summary->norevert_topic_count,
+			      topic_summary->revert_topic_count,
+			      revision_assignment_header->gamma_beta,
+			      revision_assignment_header->gamma_alpha, change_by);
+    }
+    assert(0);
+  }
+  int64_t within_pov = within_topic - sizeof(struct topic_summary);
+  struct pov_summary* pov_summary = (struct pov_summary*)(base + sizeof(struct topic_summary))
+    + within_pov / sizeof(struct pov_summary);
+  if (within_pov % sizeof(struct pov_summary) == offsetof(struct pov_summary, revert_count)) {
+    return count_pair_delta(pov_summary->revert_count, pov_summary->norevert_count,
+			    revision_assignment_header->psi_alpha,
+			    revision_assignment_header->psi_beta, change_by);
+  } else {
+    return count_pair_delta(pov_summary->norevert_count, pov_summary->revert_count,
+			    revision_assignment_header->psi_beta,
+			    revision_assignment_header->psi_alpha, change_by);
+  }
+}
+
+double user_topic_delta(double user_topic_pov_value, int change_by) {
+  if (change_by > 0) {
+    return log(user_topic_pov_value);
+  } else {
+    return -log(user_topic_pov_value - 1.0);
+  }
+}
+
+double page_topic_delta(const struct mmap_info* mmap_info, int64_t page_topic_count,
+			int change_by) {
+  struct revision_assignment_header* revision_assignment_header 
+    = (struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  if (change_by > 0) {
+    return log((double)page_topic_count + revision_assignment_header->beta);
+  } else {
+    return -log((double)(page_topic_count - 1) + revision_assignment_header->beta);
+  }
+}
@@ -4,6 +4,8 @@
 #ifndef __PROBABILITY_H__
 #define __PROBABILITY_H__
 
+#include <stdint.h>
+
 /* Sometimes, usually when sampling, it is necessary temporarily
    "patch out" a specific assignment. This struct provides information
    about which assignment is being temporarily disregarded. Also used
@@ -24,25 +26,132 @@ struct index_patch {
   int64_t user;
 };
 
+/* Nearly every log gamma evaluated by the likelihood is of an integer
+   count plus a fixed hyperparameter offset. An lgamma_table caches
+   lngamma(count + offset) for counts below size; larger counts use
+   Stirling's series (accurate to double precision at these sizes),
+   and anything else (non-integer or negative counts) falls back to
+   gsl_sf_lngamma. */
+struct lgamma_table {
+  double offset;
+  int64_t size;
+  double* values;
+};
+
+/* One table per offset appearing in the likelihood. */
+struct lgamma_tables {
+  struct lgamma_table alpha; // User (topic, POV) cells
+  struct lgamma_table user_total; // alpha * num_topics * pov_per_topic
+  struct lgamma_table beta; // (topic, page) cells
+  struct lgamma_table topic_total; // beta * num_pages
+  struct lgamma_table gamma_alpha;
+  struct lgamma_table gamma_beta;
+  struct lgamma_table gamma_total; // gamma_alpha + gamma_beta
+  struct lgamma_table psi_alpha;
+  struct lgamma_table psi_beta;
+  struct lgamma_table psi_total; // psi_alpha + psi_beta
+};
+
 struct mmap_info;
 struct revision_assignment;
 
+/* Log gamma tables */
+
+/* Fill tables for the hyperparameters in the revision assignment
+   header, and free them. */
+void init_lgamma_tables(const struct mmap_info* mmap_info, struct lgamma_tables* lgamma_tables);
+void free_lgamma_tables(struct lgamma_tables* lgamma_tables);
+
+/* lngamma(count + table->offset). */
+double table_lngamma(const struct lgamma_table* table, double count);
+
+/* Sum of lngamma(values[i]) for values which already include
+   table->offset (such as user topic/POV distributions, which start
+   at alpha). */
+double sum_table_lngamma(const struct lgamma_table* table, const double* values, int64_t count);
+
 /* Log likelihood functions */
 
 /* Compute the log likelihood of current assignments without
    parallelism. */
 double log_likelihood(const struct mmap_info* mmap_info);
 
-/* Compute the log likelihood of all disagreements, optionally
-   including page and (topic, POV) selection probabilities. To compute
-   the page and (topic, POV) selection probabilities in parallel,
-   users_pages_probability_modn must be called separately. */
-double log_likelihood_gamma(const struct mmap_info* mmap_info, int include_users_pages);
+/* Compute the terms of the log likelihood which depend only on the
+   hyperparameters, optionally including the terms which depend on
+   assignments. To compute the assignment dependent terms in parallel,
+   users_pages_probability_modn and topic_pov_probability_modn must be
+   called separately for each sample. */
+double log_likelihood_gamma(const struct mmap_info* mmap_info, int include_modn_terms,
+			    const struct lgamma_tables* lgamma_tables);
+
+/* Evaluate the log likelihood of all disagreements (general, topic
+   and POV reverts) and of the topic totals, over (topic, POV) pairs
+   numbered topic * pov_per_topic + pov such that number % modn ==
+   sample. Topic-level terms are included with POV 0. */
+double topic_pov_probability_modn(const struct mmap_info* mmap_info, int sample, int modn,
+				  const struct lgamma_tables* lgamma_tables);
 
 /* Evaluate the log likelihood of the current assignments of topics
    and POVs across pages and users such that id % modn ==
    sample. Useful for parallel log likelihood evaluations. */
-double users_pages_probability_modn(const struct mmap_info* mmap_info, int sample, int modn);
+double users_pages_probability_modn(const struct mmap_info* mmap_info, int sample, int modn,
+				    const struct lgamma_tables* lgamma_tables);
+
+/* Subsampled log likelihood estimates */
+
+/* A fixed random subset of users and pages. The user and page terms
+   dominate the cost of the likelihood, so they can be estimated from
+   the subset (scaled up to the full population), while the cheaper
+   topic and POV terms are computed exactly. Since the subset does
+   not change between iterations, successive estimates share most of
+   their sampling error, and track the likelihood's trend more
+   closely than the confidence interval suggests. */
+struct likelihood_subsample {
+  int64_t num_users;
+  int64_t num_pages;
+  int64_t count_users;
+  int64_t* users;
+  int64_t count_pages;
+  int64_t* pages;
+  // Each selected user's and page's term, from the last evaluation
+  double* user_terms;
+  double* page_terms;
+};
+
+/* Select (the ceiling of) fraction of users and pages using a
+   generator seeded with seed, and free the selection. */
+void init_likelihood_subsample(const struct mmap_info* mmap_info, double fraction,
+			       unsigned long int seed,
+			       struct likelihood_subsample* subsample);
+void free_likelihood_subsample(struct likelihood_subsample* subsample);
+
+/* Compute the terms of the subsample's users and pages in positions
+   such that position % modn == sample, storing them in user_terms and
+   page_terms. */
+void subsample_probability_modn(const struct mmap_info* mmap_info,
+				const struct likelihood_subsample* subsample,
+				int sample, int modn,
+				const struct lgamma_tables* lgamma_tables);
+/* Estimate the total of all user and page terms from the terms of the
+   whole subsample, storing the half width of a 95% confidence
+   interval in half_width (if it is not NULL). */
+double subsample_estimate(const struct likelihood_subsample* subsample,
+			  double* half_width);
+
+/* Incremental log likelihood helpers. Each returns the exact change
+   in the log likelihood caused by a single +1 or -1 change, given the
+   counts before the change is applied. */
+
+/* Change to the topic_index_mmap counter at byte offset location
+   (the header's dummy variable contributes nothing). */
+double topic_index_counter_delta(const struct mmap_info* mmap_info, int64_t location,
+				 int change_by);
+/* Change to a user's (topic, POV) cell, which currently holds
+   user_topic_pov_value (a count plus alpha). */
+double user_topic_delta(double user_topic_pov_value, int change_by);
+/* Change to a (topic, page) count. */
+double page_topic_delta(const struct mmap_info* mmap_info, int64_t page_topic_count,
+			int change_by);
 
 /* Sampling helper functions */
 
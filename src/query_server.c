@@ -0,0 +1,311 @@
+/* Answer small queries about the current model over a Unix domain
+   socket, so that the mmaps are opened once rather than by a tool per
+   question. The model is opened read-only (nothing is written back),
+   and the antagonism tables and POV controversies are computed once
+   at startup.
+
+   threads worker threads each accept one connection at a time, so at
+   most threads clients are served at once (others wait to be
+   accepted). Requests are single lines, each answered by a single
+   line, "ok ..." or "error message":
+
+     user ID         the user's normalized topic/POV distribution
+		     (num_topics * pov_per_topic values, topic major)
+     pair ID1 ID2    antagonism between two users (as compare_users)
+     page ID         the page's most common (topic, POV), the fraction
+		     of its edits on it, and the topic/POV entropy
+		     (as page_user_stats); "-1 -1 0 0" with no edits
+     topic ID        the controversy of each POV on the topic (as
+		     page_user_stats)
+     stats           requests answered so far, and the p50 and p99
+		     latency in microseconds
+
+   Latency is measured from reading a request to flushing its answer.
+   On SIGINT or SIGTERM, the latency summary is written to stderr and
+   the socket is removed. */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "comparisons.h"
+#include "index.h"
+#include "parse_mmaps.h"
+#include "sample.h"
+
+#define MAX_REQUEST_LENGTH 256
+#define ACCEPT_RETRY_SECONDS 1
+/* Latency histogram: bucket b holds latencies from 2^(b / 8) to
+   2^((b + 1) / 8) nanoseconds, so percentiles are within about 9%. */
+#define LATENCY_BUCKETS_PER_DOUBLING 8
+#define LATENCY_BUCKETS (40 * LATENCY_BUCKETS_PER_DOUBLING)
+
+struct query_model {
+  struct mmap_info mmap_info;
+  int num_topics;
+  int pov_per_topic;
+  int64_t num_users;
+  int64_t num_pages;
+  struct antagonism_tables antagonism_tables;
+  double* controversy_by_pov;
+};
+
+struct latency_histogram {
+  int64_t counts[LATENCY_BUCKETS];
+  int64_t total;
+};
+
+struct server_thread_args {
+  const struct query_model* model;
+  struct latency_histogram* latencies;
+  int listen_fd;
+};
+
+void record_latency(struct latency_histogram* latencies, double nanoseconds) {
+  int bucket = 0;
+  if (nanoseconds > 1.0) {
+    bucket = (int)(log2(nanoseconds) * LATENCY_BUCKETS_PER_DOUBLING);
+  }
+  if (bucket >= LATENCY_BUCKETS) {
+    bucket = LATENCY_BUCKETS - 1;
+  }
+  __sync_fetch_and_add(latencies->counts + bucket, 1);
+  __sync_fetch_and_add(&(latencies->total), 1);
+}
+
+// The upper edge of the bucket containing the quantile, in microseconds.
+double latency_quantile(const struct latency_histogram* latencies, double quantile) {
+  int64_t total = latencies->total;
+  if (total == 0) {
+    return 0.0;
+  }
+  int64_t seen = 0;
+  int bucket;
+  for (bucket = 0; bucket < LATENCY_BUCKETS - 1; ++bucket) {
+    seen += latencies->counts[bucket];
+    if (seen >= quantile * total) {
+      break;
+    }
+  }
+  return exp2((double)(bucket + 1) / LATENCY_BUCKETS_PER_DOUBLING) / 1000.0;
+}
+
+void answer_user(const struct query_model* model, int64_t user_id, FILE* out) {
+  double* topic_pov_dist;
+  get_user_topics(&(model->mmap_info), user_id, &topic_pov_dist);
+  double normalizer = model->antagonism_tables.user_normalizers[user_id];
+  fprintf(out, "ok");
+  for (int cell = 0; cell < model->num_topics * model->pov_per_topic; ++cell) {
+    fprintf(out, " %lf", topic_pov_dist[cell] * normalizer);
+  }
+  fprintf(out, "\n");
+}
+
+void answer_page(const struct query_model* model, struct pov_workspace* pov_workspace,
+		 int64_t page_id, FILE* out) {
+  int64_t count_revisions;
+  const int64_t* revision_ids;
+  get_page(&(model->mmap_info), page_id, &count_revisions, &revision_ids);
+  if (count_revisions == 0) {
+    fprintf(out, "ok -1 -1 0 0\n");
+    return;
+  }
+  int64_t count_on_max;
+  int max_topic;
+  int max_pov;
+  double entropy;
+  edits_on_max_pov(&(model->mmap_info), pov_workspace, revision_ids, count_revisions,
+		   &count_on_max, &max_topic, &max_pov, &entropy);
+  fprintf(out, "ok %d %d %lf %lf\n", max_topic, max_pov,
+	  (double)count_on_max / (double)count_revisions, entropy);
+}
+
+/* Write the answer to one request line (an error if it is malformed
+   or out of range) to out. */
+void answer_request(const struct query_model* model, struct pov_workspace* pov_workspace,
+		    const struct latency_histogram* latencies, const char* request, FILE* out) {
+  char command[16];
+  int64_t first;
+  int64_t second;
+  int count_args = sscanf(request, "%15s %" SCNd64 " %" SCNd64, command, &first, &second);
+  if (count_args < 1) {
+    fprintf(out, "error empty request\n");
+  } else if (strcmp(command, "user") == 0 && count_args == 2) {
+    if (first < 0 || first >= model->num_users) {
+      fprintf(out, "error no user %" PRId64 "\n", first);
+    } else {
+      answer_user(model, first, out);
+    }
+  } else if (strcmp(command, "pair") == 0 && count_args == 3) {
+    if (first < 0 || first >= model->num_users || second < 0 || second >= model->num_users) {
+      fprintf(out, "error no user pair %" PRId64 " %" PRId64 "\n", first, second);
+    } else {
+      fprintf(out, "ok %lf\n", table_user_antagonism(&(model->mmap_info),
+						      &(model->antagonism_tables),
+						      first, second));
+    }
+  } else if (strcmp(command, "page") == 0 && count_args == 2) {
+    if (first < 0 || first >= model->num_pages) {
+      fprintf(out, "error no page %" PRId64 "\n", first);
+    } else {
+      answer_page(model, pov_workspace, first, out);
+    }
+  } else if (strcmp(command, "topic") == 0 && count_args == 2) {
+    if (first < 0 || first >= model->num_topics) {
+      fprintf(out, "error no topic %" PRId64 "\n", first);
+    } else {
+      fprintf(out, "ok");
+      for (int pov = 0; pov < model->pov_per_topic; ++pov) {
+	fprintf(out, " %lf", model->controversy_by_pov[first * model->pov_per_topic + pov]);
+      }
+      fprintf(out, "\n");
+    }
+  } else if (strcmp(command, "stats") == 0 && count_args == 1) {
+    fprintf(out, "ok %" PRId64 " %lf %lf\n", latencies->total,
+	    latency_quantile(latencies, 0.5), latency_quantile(latencies, 0.99));
+  } else {
+    fprintf(out, "error unknown request\n");
+  }
+}
+
+void serve_connection(const struct server_thread_args* args,
+		      struct pov_workspace* pov_workspace, int connection_fd) {
+  FILE* in = fdopen(connection_fd, "r");
+  if (in == NULL) {
+    fprintf(stderr, "Could not open connection: %s\n", strerror(errno));
+    close(connection_fd);
+    return;
+  }
+  // Out of descriptors, accept can succeed and dup still fail
+  int out_fd = dup(connection_fd);
+  FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+  if (out == NULL) {
+    fprintf(stderr, "Could not open connection: %s\n", strerror(errno));
+    if (out_fd >= 0) {
+      close(out_fd);
+    }
+    fclose(in);
+    return;
+  }
+  char request[MAX_REQUEST_LENGTH];
+  while (fgets(request, sizeof(request), in) != NULL) {
+    double start = monotonic_seconds();
+    if (strchr(request, '\n') == NULL && !feof(in)) {
+      // Skip the rest of an overlong line
+      int c;
+      while ((c = fgetc(in)) != EOF && c != '\n') {
+      }
+      fprintf(out, "error request too long\n");
+    } else {
+      answer_request(args->model, pov_workspace, args->latencies, request, out);
+    }
+    if (fflush(out) != 0) {
+      break;
+    }
+    record_latency(args->latencies, (monotonic_seconds() - start) * 1e9);
+  }
+  fclose(in);
+  fclose(out);
+}
+
+void* server_thread(void* void_args) {
+  const struct server_thread_args* args = void_args;
+  struct pov_workspace pov_workspace;
+  init_pov_workspace(&(args->model->mmap_info), &pov_workspace);
+  while (1) {
+    int connection_fd = accept(args->listen_fd, NULL, NULL);
+    if (connection_fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+	// For example out of file descriptors; back off rather than spin
+	fprintf(stderr, "accept failed: %s\n", strerror(errno));
+	sleep(ACCEPT_RETRY_SECONDS);
+      }
+      continue;
+    }
+    serve_connection(args, &pov_workspace, connection_fd);
+  }
+  return NULL;
+}
+
+void open_query_model(const char* mmap_directory, struct query_model* model) {
+  model->mmap_info = open_mmaps_readonly(mmap_directory);
+  const struct revision_assignment_header* revision_assignment_header
+    = (const struct revision_assignment_header*)model->mmap_info.revision_assignment_mmap;
+  const struct topic_summary_header* topic_summary_header
+    = (const struct topic_summary_header*)model->mmap_info.topic_index_mmap;
+  const struct user_topic_header* user_topic_header
+    = (const struct user_topic_header*)model->mmap_info.user_topic_mmap;
+  model->num_topics = revision_assignment_header->num_topics;
+  model->pov_per_topic = revision_assignment_header->pov_per_topic;
+  model->num_users = user_topic_header->num_users;
+  model->num_pages = topic_summary_header->num_pages;
+  init_antagonism_tables(&(model->mmap_info), &(model->antagonism_tables));
+  fill_antagonism_tables(&(model->mmap_info), &(model->antagonism_tables));
+  model->controversy_by_pov = malloc(sizeof(double) * model->num_topics * model->pov_per_topic);
+  all_pov_controversy(&(model->mmap_info), model->controversy_by_pov);
+}
+
+int open_listen_socket(const char* socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", socket_path);
+    exit(1);
+  }
+  strcpy(address.sun_path, socket_path);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0
+      || listen(listen_fd, SOMAXCONN) != 0) {
+    fprintf(stderr, "Could not listen on %s\n", socket_path);
+    exit(1);
+  }
+  return listen_fd;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    printf("Usage: %s mmap_directory socket_path threads\n", argv[0]);
+    exit(1);
+  }
+  int num_threads = atoi(argv[3]);
+  assert(num_threads > 0);
+  struct query_model model;
+  open_query_model(argv[1], &model);
+  int listen_fd = open_listen_socket(argv[2]);
+
+  // Only the main thread handles signals, waiting in sigwait below
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  // A client disconnecting mid-answer fails the write instead
+  signal(SIGPIPE, SIG_IGN);
+
+  struct latency_histogram latencies;
+  memset(&latencies, 0, sizeof(latencies));
+  struct server_thread_args args = {&model, &latencies, listen_fd};
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_create(threads + i, NULL, server_thread, (void*)&args);
+  }
+  fprintf(stderr, "Listening on %s\n", argv[2]);
+  int signal_number;
+  sigwait(&signals, &signal_number);
+  fprintf(stderr, "%" PRId64 " requests, p50 %lf us, p99 %lf us\n", latencies.total,
+	  latency_quantile(&latencies, 0.5), latency_quantile(&latencies, 0.99));
+  close(listen_fd);
+  unlink(argv[2]);
+  return 0;
+}
@@ -2,7 +2,12 @@
    to stdout, optionally iteratively maximizing the assignments first
    (to find a high-probability assignments). Even if performing
    maximization, the current assignments should be post-burn-in for
-   best results. */
+   best results. Maximization anneals from initial_temperature
+   (default 1, see anneal_maximize), writing its progress to stderr;
+   an initial_temperature of 0 only maximizes, as readout did before
+   annealing was added. If revisions were stored with string
+   identifiers, the page title and user name are appended to each line
+   (tab separated). */
 
 #include <assert.h>
 #include <gsl/gsl_rng.h>
@@ -19,13 +24,19 @@
 #include "sample.h"
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    printf("Usage: %s mmap_directory maximization_iterations threads\n",
+  if (argc != 4 && argc != 5) {
+    printf("Usage: %s mmap_directory maximization_iterations threads [initial_temperature]\n",
            argv[0]);
     exit(1);
   }
   int maximization_iterations = atoi(argv[2]);
   int num_threads = atoi(argv[3]);
+  double initial_temperature;
+  if (argc >= 5) {
+    initial_temperature = atof(argv[4]);
+  } else {
+    initial_temperature = 1.0;
+  }
   struct mmap_info mmap_info = open_mmaps_readonly(argv[1]);
   int64_t count_revisions;
   struct revision_assignment* revision_assignments;
@@ -34,9 +45,7 @@ int main(int argc, char **argv) {
   if (maximization_iterations > 0) {
     struct sample_threads sample_threads;
     initialize_threads(&sample_threads, num_threads, &mmap_info);
-    for (int i = 0; i < maximization_iterations; ++i) {
-      resample_maximize(&sample_threads);
-    }
+    anneal_maximize(&sample_threads, maximization_iterations, initial_temperature, stderr);
     destroy_threads(&sample_threads);
   }
   for (int64_t revision_num = 0; revision_num < count_revisions; ++revision_num) {
@@ -44,10 +53,17 @@ int main(int argc, char **argv) {
 	|| revision_assignments[revision_num].topic < 0) {
       continue;
     }
-    printf("%" PRId64 " %d %d\n", 
+    printf("%" PRId64 " %d %d", 
 	   revision_num, 
 	   revision_assignments[revision_num].topic, 
 	   revision_assignments[revision_num].pov);
+    const struct revision* revision = get_revision(&mmap_info, revision_num);
+    const char* page_name = get_page_name(&mmap_info, revision->article);
+    const char* user_name = get_user_name(&mmap_info, revision->user);
+    if (page_name != NULL && user_name != NULL) {
+      printf("\t%s\t%s", page_name, user_name);
+    }
+    printf("\n");
   }
   close_mmaps(mmap_info);
 }
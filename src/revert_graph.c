@@ -0,0 +1,295 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "index.h"
+#include "parse_mmaps.h"
+#include "revert_graph.h"
+
+const char* REVERT_GRAPH_MMAP_NAME = "revert_graph_mmap";
+
+struct revert_triple {
+  int64_t reverter;
+  int64_t reverted;
+  int64_t page;
+};
+
+struct graph_build_args {
+  const struct mmap_info* mmap_info;
+  int sample;
+  int modn;
+  const struct graph_build_args* all_args;
+  int64_t num_users;
+  // Disagreements found in this thread's range of revisions
+  struct revert_triple* triples;
+  int64_t count_triples;
+  int64_t triples_size;
+  /* Shared, indexed by user (each thread only writes users equal to
+     sample mod modn): triple, edge and page counts and offsets. */
+  int64_t* triple_offsets;
+  int64_t* edge_offsets;
+  int64_t* page_offsets;
+  struct revert_triple* sorted_triples;
+  // The output
+  struct revert_edge* edges;
+  int64_t* edge_page_offsets;
+  int64_t* pages;
+};
+
+void* collect_reverts(void* void_args) {
+  struct graph_build_args* args = void_args;
+  int64_t count_revisions = ((const struct revision_header*)args->mmap_info->revision_mmap)
+    ->count_revisions;
+  int64_t end = count_revisions * (args->sample + 1) / args->modn;
+  for (int64_t revision_id = count_revisions * args->sample / args->modn; revision_id < end;
+       ++revision_id) {
+    const struct revision* revision = get_revision(args->mmap_info, revision_id);
+    if (!revision->disagrees || revision->parent < 0) {
+      continue;
+    }
+    const struct revision* parent = get_revision(args->mmap_info, revision->parent);
+    if (parent->user == revision->user) {
+      continue;
+    }
+    if (args->count_triples == args->triples_size) {
+      args->triples_size = args->triples_size * 2 + 1024;
+      args->triples = realloc(args->triples, sizeof(struct revert_triple) * args->triples_size);
+      assert(args->triples != NULL);
+    }
+    struct revert_triple* triple = args->triples + args->count_triples++;
+    triple->reverter = revision->user;
+    triple->reverted = parent->user;
+    triple->page = revision->article;
+  }
+  return NULL;
+}
+
+void* count_triples(void* void_args) {
+  struct graph_build_args* args = void_args;
+  for (int thread = 0; thread < args->modn; ++thread) {
+    const struct graph_build_args* other = args->all_args + thread;
+    for (int64_t i = 0; i < other->count_triples; ++i) {
+      if (other->triples[i].reverter % args->modn == args->sample) {
+	args->triple_offsets[other->triples[i].reverter + 1]++;
+      }
+    }
+  }
+  return NULL;
+}
+
+int compare_triples(const void* first_void, const void* second_void) {
+  const struct revert_triple* first = first_void;
+  const struct revert_triple* second = second_void;
+  if (first->reverted != second->reverted) {
+    return (first->reverted > second->reverted) - (first->reverted < second->reverted);
+  }
+  return (first->page > second->page) - (first->page < second->page);
+}
+
+/* Place this thread's users' triples, sort each user's, and count the
+   distinct edges and (edge, page) pairs. */
+void* sort_triples(void* void_args) {
+  struct graph_build_args* args = void_args;
+  int64_t* positions = malloc(sizeof(int64_t) * (args->num_users / args->modn + 1));
+  for (int64_t user_id = args->sample; user_id < args->num_users; user_id += args->modn) {
+    positions[user_id / args->modn] = args->triple_offsets[user_id];
+  }
+  for (int thread = 0; thread < args->modn; ++thread) {
+    const struct graph_build_args* other = args->all_args + thread;
+    for (int64_t i = 0; i < other->count_triples; ++i) {
+      int64_t user_id = other->triples[i].reverter;
+      if (user_id % args->modn == args->sample) {
+	args->sorted_triples[positions[user_id / args->modn]++] = other->triples[i];
+      }
+    }
+  }
+  free(positions);
+  for (int64_t user_id = args->sample; user_id < args->num_users; user_id += args->modn) {
+    struct revert_triple* row = args->sorted_triples + args->triple_offsets[user_id];
+    int64_t count = args->triple_offsets[user_id + 1] - args->triple_offsets[user_id];
+    qsort(row, count, sizeof(struct revert_triple), compare_triples);
+    for (int64_t i = 0; i < count; ++i) {
+      if (i == 0 || row[i].reverted != row[i - 1].reverted) {
+	args->edge_offsets[user_id + 1]++;
+	args->page_offsets[user_id + 1]++;
+      } else if (row[i].page != row[i - 1].page) {
+	args->page_offsets[user_id + 1]++;
+      }
+    }
+  }
+  return NULL;
+}
+
+void* write_edges(void* void_args) {
+  struct graph_build_args* args = void_args;
+  for (int64_t user_id = args->sample; user_id < args->num_users; user_id += args->modn) {
+    const struct revert_triple* row = args->sorted_triples + args->triple_offsets[user_id];
+    int64_t count = args->triple_offsets[user_id + 1] - args->triple_offsets[user_id];
+    int64_t edge = args->edge_offsets[user_id] - 1;
+    int64_t page = args->page_offsets[user_id];
+    for (int64_t i = 0; i < count; ++i) {
+      if (i == 0 || row[i].reverted != row[i - 1].reverted) {
+	++edge;
+	args->edges[edge].user = row[i].reverted;
+	args->edges[edge].count = 0;
+	if (args->pages != NULL) {
+	  args->edge_page_offsets[edge] = page;
+	}
+      } else if (row[i].page == row[i - 1].page) {
+	args->edges[edge].count++;
+	continue;
+      }
+      args->edges[edge].count++;
+      if (args->pages != NULL) {
+	args->pages[page] = row[i].page;
+      }
+      ++page;
+    }
+  }
+  return NULL;
+}
+
+void run_graph_threads(struct graph_build_args* args, int num_threads, void* (*work)(void*)) {
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_create(threads + i, NULL, work, (void*)(args + i));
+  }
+  void* res;
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], &res);
+  }
+  free(threads);
+}
+
+void prefix_sums(int64_t* counts, int64_t length) {
+  for (int64_t i = 1; i < length; ++i) {
+    counts[i] += counts[i - 1];
+  }
+}
+
+void build_revert_graph(const struct mmap_info* mmap_info, const char* file_name,
+			int with_pages, int num_threads) {
+  assert(num_threads > 0);
+  int64_t num_users = ((const struct user_header*)mmap_info->user_mmap)->count_users;
+  int64_t* triple_offsets = calloc(num_users + 1, sizeof(int64_t));
+  int64_t* edge_offsets = calloc(num_users + 1, sizeof(int64_t));
+  int64_t* page_offsets = calloc(num_users + 1, sizeof(int64_t));
+  struct graph_build_args* args = calloc(num_threads, sizeof(struct graph_build_args));
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].mmap_info = mmap_info;
+    args[i].sample = i;
+    args[i].modn = num_threads;
+    args[i].all_args = args;
+    args[i].num_users = num_users;
+    args[i].triple_offsets = triple_offsets;
+    args[i].edge_offsets = edge_offsets;
+    args[i].page_offsets = page_offsets;
+  }
+  run_graph_threads(args, num_threads, collect_reverts);
+  run_graph_threads(args, num_threads, count_triples);
+  prefix_sums(triple_offsets, num_users + 1);
+  struct revert_triple* sorted_triples
+    = malloc(sizeof(struct revert_triple) * (triple_offsets[num_users] + 1));
+  assert(sorted_triples != NULL);
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].sorted_triples = sorted_triples;
+  }
+  run_graph_threads(args, num_threads, sort_triples);
+  prefix_sums(edge_offsets, num_users + 1);
+  prefix_sums(page_offsets, num_users + 1);
+
+  int64_t count_edges = edge_offsets[num_users];
+  int64_t count_pages = with_pages ? page_offsets[num_users] : 0;
+  int64_t mmap_size = sizeof(struct revert_graph_header)
+    + sizeof(int64_t) * (num_users + 1) + sizeof(struct revert_edge) * count_edges;
+  if (with_pages) {
+    mmap_size += sizeof(int64_t) * (count_edges + 1 + count_pages);
+  }
+  char* graph_mmap = create_mmap(file_name, mmap_size);
+  struct revert_graph_header* header = (struct revert_graph_header*)graph_mmap;
+  header->magic = REVERT_GRAPH_MAGIC;
+  header->num_users = num_users;
+  header->count_edges = count_edges;
+  header->has_pages = with_pages;
+  header->count_pages = count_pages;
+  int64_t* row_offsets = (int64_t*)(graph_mmap + sizeof(struct revert_graph_header));
+  memcpy(row_offsets, edge_offsets, sizeof(int64_t) * (num_users + 1));
+  struct revert_edge* edges = (struct revert_edge*)(row_offsets + num_users + 1);
+  int64_t* edge_page_offsets = NULL;
+  int64_t* pages = NULL;
+  if (with_pages) {
+    edge_page_offsets = (int64_t*)(edges + count_edges);
+    pages = edge_page_offsets + count_edges + 1;
+    edge_page_offsets[count_edges] = count_pages;
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].edges = edges;
+    args[i].edge_page_offsets = edge_page_offsets;
+    args[i].pages = pages;
+  }
+  run_graph_threads(args, num_threads, write_edges);
+  munmap(graph_mmap, mmap_size);
+
+  for (int i = 0; i < num_threads; ++i) {
+    free(args[i].triples);
+  }
+  free(args);
+  free(sorted_triples);
+  free(triple_offsets);
+  free(edge_offsets);
+  free(page_offsets);
+}
+
+int is_revert_graph_file(const char* file_name) {
+  FILE* file = fopen(file_name, "r");
+  if (file == NULL) {
+    return 0;
+  }
+  int64_t magic = 0;
+  int read = fread(&magic, sizeof(int64_t), 1, file);
+  fclose(file);
+  return read == 1 && magic == REVERT_GRAPH_MAGIC;
+}
+
+void open_revert_graph(const char* file_name, struct revert_graph* graph) {
+  graph->mmap = open_mmap_read(file_name, &(graph->mmap_size));
+  graph->header = (const struct revert_graph_header*)graph->mmap;
+  if (graph->header->magic != REVERT_GRAPH_MAGIC) {
+    fprintf(stderr, "%s is not a revert graph\n", file_name);
+    exit(1);
+  }
+  graph->row_offsets = (const int64_t*)(graph->mmap + sizeof(struct revert_graph_header));
+  graph->edges = (const struct revert_edge*)(graph->row_offsets + graph->header->num_users + 1);
+  if (graph->header->has_pages) {
+    graph->page_offsets = (const int64_t*)(graph->edges + graph->header->count_edges);
+    graph->pages = graph->page_offsets + graph->header->count_edges + 1;
+  } else {
+    graph->page_offsets = NULL;
+    graph->pages = NULL;
+  }
+}
+
+void close_revert_graph(struct revert_graph* graph) {
+  munmap(graph->mmap, graph->mmap_size);
+}
+
+void get_revert_edges(const struct revert_graph* graph, int64_t user_id,
+		      int64_t* count_edges, const struct revert_edge** edges) {
+  assert(user_id >= 0 && user_id < graph->header->num_users);
+  *count_edges = graph->row_offsets[user_id + 1] - graph->row_offsets[user_id];
+  *edges = graph->edges + graph->row_offsets[user_id];
+}
+
+void get_edge_pages(const struct revert_graph* graph, int64_t edge_number,
+		    int64_t* count_pages, const int64_t** pages) {
+  if (graph->page_offsets == NULL) {
+    *count_pages = 0;
+    *pages = NULL;
+    return;
+  }
+  *count_pages = graph->page_offsets[edge_number + 1] - graph->page_offsets[edge_number];
+  *pages = graph->pages + graph->page_offsets[edge_number];
+}
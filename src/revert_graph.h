@@ -0,0 +1,72 @@
+/* A graph of who disagreed with whom: an edge from user A to user B
+   for each pair such that some edit by A disagrees with (reverts) its
+   parent edit, made by B. Stored in compressed sparse row form, so
+   that the edges from A are contiguous and sorted by B. Edits
+   disagreeing with the same user's edit are not counted.
+
+   The mmap is a struct revert_graph_header followed by num_users + 1
+   row offsets (int64_t; the edges from user A are edges[offsets[A]]
+   up to edges[offsets[A + 1] - 1]), then count_edges struct
+   revert_edge. If has_pages is set, this is followed by count_edges
+   + 1 page offsets (int64_t, into the page array, as for rows) and
+   count_pages page IDs (int64_t): for each edge, the distinct pages
+   its disagreements were on, in increasing order. */
+
+#ifndef __REVERT_GRAPH_H__
+#define __REVERT_GRAPH_H__
+
+#include <stdint.h>
+
+#include "parse_mmaps.h"
+
+// "WPRVGR01"
+#define REVERT_GRAPH_MAGIC 0x3130524756525057LL
+
+extern const char* REVERT_GRAPH_MMAP_NAME;
+
+struct revert_graph_header {
+  int64_t magic;
+  int64_t num_users;
+  int64_t count_edges;
+  int64_t has_pages;
+  int64_t count_pages;
+};
+
+struct revert_edge {
+  int64_t user;
+  // Number of disagreeing edits
+  int64_t count;
+};
+
+struct revert_graph {
+  char* mmap;
+  int64_t mmap_size;
+  const struct revert_graph_header* header;
+  const int64_t* row_offsets;
+  const struct revert_edge* edges;
+  // NULL unless has_pages is set
+  const int64_t* page_offsets;
+  const int64_t* pages;
+};
+
+/* Build the graph from the revisions in mmap_info using num_threads
+   threads, and write it to file_name. */
+void build_revert_graph(const struct mmap_info* mmap_info, const char* file_name,
+			int with_pages, int num_threads);
+
+/* Returns 1 if file_name is a revert graph mmap. */
+int is_revert_graph_file(const char* file_name);
+/* Open a graph as a read-only memory map. */
+void open_revert_graph(const char* file_name, struct revert_graph* graph);
+void close_revert_graph(struct revert_graph* graph);
+
+/* The edges from user_id. The graph retains ownership. The edge
+   number of (*edges)[i] (for get_edge_pages) is
+   graph->row_offsets[user_id] + i. */
+void get_revert_edges(const struct revert_graph* graph, int64_t user_id,
+		      int64_t* count_edges, const struct revert_edge** edges);
+/* The pages of an edge; count_pages is 0 if the graph has no pages. */
+void get_edge_pages(const struct revert_graph* graph, int64_t edge_number,
+		    int64_t* count_pages, const int64_t** pages);
+
+#endif
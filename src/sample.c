@@ -8,9 +8,15 @@
 #include <time.h>
 
 #include "index.h"
+#include "philox.h"
 #include "probability.h"
 #include "sample.h"
 
+/* Set in the sweep word of the counter-based random numbers drawn when
+   initializing assignments, so that they never coincide with those of
+   a later sampling sweep with the same number. */
+#define INITIALIZE_RNG_STREAM (UINT64_C(1) << 63)
+
 struct index_update {
   int64_t subtract_locations[4];
   int64_t add_locations[4];
@@ -40,12 +46,12 @@ void sample_random(const double* sampling_array,
 		   double probability_sum,
 		   int num_topics, int pov_per_topic,
 		   int* chosen_topic, int* chosen_pov,
-		   gsl_rng* rand_gen);
+		   double uniform);
 void sample_maximize(const double* sampling_array,
 		     double probability_sum,
 		     int num_topics, int pov_per_topic,
 		     int* chosen_topic, int* chosen_pov,
-		     gsl_rng* rand_gen);
+		     double uniform);
 
 /* Other interal functions */
 
@@ -58,7 +64,7 @@ double resample_internal(struct sample_threads* sample_threads,
 						  double probability_sum,
 						  int num_topics, int pov_per_topic,
 						  int* chosen_topic, int* chosen_pov,
-						  gsl_rng* rand_gen),
+						  double uniform),
 			 int increment);
 void initialize_sample_thread(const struct mmap_info* mmap_info,
 			      pthread_mutex_t* queue_lock, 
@@ -72,6 +78,15 @@ void initialize_sample_thread(const struct mmap_info* mmap_info,
 			      char* allocated_topic_dist);
 void destroy_sample_thread(struct sample_thread_info* thread_info);
 
+void lock_user(struct sample_thread_info* thread_info, int64_t user, int write);
+void lock_queue(struct sample_thread_info* thread_info);
+void merge_sample_stats(struct sample_stats* total, const struct sample_stats* thread_stats,
+			int first);
+
+void parallel_copy(char* destination, const char* source, int64_t length, int num_threads);
+void parallel_round_user_topics(struct sample_threads* sample_threads);
+int64_t topic_summary_size(const struct mmap_info* mmap_info);
+
 void resample_page(struct sample_thread_info* thread_info, int64_t page_id);
 void* resample_pages_modn(void* tinfo);
 void* log_likelihood_modn(void* tinfo);
@@ -177,6 +192,23 @@ void apply_index_update_sub(const struct mmap_info* mmap_info,
 		      + patch->subtract_locations[3]) -= 1) >= 0);
 }
 
+/* Equivalent to apply_index_update, but returns the change in log
+   likelihood. */
+double apply_index_update_tracked(const struct mmap_info* mmap_info, 
+				  const struct index_update* patch) {
+  double delta = 0.0;
+  for (int i = 0; i < 4; ++i) {
+    delta += topic_index_counter_delta(mmap_info, patch->add_locations[i], 1);
+    *(int64_t*)(mmap_info->topic_index_mmap + patch->add_locations[i]) += 1;
+  }
+  for (int i = 0; i < 4; ++i) {
+    delta += topic_index_counter_delta(mmap_info, patch->subtract_locations[i], -1);
+    assert((*(int64_t*)(mmap_info->topic_index_mmap 
+			+ patch->subtract_locations[i]) -= 1) >= 0);
+  }
+  return delta;
+}
+
 void apply_index_update_add(const struct mmap_info* mmap_info, 
 			    const struct index_update* patch) {
   *(int64_t*)(mmap_info->topic_index_mmap + patch->add_locations[0]) += 1;
@@ -191,16 +223,19 @@ void resample(struct sample_threads* sample_threads) {
 }
 
 void resample_uniform(struct sample_threads* sample_threads) {
+  sample_threads->track_likelihood = 0;
   resample_internal(sample_threads, resample_initialize, 
 		    apply_index_update_add, sample_random, 1);
 }
 
 void resample_null(struct sample_threads* sample_threads) {
+  sample_threads->track_likelihood = 0;
   resample_internal(sample_threads, null_assignment, 
 		    apply_index_update_add, sample_random, 1);
 }
 
 void resample_zero(struct sample_threads* sample_threads) {
+  sample_threads->track_likelihood = 0;
   resample_internal(sample_threads, resample_destroy, 
 		    apply_index_update_sub, sample_random, -1);
 }
@@ -210,6 +245,49 @@ void resample_maximize(struct sample_threads* sample_threads) {
 		    apply_index_update, sample_maximize, 1);
 }
 
+void resample_anneal(struct sample_threads* sample_threads, double temperature) {
+  assert(temperature >= 0.0);
+  if (temperature == 0.0) {
+    resample_maximize(sample_threads);
+    return;
+  }
+  for (int i = 0; i < sample_threads->num_threads; ++i) {
+    sample_threads->thread_info[i].temperature = temperature;
+  }
+  resample_internal(sample_threads, resample_revision, 
+		    apply_index_update, sample_random, 1);
+  for (int i = 0; i < sample_threads->num_threads; ++i) {
+    sample_threads->thread_info[i].temperature = 1.0;
+  }
+}
+
+double anneal_maximize(struct sample_threads* sample_threads, int max_sweeps,
+		       double initial_temperature, FILE* progress) {
+  int was_tracking = sample_threads->track_likelihood;
+  start_likelihood_tracking(sample_threads);
+  int cooling_sweeps = (initial_temperature > 0.0) ? max_sweeps / 2 : 0;
+  for (int sweep = 0; sweep < max_sweeps; ++sweep) {
+    double temperature = 0.0;
+    if (sweep < cooling_sweeps) {
+      temperature = initial_temperature 
+	* pow(ANNEAL_FINAL_TEMPERATURE / initial_temperature, 
+	      (double)sweep / (cooling_sweeps > 1 ? cooling_sweeps - 1 : 1));
+    }
+    resample_anneal(sample_threads, temperature);
+    if (progress != NULL) {
+      fprintf(progress, "%d %lf %" PRId64 " %lf\n", sweep + 1, temperature,
+	      sample_threads->stats.changed_revisions, 
+	      tracked_log_likelihood(sample_threads));
+    }
+    if (temperature == 0.0 && sample_threads->stats.changed_revisions == 0) {
+      break;
+    }
+  }
+  sample_threads->track_likelihood = was_tracking;
+  // Return an exact value, free of tracking drift
+  return parallel_log_likelihood(sample_threads);
+}
+
 void resample_restore(struct sample_threads* sample_threads,
 		      const struct revision_assignment* revision_assignments) {
   for (int i = 0; i < sample_threads->num_threads; ++i) {
@@ -219,6 +297,194 @@ void resample_restore(struct sample_threads* sample_threads,
 		    apply_index_update, sample_random, 1);
 }
 
+struct restore_change {
+  int64_t revision_id;
+  // Set if the revision's own assignment changes, not just its parent's
+  int changed;
+};
+
+struct restore_args {
+  const struct mmap_info* mmap_info;
+  const struct revision_assignment* revision_assignments;
+  int sample;
+  int modn;
+  // This thread's part of the change list (found by collect_changes_modn)
+  struct restore_change* changes;
+  int64_t count_changes;
+  int64_t changes_size;
+  // Every thread's args, to walk the whole change list
+  const struct restore_args* all_args;
+  // Changes to topic summary counters, indexed like the topic index
+  int64_t* summary_delta;
+  int change_by;
+};
+
+void add_restore_change(struct restore_args* args, int64_t revision_id, int changed) {
+  if (args->count_changes == args->changes_size) {
+    args->changes_size = args->changes_size * 2 + 64;
+    args->changes = realloc(args->changes, sizeof(struct restore_change) * args->changes_size);
+    assert(args->changes != NULL);
+  }
+  args->changes[args->count_changes].revision_id = revision_id;
+  args->changes[args->count_changes].changed = changed;
+  args->count_changes++;
+}
+
+int assignment_differs(const struct revision_assignment* first,
+		       const struct revision_assignment* second) {
+  return first->topic != second->topic || first->pov != second->pov;
+}
+
+void* collect_changes_modn(void* void_args) {
+  struct restore_args* args = void_args;
+  int64_t count_revisions;
+  struct revision_assignment* current;
+  get_revision_assignment_array(args->mmap_info, &count_revisions, &current);
+  for (int64_t revision_id = args->sample; revision_id < count_revisions;
+       revision_id += args->modn) {
+    if (!assignment_differs(current + revision_id, args->revision_assignments + revision_id)) {
+      continue;
+    }
+    add_restore_change(args, revision_id, 1);
+    // Its child's revert counts depend on this assignment too
+    int64_t child = get_revision(args->mmap_info, revision_id)->child;
+    if (child >= 0 && !assignment_differs(current + child,
+					  args->revision_assignments + child)) {
+      add_restore_change(args, child, 0);
+    }
+  }
+  return NULL;
+}
+
+/* Add change_by times the index counts of every listed revision under
+   the current assignments. Topic summary counts go to this thread's
+   summary_delta (for every (sample)th change overall); page and user
+   counts are changed directly for pages and users equal to sample mod
+   modn, so no two threads touch the same counter. */
+void* apply_changes_modn(void* void_args) {
+  struct restore_args* args = void_args;
+  const struct mmap_info* mmap_info = args->mmap_info;
+  int pov_per_topic = ((struct revision_assignment_header*)
+		       mmap_info->revision_assignment_mmap)->pov_per_topic;
+  int64_t position = 0;
+  for (int thread = 0; thread < args->modn; ++thread) {
+    const struct restore_args* list = args->all_args + thread;
+    for (int64_t i = 0; i < list->count_changes; ++i, ++position) {
+      const struct restore_change* change = list->changes + i;
+      const struct revision* revision = get_revision(mmap_info, change->revision_id);
+      const struct revision_assignment* assignment
+	= get_revision_assignment(mmap_info, change->revision_id);
+      if (position % args->modn == args->sample) {
+	int parent_topic = -1;
+	int parent_pov = -1;
+	if (revision->parent >= 0) {
+	  const struct revision_assignment* parent_assignment
+	    = get_revision_assignment(mmap_info, revision->parent);
+	  parent_topic = parent_assignment->topic;
+	  parent_pov = parent_assignment->pov;
+	}
+	int64_t first_update;
+	int64_t second_update;
+	update_locations(mmap_info, parent_topic, parent_pov,
+			 assignment->topic, assignment->pov, revision->disagrees,
+			 &first_update, &second_update);
+	args->summary_delta[first_update / sizeof(int64_t)] += args->change_by;
+	args->summary_delta[second_update / sizeof(int64_t)] += args->change_by;
+      }
+      if (!change->changed || assignment->topic < 0 || assignment->pov < 0) {
+	continue;
+      }
+      if (revision->article % args->modn == args->sample) {
+	int64_t* page_dist;
+	get_topic_summary(mmap_info, assignment->topic, NULL, NULL, &page_dist);
+	assert((page_dist[revision->article] += args->change_by) >= 0);
+      }
+      if (revision->user % args->modn == args->sample) {
+	double* user_topic_pov_dist;
+	get_user_topics(mmap_info, revision->user, &user_topic_pov_dist);
+	assert((user_topic_pov_dist[assignment->topic * pov_per_topic + assignment->pov]
+		+= args->change_by) >= 0.0);
+      }
+    }
+  }
+  return NULL;
+}
+
+void* assign_changes_modn(void* void_args) {
+  struct restore_args* args = void_args;
+  for (int64_t i = 0; i < args->count_changes; ++i) {
+    int64_t revision_id = args->changes[i].revision_id;
+    *get_revision_assignment(args->mmap_info, revision_id)
+      = args->revision_assignments[revision_id];
+  }
+  return NULL;
+}
+
+void run_restore_phase(struct restore_args* args, int num_threads,
+		       void* (*phase)(void*)) {
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_create(threads + i, NULL, phase, (void*)(args + i));
+  }
+  void* res;
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], &res);
+  }
+  free(threads);
+}
+
+int64_t restore_changes(struct sample_threads* sample_threads,
+			const struct revision_assignment* revision_assignments) {
+  int num_threads = sample_threads->num_threads;
+  // Thread 0 holds the original topic index; the others hold copies
+  const struct mmap_info* mmap_info = &(sample_threads->thread_info[0].mmap_info);
+  int64_t summary_size = topic_summary_size(mmap_info);
+  int64_t summary_counters = summary_size / sizeof(int64_t);
+  struct restore_args* args = calloc(num_threads, sizeof(struct restore_args));
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].mmap_info = mmap_info;
+    args[i].revision_assignments = revision_assignments;
+    args[i].sample = i;
+    args[i].modn = num_threads;
+    args[i].all_args = args;
+    args[i].summary_delta = calloc(summary_counters, sizeof(int64_t));
+    assert(args[i].summary_delta != NULL);
+  }
+  run_restore_phase(args, num_threads, collect_changes_modn);
+  // Remove the old counts, switch assignments, and add the new counts
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].change_by = -1;
+  }
+  run_restore_phase(args, num_threads, apply_changes_modn);
+  run_restore_phase(args, num_threads, assign_changes_modn);
+  for (int i = 0; i < num_threads; ++i) {
+    args[i].change_by = 1;
+  }
+  run_restore_phase(args, num_threads, apply_changes_modn);
+
+  int64_t* summary = (int64_t*)mmap_info->topic_index_mmap;
+  int64_t count_changed = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    for (int64_t counter = 0; counter < summary_counters; ++counter) {
+      summary[counter] += args[i].summary_delta[counter];
+    }
+    for (int64_t change = 0; change < args[i].count_changes; ++change) {
+      count_changed += args[i].changes[change].changed;
+    }
+    free(args[i].summary_delta);
+    free(args[i].changes);
+  }
+  free(args);
+  // Updates without a counter of their own go to _dummy_var
+  ((struct topic_summary_header*)mmap_info->topic_index_mmap)->_dummy_var = INT64_MAX / 2;
+  for (int i = 1; i < num_threads; ++i) {
+    memcpy(sample_threads->thread_info[i].mmap_info.topic_index_mmap,
+	   mmap_info->topic_index_mmap, summary_size);
+  }
+  sample_threads->track_likelihood = 0;
+  return count_changed;
+}
+
 double transition_probability(struct sample_threads* sample_threads,
 			    const struct revision_assignment* revision_assignments) {
   for (int i = 0; i < sample_threads->num_threads; ++i) {
@@ -241,10 +507,29 @@ double resample_internal(struct sample_threads* sample_threads,
 						  double probability_sum,
 						  int num_topics, int pov_per_topic,
 						  int* chosen_topic, int* chosen_pov,
-						  gsl_rng* rand_gen),
+						  double uniform),
 			 int increment) {
+  if (index_update_function != apply_index_update) {
+    sample_threads->track_likelihood = 0;
+  }
+  double start = monotonic_seconds();
+  sample_threads->sweep++;
+  int deterministic = (sample_threads->deterministic && revision_callback == resample_revision);
+  if (deterministic) {
+    parallel_round_user_topics(sample_threads);
+    parallel_copy(sample_threads->user_topic_snapshot,
+		  sample_threads->thread_info[0].mmap_info.user_topic_mmap,
+		  sample_threads->thread_info[0].mmap_info.user_topic_mmap_size,
+		  sample_threads->num_threads);
+  }
   for (int i = 0; i < sample_threads->num_threads; ++i) {
+    sample_threads->thread_info[i].sweep = sample_threads->sweep;
+    sample_threads->thread_info[i].deterministic = deterministic;
     sample_threads->thread_info[i].output = 0.0;
+    sample_threads->thread_info[i].track_likelihood = sample_threads->track_likelihood;
+    sample_threads->thread_info[i].likelihood_delta = 0.0;
+    memset(&(sample_threads->thread_info[i].stats), 0, sizeof(struct sample_stats));
+    sample_threads->thread_info[i].time_locks = sample_threads->time_locks;
     sample_threads->thread_info[i].revision_callback = revision_callback;
     sample_threads->thread_info[i].index_update_function = index_update_function;
     sample_threads->thread_info[i].sample_function = sample_function;
@@ -259,8 +544,19 @@ double resample_internal(struct sample_threads* sample_threads,
     pthread_join(sample_threads->thread_info[i].thread, &res);
     ret += sample_threads->thread_info[i].output;
   }
+  if (deterministic) {
+    parallel_round_user_topics(sample_threads);
+  }
+  sample_threads->sweep_seconds = monotonic_seconds() - start;
   for (int i = 0; i < sample_threads->num_threads; ++i) {
     reset_thread(sample_threads->thread_info + i);
+    merge_sample_stats(&(sample_threads->stats), &(sample_threads->thread_info[i].stats),
+		       i == 0);
+  }
+  if (sample_threads->track_likelihood) {
+    for (int i = 0; i < sample_threads->num_threads; ++i) {
+      sample_threads->tracked_log_likelihood += sample_threads->thread_info[i].likelihood_delta;
+    }
   }
   sample_threads->queue_location = 0;
   return ret;
@@ -273,6 +569,26 @@ void* initialize_user_topics_modn(void* tinfo) {
   return NULL;
 }
 
+void* round_user_topics_modn(void* tinfo) {
+  struct sample_thread_info* thread_info = (struct sample_thread_info*)tinfo;
+  round_user_topics(&(thread_info->mmap_info),
+		    thread_info->sample_pages, thread_info->mod_n);
+  return NULL;
+}
+
+// Deterministic sweeps start and end from exact user distributions
+void parallel_round_user_topics(struct sample_threads* sample_threads) {
+  for (int i = 0; i < sample_threads->num_threads; ++i) {
+    pthread_create(&(sample_threads->thread_info[i].thread),
+		   NULL, round_user_topics_modn,
+		   (void*)(sample_threads->thread_info + i));
+  }
+  void* res;
+  for (int i = 0; i < sample_threads->num_threads; ++i) {
+    pthread_join(sample_threads->thread_info[i].thread, &res);
+  }
+}
+
 void parallel_initialize_user_topics(struct sample_threads* sample_threads) {
   for (int i = 0; i < sample_threads->num_threads; ++i) {
     pthread_create(&(sample_threads->thread_info[i].thread),
@@ -285,14 +601,25 @@ void parallel_initialize_user_topics(struct sample_threads* sample_threads) {
   }
 }
 
+const struct lgamma_tables* get_lgamma_tables(struct sample_threads* sample_threads) {
+  if (sample_threads->lgamma_tables.alpha.values == NULL) {
+    init_lgamma_tables(&(sample_threads->thread_info[0].mmap_info),
+		       &(sample_threads->lgamma_tables));
+  }
+  return &(sample_threads->lgamma_tables);
+}
+
 double parallel_log_likelihood(struct sample_threads* sample_threads) {
+  get_lgamma_tables(sample_threads);
   for (int i = 0; i < sample_threads->num_threads; ++i) {
+    sample_threads->thread_info[i].lgamma_tables = &(sample_threads->lgamma_tables);
     pthread_create(&(sample_threads->thread_info[i].thread),
 		   NULL, log_likelihood_modn, 
 		   (void*)(sample_threads->thread_info + i));
   }
   void* res;
-  double log_likelihood = log_likelihood_gamma(&(sample_threads->thread_info[0].mmap_info), 0);
+  double log_likelihood = log_likelihood_gamma(&(sample_threads->thread_info[0].mmap_info), 0,
+					       &(sample_threads->lgamma_tables));
   for (int i = 0; i < sample_threads->num_threads; ++i) {
     pthread_join(sample_threads->thread_info[i].thread, &res);
     log_likelihood += *((double*)res);
@@ -301,14 +628,204 @@ double parallel_log_likelihood(struct sample_threads* sample_threads) {
   return log_likelihood;
 }
 
+struct subsample_worker_args {
+  const struct sample_thread_info* thread_info;
+  const struct likelihood_subsample* subsample;
+  double output;
+};
+
+void* subsample_likelihood_modn(void* void_args) {
+  struct subsample_worker_args* args = void_args;
+  const struct sample_thread_info* thread_info = args->thread_info;
+  subsample_probability_modn(&(thread_info->mmap_info), args->subsample,
+			     thread_info->sample_pages, thread_info->mod_n,
+			     thread_info->lgamma_tables);
+  args->output = topic_pov_probability_modn(&(thread_info->mmap_info),
+					    thread_info->sample_pages, thread_info->mod_n,
+					    thread_info->lgamma_tables);
+  return NULL;
+}
+
+double estimate_log_likelihood(struct sample_threads* sample_threads,
+			       const struct likelihood_subsample* subsample,
+			       double* half_width) {
+  get_lgamma_tables(sample_threads);
+  struct subsample_worker_args* worker_args
+    = calloc(sample_threads->num_threads, sizeof(struct subsample_worker_args));
+  for (int i = 0; i < sample_threads->num_threads; ++i) {
+    sample_threads->thread_info[i].lgamma_tables = &(sample_threads->lgamma_tables);
+    worker_args[i].thread_info = sample_threads->thread_info + i;
+    worker_args[i].subsample = subsample;
+    pthread_create(&(sample_threads->thread_info[i].thread),
+		   NULL, subsample_likelihood_modn, 
+		   (void*)(worker_args + i));
+  }
+  void* res;
+  double log_likelihood = log_likelihood_gamma(&(sample_threads->thread_info[0].mmap_info), 0,
+					       &(sample_threads->lgamma_tables));
+  for (int i = 0; i < sample_threads->num_threads; ++i) {
+    pthread_join(sample_threads->thread_info[i].thread, &res);
+    log_likelihood += worker_args[i].output;
+  }
+  free(worker_args);
+  return log_likelihood + subsample_estimate(subsample, half_width);
+}
+
+double start_likelihood_tracking(struct sample_threads* sample_threads) {
+  sample_threads->tracked_log_likelihood = parallel_log_likelihood(sample_threads);
+  sample_threads->track_likelihood = 1;
+  return sample_threads->tracked_log_likelihood;
+}
+
+double tracked_log_likelihood(const struct sample_threads* sample_threads) {
+  assert(sample_threads->track_likelihood);
+  return sample_threads->tracked_log_likelihood;
+}
+
 void* log_likelihood_modn(void* tinfo) {
   struct sample_thread_info* thread_info = (struct sample_thread_info*)tinfo;
   double* ret = malloc(sizeof(double));
   *ret = users_pages_probability_modn(&(thread_info->mmap_info), 
-				thread_info->sample_pages, thread_info->mod_n);
+				thread_info->sample_pages, thread_info->mod_n,
+				thread_info->lgamma_tables)
+    + topic_pov_probability_modn(&(thread_info->mmap_info), 
+				 thread_info->sample_pages, thread_info->mod_n,
+				 thread_info->lgamma_tables);
   return (void*)ret;
 }
 
+struct snapshot_worker_args {
+  const struct likelihood_snapshot* snapshot;
+  int sample;
+  double output;
+};
+
+void* snapshot_likelihood_modn(void* void_args) {
+  struct snapshot_worker_args* args = void_args;
+  args->output = users_pages_probability_modn(&(args->snapshot->mmap_info), args->sample,
+					      args->snapshot->num_threads,
+					      args->snapshot->lgamma_tables)
+    + topic_pov_probability_modn(&(args->snapshot->mmap_info), args->sample,
+				 args->snapshot->num_threads,
+				 args->snapshot->lgamma_tables);
+  return NULL;
+}
+
+void* snapshot_likelihood(void* void_snapshot) {
+  struct likelihood_snapshot* snapshot = void_snapshot;
+  pthread_t* threads = malloc(sizeof(pthread_t) * snapshot->num_threads);
+  struct snapshot_worker_args* worker_args
+    = calloc(snapshot->num_threads, sizeof(struct snapshot_worker_args));
+  for (int i = 0; i < snapshot->num_threads; ++i) {
+    worker_args[i].snapshot = snapshot;
+    worker_args[i].sample = i;
+    pthread_create(threads + i, NULL, snapshot_likelihood_modn, (void*)(worker_args + i));
+  }
+  double log_likelihood = log_likelihood_gamma(&(snapshot->mmap_info), 0,
+					       snapshot->lgamma_tables);
+  void* res;
+  // Reduce in thread order, so results match parallel_log_likelihood
+  for (int i = 0; i < snapshot->num_threads; ++i) {
+    pthread_join(threads[i], &res);
+    log_likelihood += worker_args[i].output;
+  }
+  snapshot->log_likelihood = log_likelihood;
+  free(threads);
+  free(worker_args);
+  return NULL;
+}
+
+void init_likelihood_snapshot(struct likelihood_snapshot* snapshot,
+			      const struct sample_threads* sample_threads,
+			      int num_threads) {
+  assert(num_threads > 0);
+  const struct mmap_info* mmap_info = &(sample_threads->thread_info[0].mmap_info);
+  memcpy(&(snapshot->mmap_info), mmap_info, sizeof(struct mmap_info));
+  snapshot->topic_index_copy = malloc(mmap_info->topic_index_mmap_size);
+  snapshot->user_topic_copy = malloc(mmap_info->user_topic_mmap_size);
+  assert(snapshot->topic_index_copy != NULL && snapshot->user_topic_copy != NULL);
+  snapshot->mmap_info.topic_index_mmap = snapshot->topic_index_copy;
+  snapshot->mmap_info.topic_index_pages_mmap = snapshot->topic_index_copy
+    + (mmap_info->topic_index_pages_mmap - mmap_info->topic_index_mmap);
+  snapshot->mmap_info.user_topic_mmap = snapshot->user_topic_copy;
+  snapshot->lgamma_tables = NULL;
+  snapshot->num_threads = num_threads;
+  snapshot->in_flight = 0;
+  snapshot->iteration = -1;
+  snapshot->log_likelihood = 0.0;
+}
+
+void destroy_likelihood_snapshot(struct likelihood_snapshot* snapshot) {
+  int64_t iteration;
+  double log_likelihood;
+  finish_async_log_likelihood(snapshot, &iteration, &log_likelihood);
+  free(snapshot->topic_index_copy);
+  free(snapshot->user_topic_copy);
+  snapshot->topic_index_copy = NULL;
+  snapshot->user_topic_copy = NULL;
+}
+
+struct copy_args {
+  char* destination;
+  const char* source;
+  int64_t length;
+};
+
+void* copy_range(void* void_args) {
+  struct copy_args* args = void_args;
+  memcpy(args->destination, args->source, args->length);
+  return NULL;
+}
+
+void parallel_copy(char* destination, const char* source, int64_t length, int num_threads) {
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  struct copy_args* args = malloc(sizeof(struct copy_args) * num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    int64_t start = length * i / num_threads;
+    args[i].destination = destination + start;
+    args[i].source = source + start;
+    args[i].length = length * (i + 1) / num_threads - start;
+    pthread_create(threads + i, NULL, copy_range, (void*)(args + i));
+  }
+  void* res;
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], &res);
+  }
+  free(threads);
+  free(args);
+}
+
+void start_async_log_likelihood(struct sample_threads* sample_threads,
+				struct likelihood_snapshot* snapshot,
+				int64_t iteration) {
+  int64_t previous_iteration;
+  double previous_log_likelihood;
+  finish_async_log_likelihood(snapshot, &previous_iteration, &previous_log_likelihood);
+  snapshot->lgamma_tables = get_lgamma_tables(sample_threads);
+  // Between sweeps, every thread's topic summary matches thread 0's
+  const struct mmap_info* mmap_info = &(sample_threads->thread_info[0].mmap_info);
+  parallel_copy(snapshot->topic_index_copy, mmap_info->topic_index_mmap,
+		mmap_info->topic_index_mmap_size, sample_threads->num_threads);
+  parallel_copy(snapshot->user_topic_copy, mmap_info->user_topic_mmap,
+		mmap_info->user_topic_mmap_size, sample_threads->num_threads);
+  snapshot->iteration = iteration;
+  snapshot->in_flight = 1;
+  pthread_create(&(snapshot->thread), NULL, snapshot_likelihood, (void*)snapshot);
+}
+
+int finish_async_log_likelihood(struct likelihood_snapshot* snapshot,
+				int64_t* iteration, double* log_likelihood) {
+  if (!snapshot->in_flight) {
+    return 0;
+  }
+  void* res;
+  pthread_join(snapshot->thread, &res);
+  snapshot->in_flight = 0;
+  *iteration = snapshot->iteration;
+  *log_likelihood = snapshot->log_likelihood;
+  return 1;
+}
+
 int64_t topic_summary_size(const struct mmap_info* mmap_info) {
   struct topic_summary_header* topic_summary_header
     = (struct topic_summary_header*)(mmap_info->topic_index_mmap);
@@ -318,6 +835,28 @@ int64_t topic_summary_size(const struct mmap_info* mmap_info) {
     * topic_summary_header->num_topics;
 }
 
+void use_counter_rng(struct sample_threads* sample_threads, uint64_t seed,
+		     int deterministic) {
+  sample_threads->deterministic = deterministic;
+  if (deterministic && sample_threads->user_topic_snapshot == NULL) {
+    sample_threads->user_topic_snapshot
+      = malloc(sample_threads->thread_info[0].mmap_info.user_topic_mmap_size);
+    assert(sample_threads->user_topic_snapshot != NULL);
+  }
+  for (int i = 0; i < sample_threads->num_threads; ++i) {
+    sample_threads->thread_info[i].counter_rng = 1;
+    sample_threads->thread_info[i].rng_seed = seed;
+    sample_threads->thread_info[i].user_topic_snapshot = sample_threads->user_topic_snapshot;
+  }
+}
+
+void offset_thread_seeds(struct sample_threads* sample_threads, int64_t stream) {
+  for (int i = 0; i < sample_threads->num_threads; ++i) {
+    gsl_rng_set(sample_threads->thread_info[i].rand_gen,
+		time(NULL) + stream * sample_threads->num_threads + i);
+  }
+}
+
 void initialize_threads(struct sample_threads* sample_threads, int num_threads,
 			const struct mmap_info* mmap_info) {
   assert(num_threads > 0);
@@ -333,6 +872,16 @@ void initialize_threads(struct sample_threads* sample_threads, int num_threads,
     = malloc(revision_assignment_header->count_revisions * sizeof(struct index_update));
   assert(sample_threads->index_update_queue != NULL);
   sample_threads->queue_location = 0;
+  memset(&(sample_threads->lgamma_tables), 0, sizeof(struct lgamma_tables));
+  sample_threads->track_likelihood = 0;
+  sample_threads->tracked_log_likelihood = 0.0;
+  memset(&(sample_threads->stats), 0, sizeof(struct sample_stats));
+  sample_threads->sweep_seconds = 0.0;
+  sample_threads->time_locks = 0;
+  // Continue the counter-based random streams where the last run stopped
+  sample_threads->sweep = revision_assignment_header->total_iterations;
+  sample_threads->deterministic = 0;
+  sample_threads->user_topic_snapshot = NULL;
   ((struct topic_summary_header*)mmap_info->topic_index_mmap)->_dummy_var
     = INT64_MAX / 2;
   for (int i = 0; i < sample_threads->num_threads; ++i) {
@@ -363,6 +912,8 @@ void destroy_threads(struct sample_threads* sample_threads) {
   }
   free(sample_threads->thread_info);
   free(sample_threads->index_update_queue);
+  free(sample_threads->user_topic_snapshot);
+  free_lgamma_tables(&(sample_threads->lgamma_tables));
 }
 
 double* allocate_sampling_array(const struct mmap_info* mmap_info) {
@@ -372,6 +923,67 @@ double* allocate_sampling_array(const struct mmap_info* mmap_info) {
 			 * revision_assignment_header->pov_per_topic);
 }
 
+double monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+/* Take the lock for a user's distribution (a write lock if write is
+   set) or the queue lock, timing how long we were blocked if
+   requested. */
+void lock_user(struct sample_thread_info* thread_info, int64_t user, int write) {
+  pthread_rwlock_t* lock = thread_info->user_locks + (user % NUM_USER_LOCKS);
+  if (!thread_info->time_locks) {
+    if (write) {
+      pthread_rwlock_wrlock(lock);
+    } else {
+      pthread_rwlock_rdlock(lock);
+    }
+    return;
+  }
+  double start = monotonic_seconds();
+  if (write) {
+    pthread_rwlock_wrlock(lock);
+  } else {
+    pthread_rwlock_rdlock(lock);
+  }
+  thread_info->stats.user_lock_seconds += monotonic_seconds() - start;
+}
+
+void lock_queue(struct sample_thread_info* thread_info) {
+  if (!thread_info->time_locks) {
+    pthread_mutex_lock(thread_info->queue_lock);
+    return;
+  }
+  double start = monotonic_seconds();
+  pthread_mutex_lock(thread_info->queue_lock);
+  thread_info->stats.queue_lock_seconds += monotonic_seconds() - start;
+}
+
+void merge_sample_stats(struct sample_stats* total, const struct sample_stats* thread_stats,
+			int first) {
+  if (first) {
+    *total = *thread_stats;
+    return;
+  }
+  total->revisions += thread_stats->revisions;
+  total->changed_revisions += thread_stats->changed_revisions;
+  total->pages += thread_stats->pages;
+  total->replayed_updates += thread_stats->replayed_updates;
+  if (thread_stats->max_queue_lag > total->max_queue_lag) {
+    total->max_queue_lag = thread_stats->max_queue_lag;
+  }
+  total->user_lock_seconds += thread_stats->user_lock_seconds;
+  total->queue_lock_seconds += thread_stats->queue_lock_seconds;
+  if (thread_stats->min_thread_seconds < total->min_thread_seconds) {
+    total->min_thread_seconds = thread_stats->min_thread_seconds;
+  }
+  if (thread_stats->max_thread_seconds > total->max_thread_seconds) {
+    total->max_thread_seconds = thread_stats->max_thread_seconds;
+  }
+}
+
 // Requires write lock on queue!
 void push_queue(struct sample_thread_info* thread_info,
 		const struct index_update* index_update) {
@@ -379,21 +991,45 @@ void push_queue(struct sample_thread_info* thread_info,
   *(thread_info->queue_location) += 1;
 }
 
-// Does not require a read lock on queue
-// (but you may need one to get a to_position consistent with other data).
 // Read thread_info->last_queue_position up to but not including to_position
-void pop_queue(struct sample_thread_info* thread_info,
-	       int64_t to_position) {
+void replay_queue(struct sample_thread_info* thread_info,
+		  int64_t to_position) {
   for (; thread_info->last_queue_position < to_position; 
        ++(thread_info->last_queue_position)) {
+    // Every thread applies every update in the same order, so the
+    // change in likelihood can be computed by any one of them.
+    if (thread_info->track_likelihood
+	&& thread_info->last_queue_position % thread_info->mod_n == thread_info->sample_pages) {
+      thread_info->likelihood_delta
+	+= apply_index_update_tracked(&(thread_info->mmap_info), 
+				      thread_info->index_update_queue 
+				      + thread_info->last_queue_position);
+      continue;
+    }
     thread_info->index_update_function(&(thread_info->mmap_info), 
 				       thread_info->index_update_queue 
 				       + thread_info->last_queue_position);
   }
 }
 
+// Does not require a read lock on queue
+// (but you may need one to get a to_position consistent with other data).
+// Like replay_queue, counting the updates read in the sweep's stats
+void pop_queue(struct sample_thread_info* thread_info,
+	       int64_t to_position) {
+  int64_t lag = to_position - thread_info->last_queue_position;
+  if (lag > 0) {
+    thread_info->stats.replayed_updates += lag;
+    if (lag > thread_info->stats.max_queue_lag) {
+      thread_info->stats.max_queue_lag = lag;
+    }
+  }
+  replay_queue(thread_info, to_position);
+}
+
 void reset_thread(struct sample_thread_info* thread_info) {
-  pop_queue(thread_info, *(thread_info->queue_location));
+  // The catch-up after sampling is not counted as queue lag
+  replay_queue(thread_info, *(thread_info->queue_location));
   thread_info->last_queue_position = 0;
   ((struct topic_summary_header*)thread_info->mmap_info.topic_index_mmap)->_dummy_var
     = INT64_MAX / 2;
@@ -429,6 +1065,23 @@ void initialize_sample_thread(const struct mmap_info* mmap_info,
   thread_info->index_update_queue = index_update_queue;
   thread_info->increment = 1;
   thread_info->reference_assignments = NULL;
+  thread_info->lgamma_tables = NULL;
+  thread_info->track_likelihood = 0;
+  thread_info->likelihood_delta = 0.0;
+  memset(&(thread_info->stats), 0, sizeof(struct sample_stats));
+  thread_info->time_locks = 0;
+  thread_info->temperature = 1.0;
+  thread_info->counter_rng = 0;
+  thread_info->rng_seed = 0;
+  thread_info->sweep = 0;
+  thread_info->page_uniforms = NULL;
+  thread_info->page_uniforms_size = 0;
+  thread_info->page_position = 0;
+  thread_info->deterministic = 0;
+  thread_info->user_topic_snapshot = NULL;
+  thread_info->page_updates = NULL;
+  thread_info->count_page_updates = 0;
+  thread_info->page_updates_size = 0;
 }
 
 void destroy_sample_thread(struct sample_thread_info* thread_info) {
@@ -440,14 +1093,18 @@ void destroy_sample_thread(struct sample_thread_info* thread_info) {
   thread_info->user_locks = NULL;
   free(thread_info->allocated_topic_dist);
   thread_info->allocated_topic_dist = NULL;
+  free(thread_info->page_uniforms);
+  thread_info->page_uniforms = NULL;
+  free(thread_info->page_updates);
+  thread_info->page_updates = NULL;
 }
 
 void sample_random(const double* sampling_array,
 		   double probability_sum,
 		   int num_topics, int pov_per_topic,
 		   int* chosen_topic, int* chosen_pov,
-		   gsl_rng* rand_gen) {
-  double chosen = probability_sum * gsl_rng_uniform(rand_gen);
+		   double uniform) {
+  double chosen = probability_sum * uniform;
   double running_sum = 0.0;
   for (int topic = 0; topic < num_topics; ++topic) {
     for (int pov = 0; pov < pov_per_topic; ++pov) {
@@ -465,7 +1122,7 @@ void sample_maximize(const double* sampling_array,
 		     double probability_sum,
 		     int num_topics, int pov_per_topic,
 		     int* chosen_topic, int* chosen_pov,
-		     gsl_rng* rand_gen) {
+		     double uniform) {
   double max_prob = 0.0;
   for (int topic = 0; topic < num_topics; ++topic) {
     for (int pov = 0; pov < pov_per_topic; ++pov) {
@@ -478,6 +1135,49 @@ void sample_maximize(const double* sampling_array,
   }
 }
 
+void record_page_update(struct sample_thread_info* thread_info,
+			const struct index_update* index_update) {
+  if (thread_info->count_page_updates == thread_info->page_updates_size) {
+    thread_info->page_updates_size = 2 * thread_info->page_updates_size + 16;
+    thread_info->page_updates = realloc(thread_info->page_updates,
+					sizeof(struct index_update) 
+					* thread_info->page_updates_size);
+    assert(thread_info->page_updates != NULL);
+  }
+  thread_info->page_updates[thread_info->count_page_updates++] = *index_update;
+}
+
+// Reverse this page's updates, in the opposite order
+void undo_page_updates(struct sample_thread_info* thread_info) {
+  for (int64_t i = thread_info->count_page_updates - 1; i >= 0; --i) {
+    struct index_update inverse;
+    memcpy(inverse.add_locations, thread_info->page_updates[i].subtract_locations,
+	   sizeof(inverse.add_locations));
+    memcpy(inverse.subtract_locations, thread_info->page_updates[i].add_locations,
+	   sizeof(inverse.subtract_locations));
+    thread_info->index_update_function(&(thread_info->mmap_info), &inverse);
+  }
+  thread_info->count_page_updates = 0;
+}
+
+/* Raise each probability to the power 1 / temperature (scaled by the
+   largest, so that low temperatures do not underflow), returning the
+   new sum. */
+double temper(double* sampling_array, int count, double temperature) {
+  double max_prob = 0.0;
+  for (int i = 0; i < count; ++i) {
+    if (sampling_array[i] > max_prob) {
+      max_prob = sampling_array[i];
+    }
+  }
+  double probability_sum = 0.0;
+  for (int i = 0; i < count; ++i) {
+    sampling_array[i] = pow(sampling_array[i] / max_prob, 1.0 / temperature);
+    probability_sum += sampling_array[i];
+  }
+  return probability_sum;
+}
+
 void resample_revision(struct sample_thread_info* thread_info, int64_t revision_id) {
   struct index_patch index_patch;
   int64_t queue_location;
@@ -492,17 +1192,27 @@ void resample_revision(struct sample_thread_info* thread_info, int64_t revision_
   // Patch this revision out of indexes temporarily;
   // pseudo-counts should not take it into account
   fill_index_patch(&(thread_info->mmap_info), revision_id, &index_patch);
-  pthread_rwlock_rdlock(thread_info->user_locks + (revision->user % NUM_USER_LOCKS));
-  // Read queue position
-  queue_location = *(thread_info->queue_location);
-  // Copy user distribution
-  memcpy(thread_info->sampling_array, user_topic_pov_dist,
-	 sizeof(double) * revision_assignment_header->num_topics 
-	 * revision_assignment_header->pov_per_topic);
-  pthread_rwlock_unlock(thread_info->user_locks + (revision->user % NUM_USER_LOCKS));
+  if (thread_info->deterministic) {
+    // Sample from the user distribution as of the start of the sweep,
+    // and ignore other threads' index updates until the sweep ends
+    memcpy(thread_info->sampling_array, 
+	   thread_info->user_topic_snapshot
+	   + ((char*)user_topic_pov_dist - thread_info->mmap_info.user_topic_mmap),
+	   sizeof(double) * revision_assignment_header->num_topics 
+	   * revision_assignment_header->pov_per_topic);
+  } else {
+    lock_user(thread_info, revision->user, 0);
+    // Read queue position
+    queue_location = *(thread_info->queue_location);
+    // Copy user distribution
+    memcpy(thread_info->sampling_array, user_topic_pov_dist,
+	   sizeof(double) * revision_assignment_header->num_topics 
+	   * revision_assignment_header->pov_per_topic);
+    pthread_rwlock_unlock(thread_info->user_locks + (revision->user % NUM_USER_LOCKS));
 
-  // Update distribution from queue
-  pop_queue(thread_info, queue_location);
+    // Update distribution from queue
+    pop_queue(thread_info, queue_location);
+  }
   assert(index_patch.topic >= 0 && index_patch.pov >= 0);
   double probability_sum = 0.0;
   for (int topic = 0; topic < revision_assignment_header->num_topics; ++topic) {
@@ -519,6 +1229,18 @@ void resample_revision(struct sample_thread_info* thread_info, int64_t revision_
     }
   }
   assert(probability_sum > 0.0);
+  if (thread_info->temperature != 1.0) {
+    probability_sum = temper(thread_info->sampling_array,
+			     revision_assignment_header->num_topics
+			     * revision_assignment_header->pov_per_topic,
+			     thread_info->temperature);
+  }
+  double uniform;
+  if (thread_info->counter_rng) {
+    uniform = thread_info->page_uniforms[thread_info->page_position];
+  } else {
+    uniform = gsl_rng_uniform(thread_info->rand_gen);
+  }
   int chosen_topic = -1;
   int chosen_pov = -1;
   thread_info->sample_function(thread_info->sampling_array,
@@ -527,7 +1249,7 @@ void resample_revision(struct sample_thread_info* thread_info, int64_t revision_
 			       revision_assignment_header->pov_per_topic,
 			       &chosen_topic,
 			       &chosen_pov,
-			       thread_info->rand_gen);
+			       uniform);
   assert(chosen_topic != -1);
   assert(chosen_pov != -1);
   
@@ -541,14 +1263,29 @@ void resample_revision(struct sample_thread_info* thread_info, int64_t revision_
     // so this update is not a critical section.
     revision_assignment->pov = chosen_pov;
     revision_assignment->topic = chosen_topic;
-    pthread_rwlock_wrlock(thread_info->user_locks
-			  + (revision->user % NUM_USER_LOCKS));
-    pthread_mutex_lock(thread_info->queue_lock);
+    thread_info->stats.changed_revisions++;
+    lock_user(thread_info, revision->user, 1);
+    lock_queue(thread_info);
     // Add this update to the queue
     push_queue(thread_info, &index_update);
     // We'll patch our indexes when we read it out
     pthread_mutex_unlock(thread_info->queue_lock);
+    if (thread_info->deterministic) {
+      // Other threads only see this at the end of the sweep, but the
+      // rest of this page must see it now (undone in resample_page)
+      thread_info->index_update_function(&(thread_info->mmap_info), &index_update);
+      record_page_update(thread_info, &index_update);
+    }
     // Update the user distribution
+    if (thread_info->track_likelihood) {
+      thread_info->likelihood_delta
+	+= user_topic_delta(user_topic_pov_dist[index_patch.topic
+						* revision_assignment_header->pov_per_topic
+						+ index_patch.pov], -1)
+	+ user_topic_delta(user_topic_pov_dist[chosen_topic
+					       * revision_assignment_header->pov_per_topic
+					       + chosen_pov], 1);
+    }
     assert((user_topic_pov_dist[index_patch.topic
 				* revision_assignment_header->pov_per_topic
 				+ index_patch.pov] -= 1.0) >= 0.0);
@@ -561,9 +1298,17 @@ void resample_revision(struct sample_thread_info* thread_info, int64_t revision_
     int64_t* page_dist;
     get_topic_summary(&(thread_info->mmap_info), index_patch.topic, 
 		      NULL, NULL, &page_dist);
+    if (thread_info->track_likelihood) {
+      thread_info->likelihood_delta
+	+= page_topic_delta(&(thread_info->mmap_info), page_dist[revision->article], -1);
+    }
     page_dist[revision->article] -= 1;
     get_topic_summary(&(thread_info->mmap_info), chosen_topic, 
 		      NULL, NULL, &page_dist);
+    if (thread_info->track_likelihood) {
+      thread_info->likelihood_delta
+	+= page_topic_delta(&(thread_info->mmap_info), page_dist[revision->article], 1);
+    }
     page_dist[revision->article] += 1;
   }
 }
@@ -643,14 +1388,22 @@ void resample_assign(struct sample_thread_info* thread_info, int64_t revision_id
     // so this update is not a critical section.
     revision_assignment->pov = chosen_pov;
     revision_assignment->topic = chosen_topic;
-    pthread_rwlock_wrlock(thread_info->user_locks
-			  + (revision->user % NUM_USER_LOCKS));
-    pthread_mutex_lock(thread_info->queue_lock);
+    lock_user(thread_info, revision->user, 1);
+    lock_queue(thread_info);
     // Add this update to the queue
     push_queue(thread_info, &index_update);
     // We'll patch our indexes when we read it out
     pthread_mutex_unlock(thread_info->queue_lock);
     // Update the user distribution
+    if (thread_info->track_likelihood) {
+      thread_info->likelihood_delta
+	+= user_topic_delta(user_topic_pov_dist[index_patch.topic
+						* revision_assignment_header->pov_per_topic
+						+ index_patch.pov], -1)
+	+ user_topic_delta(user_topic_pov_dist[chosen_topic
+					       * revision_assignment_header->pov_per_topic
+					       + chosen_pov], 1);
+    }
     assert((user_topic_pov_dist[index_patch.topic
 				* revision_assignment_header->pov_per_topic
 				+ index_patch.pov] -= 1.0) >= 0.0);
@@ -663,9 +1416,17 @@ void resample_assign(struct sample_thread_info* thread_info, int64_t revision_id
     int64_t* page_dist;
     get_topic_summary(&(thread_info->mmap_info), index_patch.topic, 
 		      NULL, NULL, &page_dist);
+    if (thread_info->track_likelihood) {
+      thread_info->likelihood_delta
+	+= page_topic_delta(&(thread_info->mmap_info), page_dist[revision->article], -1);
+    }
     page_dist[revision->article] -= 1;
     get_topic_summary(&(thread_info->mmap_info), chosen_topic, 
 		      NULL, NULL, &page_dist);
+    if (thread_info->track_likelihood) {
+      thread_info->likelihood_delta
+	+= page_topic_delta(&(thread_info->mmap_info), page_dist[revision->article], 1);
+    }
     page_dist[revision->article] += 1;
   }
 }
@@ -710,19 +1471,28 @@ void resample_initialize(struct sample_thread_info* thread_info, int64_t revisio
   // Update distribution from queue
   pop_queue(thread_info, queue_location);
 
-  int chosen_topic = gsl_rng_uniform_int(thread_info->rand_gen,
-					 revision_assignment_header->num_topics);
-  int chosen_pov = gsl_rng_uniform_int(thread_info->rand_gen,
-				       revision_assignment_header->pov_per_topic);
+  int chosen_topic;
+  int chosen_pov;
+  if (thread_info->counter_rng) {
+    double uniforms[2];
+    philox_uniform_pair(thread_info->rng_seed, revision_id,
+			thread_info->sweep | INITIALIZE_RNG_STREAM, uniforms);
+    chosen_topic = uniforms[0] * revision_assignment_header->num_topics;
+    chosen_pov = uniforms[1] * revision_assignment_header->pov_per_topic;
+  } else {
+    chosen_topic = gsl_rng_uniform_int(thread_info->rand_gen,
+				       revision_assignment_header->num_topics);
+    chosen_pov = gsl_rng_uniform_int(thread_info->rand_gen,
+				     revision_assignment_header->pov_per_topic);
+  }
   
   struct index_update index_update;
   create_index_update(&(thread_info->mmap_info), &index_patch, chosen_topic,
 		      chosen_pov, &index_update);
   double* user_topic_pov_dist;
   get_user_topics(&(thread_info->mmap_info), revision->user, &user_topic_pov_dist);
-  pthread_rwlock_wrlock(thread_info->user_locks
-			+ (revision->user % NUM_USER_LOCKS));
-  pthread_mutex_lock(thread_info->queue_lock);
+  lock_user(thread_info, revision->user, 1);
+  lock_queue(thread_info);
   revision_assignment->pov = chosen_pov;
   revision_assignment->topic = chosen_topic;
   // Add this update to the queue
@@ -779,9 +1549,8 @@ void resample_destroy(struct sample_thread_info* thread_info, int64_t revision_i
 		      chosen_pov, &index_update);
   double* user_topic_pov_dist;
   get_user_topics(&(thread_info->mmap_info), revision->user, &user_topic_pov_dist);
-  pthread_rwlock_wrlock(thread_info->user_locks
-			+ (revision->user % NUM_USER_LOCKS));
-  pthread_mutex_lock(thread_info->queue_lock);
+  lock_user(thread_info, revision->user, 1);
+  lock_queue(thread_info);
   revision_assignment->pov = chosen_pov;
   revision_assignment->topic = chosen_topic;
   // Add this update to the queue
@@ -805,20 +1574,38 @@ void resample_page(struct sample_thread_info* thread_info, int64_t page_id) {
   int64_t count_revisions;
   const int64_t* revision_ids;
   get_page(&(thread_info->mmap_info), page_id, &count_revisions, &revision_ids);
+  thread_info->stats.pages++;
+  thread_info->stats.revisions += count_revisions;
+  if (thread_info->counter_rng) {
+    if (count_revisions > thread_info->page_uniforms_size) {
+      thread_info->page_uniforms_size = count_revisions;
+      thread_info->page_uniforms = realloc(thread_info->page_uniforms,
+					   sizeof(double) * count_revisions);
+      assert(thread_info->page_uniforms != NULL);
+    }
+    philox_uniforms(thread_info->rng_seed, revision_ids, count_revisions, thread_info->sweep,
+		    thread_info->page_uniforms);
+  }
   if (thread_info->increment >= 0) {
     for (int64_t i = 0; i < count_revisions; ++i) {
+      thread_info->page_position = i;
       thread_info->revision_callback(thread_info, revision_ids[i]);
     }
   } else {
     for (int64_t i = count_revisions - 1; i >= 0; --i) {
+      thread_info->page_position = i;
       thread_info->revision_callback(thread_info, revision_ids[i]);
     }
   }
+  if (thread_info->deterministic) {
+    undo_page_updates(thread_info);
+  }
 }
 
 void* resample_pages_modn(void* tinfo) {
   struct sample_thread_info* thread_info = (struct sample_thread_info*)tinfo;
   int64_t num_pages = ((const struct page_header*)(thread_info->mmap_info.page_mmap))->count_pages;
+  double start = monotonic_seconds();
   if (thread_info->increment >= 0) {
     for (int64_t page_number = thread_info->sample_pages; page_number < num_pages; 
 	 page_number += thread_info->mod_n) {
@@ -837,5 +1624,7 @@ void* resample_pages_modn(void* tinfo) {
       resample_page(thread_info, page_number);
     }
   }
+  thread_info->stats.min_thread_seconds = monotonic_seconds() - start;
+  thread_info->stats.max_thread_seconds = thread_info->stats.min_thread_seconds;
   return NULL;
 }
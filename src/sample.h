@@ -4,10 +4,13 @@
 #include <gsl/gsl_rng.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "parse_mmaps.h"
+#include "probability.h"
 
 #define NUM_USER_LOCKS 2000
+#define ANNEAL_FINAL_TEMPERATURE 0.01
 
 struct sample_thread_info;
 struct index_update;
@@ -15,9 +18,40 @@ struct sample_threads;
 
 /* Thread utility functions */
 
+/* Seconds on CLOCK_MONOTONIC, for timing (differences only). */
+double monotonic_seconds(void);
+
 void initialize_threads(struct sample_threads* sample_threads, int num_threads,
 			const struct mmap_info* mmap_info);
 void destroy_threads(struct sample_threads* sample_threads);
+/* Draw random numbers from a Philox counter-based generator keyed on
+   seed (see philox.h) instead of each thread's GSL generator, so that
+   the numbers used for a revision depend only on the seed, the sweep
+   (counted from the total_iterations in the revision assignment
+   header) and the revision id. Initialization (resample_uniform) draws
+   from a separate stream, so its numbers are not reused by the
+   sampling sweep with the same number.
+
+   If deterministic is set, resample() and the other Gibbs sweeps also
+   sample every page from the topic index as it was at the start of
+   the sweep plus the page's own changes, and from the user
+   distributions exactly as they were at the start of the sweep: a
+   user's earlier change on the same page in the same sweep is not
+   seen either. Other changes are only seen in the next sweep, which
+   slows mixing somewhat, and the chain is not the same, sweep for
+   sweep, as in the default mode; but results no longer depend on the
+   number of threads or on their timing. So that the user
+   distributions do not pick up rounding errors that depend on the
+   order of their updates either, they are rounded to alpha plus whole
+   counts at the start and end of each sweep. */
+void use_counter_rng(struct sample_threads* sample_threads, uint64_t seed,
+		     int deterministic);
+
+/* Each thread's GSL generator is seeded from the time plus its
+   thread number, so sample_threads initialized in the same second
+   draw the same numbers. When several run side by side (chains,
+   parallel trials), reseed each with a different stream number. */
+void offset_thread_seeds(struct sample_threads* sample_threads, int64_t stream);
 
 /* Resampling functions */
 
@@ -38,9 +72,31 @@ void resample_reverse(struct sample_threads* sample_threads);
    probability assignment. Useful for finding a high probability
    assignment of topics and POVs after random sampling. */
 void resample_maximize(struct sample_threads* sample_threads);
+/* Re-sample from each revision's conditional distribution raised to
+   the power 1 / temperature. A temperature of 1 is resample(), and 0
+   is resample_maximize(). */
+void resample_anneal(struct sample_threads* sample_threads, double temperature);
+/* Search for a high probability assignment by simulated annealing:
+   the temperature falls geometrically from initial_temperature to
+   ANNEAL_FINAL_TEMPERATURE over the first half of max_sweeps, after
+   which sweeps maximize until no assignment changes (or max_sweeps
+   is reached). If initial_temperature is 0, every sweep
+   maximizes. Writes "sweep temperature changed_revisions
+   log_likelihood" to progress after each sweep (if it is not NULL),
+   and returns the final log likelihood. */
+double anneal_maximize(struct sample_threads* sample_threads, int max_sweeps,
+		       double initial_temperature, FILE* progress);
 /* Restore a set of assignments, updating indexes as necessary */
 void resample_restore(struct sample_threads* sample_threads, 
 		      const struct revision_assignment* revision_assignments);
+/* Restore a set of assignments like resample_restore, but without
+   sampling: only revisions whose assignment differs (and the
+   revisions reverting them) are visited, in four parallel passes
+   that need no locks or update queue. Cheap when consecutive samples
+   are similar. Stops likelihood tracking. Returns the number of
+   revisions whose assignment changed. */
+int64_t restore_changes(struct sample_threads* sample_threads,
+			const struct revision_assignment* revision_assignments);
 /* Set all topic and POV assignments to -1, subtracting the
    assignments from indexes. Primarily useful for verifying that
    indexes were correct. */
@@ -56,6 +112,52 @@ double transition_probability(struct sample_threads* sample_threads,
 /* Compute the likelihood of the current model and topic/POV
    assignments */
 double parallel_log_likelihood(struct sample_threads* sample_threads);
+/* Estimate the likelihood of the current assignments from a subset
+   of users and pages (see struct likelihood_subsample), storing the
+   half width of its 95% confidence interval in half_width. */
+double estimate_log_likelihood(struct sample_threads* sample_threads,
+			       const struct likelihood_subsample* subsample,
+			       double* half_width);
+
+/* Asynchronous likelihood evaluation */
+
+struct likelihood_snapshot;
+
+/* Allocate buffers for a copy of the user and topic indexes, and use
+   num_threads background threads to compute likelihoods. */
+void init_likelihood_snapshot(struct likelihood_snapshot* snapshot,
+			      const struct sample_threads* sample_threads,
+			      int num_threads);
+void destroy_likelihood_snapshot(struct likelihood_snapshot* snapshot);
+
+/* Copy the current counts (in parallel, using the sampling threads)
+   and start computing their log likelihood in the background, so
+   that sampling can continue. Only one evaluation is in flight at a
+   time; if the previous one has not finished, this first waits for
+   it, so its result must already have been collected with
+   finish_async_log_likelihood. The iteration is recorded alongside
+   the result. */
+void start_async_log_likelihood(struct sample_threads* sample_threads,
+				struct likelihood_snapshot* snapshot,
+				int64_t iteration);
+/* Wait for the evaluation in flight, if any, storing its iteration
+   and log likelihood. Returns 0 if there was nothing in flight. */
+int finish_async_log_likelihood(struct likelihood_snapshot* snapshot,
+				int64_t* iteration, double* log_likelihood);
+
+/* Incremental likelihood tracking */
+
+/* Compute the likelihood of the current assignments, then keep it up
+   to date as resample(), resample_reverse(), resample_maximize() and
+   resample_restore() change assignments, by accumulating the exact
+   change in each term as counts change. Other resampling functions
+   stop tracking. Returns the full likelihood. */
+double start_likelihood_tracking(struct sample_threads* sample_threads);
+/* The tracked log likelihood of the current assignments (O(1)). Only
+   valid while tracking; floating point drift accumulates slowly, so
+   it should occasionally be replaced by calling
+   start_likelihood_tracking again. */
+double tracked_log_likelihood(const struct sample_threads* sample_threads);
 
 /* Other miscellaneous parallel utility routines */
 
@@ -65,6 +167,42 @@ void parallel_initialize_user_topics(struct sample_threads* sample_threads);
 
 /* Structs to hold synchronization and thread information. */
 
+struct likelihood_snapshot {
+  /* A copy of the sampler's mmap_info, with the user and topic
+     indexes pointing at private copies. */
+  struct mmap_info mmap_info;
+  char* topic_index_copy;
+  char* user_topic_copy;
+
+  const struct lgamma_tables* lgamma_tables;
+  int num_threads;
+  // Background thread coordinating the evaluation
+  pthread_t thread;
+  int in_flight;
+
+  int64_t iteration;
+  double log_likelihood;
+};
+
+/* Counters describing one sweep, kept per thread and merged. */
+struct sample_stats {
+  int64_t revisions;
+  // Revisions whose assignment was changed by resample_revision
+  int64_t changed_revisions;
+  int64_t pages;
+  /* Topic index updates read from the queue while sampling, and the
+     largest number waiting at once (last_queue_position to
+     queue_location). The end of sweep catch-up is not counted. */
+  int64_t replayed_updates;
+  int64_t max_queue_lag;
+  // Time spent blocked on user_locks and queue_lock, summed
+  double user_lock_seconds;
+  double queue_lock_seconds;
+  // Range of time threads spent sampling their pages
+  double min_thread_seconds;
+  double max_thread_seconds;
+};
+
 struct sample_thread_info {
   /* Each thread gets its own random number generator, initialized
      with a different seed. */
@@ -121,12 +259,49 @@ struct sample_thread_info {
 			   double probability_sum,
 			   int num_topics, int pov_per_topic,
 			   int* chosen_topic, int* chosen_pov,
-			   gsl_rng* rand_gen);
+			   double uniform);
 
   /* When computing transition probabilities, these assignments
      specify which assignments the transition is to. */
   const struct revision_assignment* reference_assignments;
 
+  // Shared log gamma tables, used when computing likelihoods
+  const struct lgamma_tables* lgamma_tables;
+
+  /* If track_likelihood is set, the change in log likelihood from
+     this thread's user and page updates, and from the topic index
+     updates at queue positions % mod_n == sample_pages, is
+     accumulated in likelihood_delta. */
+  int track_likelihood;
+  double likelihood_delta;
+
+  // Conditional distributions are raised to the power 1 / temperature
+  double temperature;
+
+  /* Counter-based random numbers (see use_counter_rng), drawn for a
+     whole page at once into page_uniforms, indexed by the position
+     of the revision being sampled within the page. */
+  int counter_rng;
+  uint64_t rng_seed;
+  int64_t sweep;
+  double* page_uniforms;
+  int64_t page_uniforms_size;
+  int64_t page_position;
+
+  /* In deterministic mode, user distributions are read from a copy
+     taken at the start of the sweep, and this page's topic index
+     updates are applied to our copy as they are made, then undone
+     when the page is finished. */
+  int deterministic;
+  const char* user_topic_snapshot;
+  struct index_update* page_updates;
+  int64_t count_page_updates;
+  int64_t page_updates_size;
+
+  // Counters for the current sweep; lock waits only if time_locks
+  struct sample_stats stats;
+  int time_locks;
+
   double output;
 };
 
@@ -139,6 +314,23 @@ struct sample_threads {
   struct index_update* index_update_queue;
   // One past the last value in the queue
   int64_t queue_location;
+
+  /* Built the first time a likelihood is computed (values are NULL
+     until then). */
+  struct lgamma_tables lgamma_tables;
+  int track_likelihood;
+  double tracked_log_likelihood;
+
+  /* Counters from every thread, merged at the end of each sweep,
+     and the sweep's wall clock time. Timing lock waits costs two
+     clock reads per lock, so it is only done if time_locks is set. */
+  struct sample_stats stats;
+  double sweep_seconds;
+  int time_locks;
+  // Counter-based random number state; see use_counter_rng
+  int64_t sweep;
+  int deterministic;
+  char* user_topic_snapshot;
 };
 
 #endif
@@ -1,6 +1,7 @@
 /* As an alternative to randomized initialization, this allows
    user-specified topic and POV assignments to be loaded from a text
-   file. */
+   file (lines of "revision_id topic pov"). Revisions not listed are
+   left unassigned. */
 
 #include <assert.h>
 #include <inttypes.h>
@@ -34,10 +35,18 @@ int main(int argc, char **argv) {
   struct revision_assignment* revision_assignments;
   int64_t count_revisions;
   get_revision_assignment_array(&mmap_info, &count_revisions, &revision_assignments);
+  int64_t revision_id;
 
+  for (revision_id = 0; revision_id < count_revisions; ++revision_id) {
+    revision_assignments[revision_id].topic = -1;
+    revision_assignments[revision_id].pov = -1;
+  }
   FILE* assignments_file = fopen(argv[11], "r");
+  if (assignments_file == NULL) {
+    fprintf(stderr, "Could not open %s\n", argv[11]);
+    exit(1);
+  }
 
-  int64_t revision_id;
   int topic;
   int pov;
   while (fscanf(assignments_file, "%" PRId64 " %d %d", &revision_id, &topic, &pov) != EOF) {
@@ -45,9 +54,9 @@ int main(int argc, char **argv) {
     assert(revision->timestamp != 0 || revision->user != 0 || revision->article != 0);
     revision_assignments[revision_id].topic = topic;
     revision_assignments[revision_id].pov = pov;
-    change_indexes(&mmap_info, revision_id, 1);
   }
 
   fclose(assignments_file);
+  rebuild_indexes(&mmap_info, num_threads);
   close_mmaps(mmap_info);
 }
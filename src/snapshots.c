@@ -0,0 +1,356 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "index.h"
+#include "parse_mmaps.h"
+#include "sample.h"
+#include "snapshots.h"
+
+#define FULL_FRAME 0
+#define DIFF_FRAME 1
+// Longest varint for an int64_t
+#define MAX_VARINT_BYTES 10
+// Frames are encoded into a buffer of this many bytes, written out as it fills
+#define SNAPSHOT_CHUNK_BYTES 65536
+
+uint8_t* put_varint(uint8_t* out, uint64_t value) {
+  while (value >= 0x80) {
+    *(out++) = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *(out++) = (uint8_t)value;
+  return out;
+}
+
+const uint8_t* get_varint(const uint8_t* in, uint64_t* value) {
+  uint64_t result = 0;
+  int shift = 0;
+  while (*in & 0x80) {
+    result |= (uint64_t)(*(in++) & 0x7f) << shift;
+    shift += 7;
+  }
+  *value = result | ((uint64_t)*(in++) << shift);
+  return in;
+}
+
+uint64_t pack_cell(const struct revision_assignment* assignment, int32_t pov_per_topic) {
+  if (assignment->topic < 0 || assignment->pov < 0) {
+    return 0;
+  }
+  return (uint64_t)assignment->topic * pov_per_topic + assignment->pov + 1;
+}
+
+void unpack_cell(uint64_t cell, int32_t pov_per_topic, struct revision_assignment* assignment) {
+  if (cell == 0) {
+    assignment->topic = -1;
+    assignment->pov = -1;
+  } else {
+    assignment->topic = (cell - 1) / pov_per_topic;
+    assignment->pov = (cell - 1) % pov_per_topic;
+  }
+}
+
+void write_or_exit(const void* data, size_t size, size_t count, FILE* file) {
+  if (fwrite(data, size, count, file) != count) {
+    fprintf(stderr, "Could not write snapshot file\n");
+    exit(1);
+  }
+}
+
+void flush_or_exit(FILE* file) {
+  if (fflush(file) != 0) {
+    fprintf(stderr, "Could not write snapshot file\n");
+    exit(1);
+  }
+}
+
+/* Write out the bytes encoded before out if fewer than room bytes are
+   left in the chunk buffer, adding their number to *length. Returns
+   where to continue encoding. */
+uint8_t* make_room(struct snapshot_writer* writer, uint8_t* out, int64_t room,
+		   int64_t* length) {
+  if (out + room <= writer->buffer + SNAPSHOT_CHUNK_BYTES) {
+    return out;
+  }
+  write_or_exit(writer->buffer, 1, out - writer->buffer, writer->file);
+  *length += out - writer->buffer;
+  return writer->buffer;
+}
+
+/* Write the index of the samples so far after the last frame, then
+   point the header at it. The next frame goes after this copy of the
+   index, so the header always points at a complete index. */
+void write_snapshot_index(struct snapshot_writer* writer) {
+  write_or_exit(writer->index, sizeof(struct snapshot_index_entry),
+		writer->header.count_samples, writer->file);
+  flush_or_exit(writer->file);
+  writer->header.index_offset = writer->file_position;
+  writer->file_position += sizeof(struct snapshot_index_entry) * writer->header.count_samples;
+  fseek(writer->file, 0, SEEK_SET);
+  write_or_exit(&(writer->header), sizeof(struct snapshot_header), 1, writer->file);
+  fseek(writer->file, writer->file_position, SEEK_SET);
+  flush_or_exit(writer->file);
+}
+
+void open_snapshot_writer(struct snapshot_writer* writer, const char* file_name,
+			  const struct mmap_info* mmap_info, int64_t keyframe_interval) {
+  const struct revision_assignment_header* revision_assignment_header
+    = (const struct revision_assignment_header*)mmap_info->revision_assignment_mmap;
+  assert(keyframe_interval > 0);
+  writer->file = fopen(file_name, "w+");
+  if (writer->file == NULL) {
+    fprintf(stderr, "Could not open snapshot file %s\n", file_name);
+    exit(1);
+  }
+  memset(&(writer->header), 0, sizeof(struct snapshot_header));
+  writer->header.magic = SNAPSHOT_MAGIC;
+  writer->header.num_topics = revision_assignment_header->num_topics;
+  writer->header.pov_per_topic = revision_assignment_header->pov_per_topic;
+  writer->header.count_revisions = revision_assignment_header->count_revisions;
+  writer->header.keyframe_interval = keyframe_interval;
+  // Rewritten with the index offset by write_snapshot_index
+  write_or_exit(&(writer->header), sizeof(struct snapshot_header), 1, writer->file);
+  writer->file_position = sizeof(struct snapshot_header);
+  writer->previous = malloc(sizeof(struct revision_assignment)
+			    * writer->header.count_revisions);
+  writer->index_size = 64;
+  writer->index = malloc(sizeof(struct snapshot_index_entry) * writer->index_size);
+  writer->buffer = malloc(SNAPSHOT_CHUNK_BYTES);
+  assert(writer->previous != NULL && writer->index != NULL && writer->buffer != NULL);
+}
+
+void write_snapshot(struct snapshot_writer* writer,
+		    const struct revision_assignment* revision_assignments, int64_t iteration) {
+  int64_t count_revisions = writer->header.count_revisions;
+  int32_t pov_per_topic = writer->header.pov_per_topic;
+  uint8_t* out = writer->buffer;
+  int64_t length = 0;
+  if (writer->header.count_samples % writer->header.keyframe_interval == 0) {
+    *(out++) = FULL_FRAME;
+    for (int64_t revision_id = 0; revision_id < count_revisions; ++revision_id) {
+      out = make_room(writer, out, MAX_VARINT_BYTES, &length);
+      out = put_varint(out, pack_cell(revision_assignments + revision_id, pov_per_topic));
+    }
+  } else {
+    int64_t count_changed = 0;
+    for (int64_t revision_id = 0; revision_id < count_revisions; ++revision_id) {
+      count_changed += (revision_assignments[revision_id].topic
+			!= writer->previous[revision_id].topic
+			|| revision_assignments[revision_id].pov
+			!= writer->previous[revision_id].pov);
+    }
+    *(out++) = DIFF_FRAME;
+    out = put_varint(out, count_changed);
+    int64_t last_changed = 0;
+    for (int64_t revision_id = 0; revision_id < count_revisions; ++revision_id) {
+      if (revision_assignments[revision_id].topic != writer->previous[revision_id].topic
+	  || revision_assignments[revision_id].pov != writer->previous[revision_id].pov) {
+	out = make_room(writer, out, 2 * MAX_VARINT_BYTES, &length);
+	out = put_varint(out, revision_id - last_changed);
+	out = put_varint(out, pack_cell(revision_assignments + revision_id, pov_per_topic));
+	last_changed = revision_id;
+      }
+    }
+  }
+  write_or_exit(writer->buffer, 1, out - writer->buffer, writer->file);
+  length += out - writer->buffer;
+  if (writer->header.count_samples == writer->index_size) {
+    writer->index_size *= 2;
+    writer->index = realloc(writer->index,
+			    sizeof(struct snapshot_index_entry) * writer->index_size);
+    assert(writer->index != NULL);
+  }
+  struct snapshot_index_entry* entry = writer->index + writer->header.count_samples;
+  entry->offset = writer->file_position;
+  entry->length = length;
+  entry->iteration = iteration;
+  writer->file_position += length;
+  writer->header.count_samples++;
+  memcpy(writer->previous, revision_assignments,
+	 sizeof(struct revision_assignment) * count_revisions);
+  // Once a keyframe is written, a killed run keeps everything up to it
+  if ((writer->header.count_samples - 1) % writer->header.keyframe_interval == 0) {
+    write_snapshot_index(writer);
+  }
+}
+
+void close_snapshot_writer(struct snapshot_writer* writer) {
+  write_snapshot_index(writer);
+  if (fclose(writer->file) != 0) {
+    fprintf(stderr, "Could not write snapshot file\n");
+    exit(1);
+  }
+  free(writer->previous);
+  free(writer->index);
+  free(writer->buffer);
+}
+
+void* async_snapshot_writer_thread(void* void_async) {
+  struct async_snapshot_writer* async = void_async;
+  pthread_mutex_lock(&(async->lock));
+  while (1) {
+    while (async->count == 0 && !async->finishing) {
+      pthread_cond_wait(&(async->changed), &(async->lock));
+    }
+    if (async->count == 0) {
+      break;
+    }
+    int buffer = async->first;
+    // The buffer stays ours until count is decremented
+    pthread_mutex_unlock(&(async->lock));
+    write_snapshot(&(async->writer), async->buffers[buffer], async->iterations[buffer]);
+    fflush(async->writer.file);
+    double latency = monotonic_seconds() - async->queued_times[buffer];
+    pthread_mutex_lock(&(async->lock));
+    async->first = (async->first + 1) % async->max_in_flight;
+    async->count--;
+    async->written++;
+    async->total_latency += latency;
+    if (latency > async->max_latency) {
+      async->max_latency = latency;
+    }
+    pthread_cond_broadcast(&(async->changed));
+  }
+  pthread_mutex_unlock(&(async->lock));
+  return NULL;
+}
+
+void start_async_snapshot_writer(struct async_snapshot_writer* async,
+				 const char* file_name, const struct mmap_info* mmap_info,
+				 int64_t keyframe_interval, int max_in_flight) {
+  assert(max_in_flight > 0);
+  open_snapshot_writer(&(async->writer), file_name, mmap_info, keyframe_interval);
+  pthread_mutex_init(&(async->lock), NULL);
+  pthread_cond_init(&(async->changed), NULL);
+  async->max_in_flight = max_in_flight;
+  async->buffers = malloc(sizeof(struct revision_assignment*) * max_in_flight);
+  async->iterations = malloc(sizeof(int64_t) * max_in_flight);
+  async->queued_times = malloc(sizeof(double) * max_in_flight);
+  for (int i = 0; i < max_in_flight; ++i) {
+    async->buffers[i] = malloc(sizeof(struct revision_assignment)
+			       * async->writer.header.count_revisions);
+    assert(async->buffers[i] != NULL);
+  }
+  async->first = 0;
+  async->count = 0;
+  async->finishing = 0;
+  async->written = 0;
+  async->total_latency = 0.0;
+  async->max_latency = 0.0;
+  async->blocked_seconds = 0.0;
+  pthread_create(&(async->thread), NULL, async_snapshot_writer_thread, (void*)async);
+}
+
+void queue_snapshot(struct async_snapshot_writer* async,
+		    const struct revision_assignment* revision_assignments, int64_t iteration) {
+  double start = monotonic_seconds();
+  pthread_mutex_lock(&(async->lock));
+  while (async->count == async->max_in_flight) {
+    pthread_cond_wait(&(async->changed), &(async->lock));
+  }
+  int buffer = (async->first + async->count) % async->max_in_flight;
+  pthread_mutex_unlock(&(async->lock));
+  // Free buffers are only touched by this thread
+  memcpy(async->buffers[buffer], revision_assignments,
+	 sizeof(struct revision_assignment) * async->writer.header.count_revisions);
+  async->iterations[buffer] = iteration;
+  double now = monotonic_seconds();
+  async->queued_times[buffer] = now;
+  pthread_mutex_lock(&(async->lock));
+  async->blocked_seconds += now - start;
+  async->count++;
+  pthread_cond_broadcast(&(async->changed));
+  pthread_mutex_unlock(&(async->lock));
+}
+
+void finish_async_snapshot_writer(struct async_snapshot_writer* async) {
+  pthread_mutex_lock(&(async->lock));
+  async->finishing = 1;
+  pthread_cond_broadcast(&(async->changed));
+  pthread_mutex_unlock(&(async->lock));
+  void* res;
+  pthread_join(async->thread, &res);
+  close_snapshot_writer(&(async->writer));
+  for (int i = 0; i < async->max_in_flight; ++i) {
+    free(async->buffers[i]);
+  }
+  free(async->buffers);
+  free(async->iterations);
+  free(async->queued_times);
+  pthread_mutex_destroy(&(async->lock));
+  pthread_cond_destroy(&(async->changed));
+}
+
+int is_snapshot_file(const char* file_name) {
+  FILE* file = fopen(file_name, "r");
+  if (file == NULL) {
+    return 0;
+  }
+  int64_t magic = 0;
+  int read = fread(&magic, sizeof(int64_t), 1, file);
+  fclose(file);
+  return read == 1 && magic == SNAPSHOT_MAGIC;
+}
+
+void open_snapshot_reader(struct snapshot_reader* reader, const char* file_name) {
+  reader->mmap = open_mmap_read(file_name, &(reader->mmap_size));
+  reader->header = (const struct snapshot_header*)reader->mmap;
+  if (reader->header->magic != SNAPSHOT_MAGIC || reader->header->index_offset == 0) {
+    fprintf(stderr, "%s is not a complete snapshot file\n", file_name);
+    exit(1);
+  }
+  reader->index = (const struct snapshot_index_entry*)(reader->mmap
+						       + reader->header->index_offset);
+  reader->current = malloc(sizeof(struct revision_assignment)
+			   * reader->header->count_revisions);
+  assert(reader->current != NULL);
+  reader->current_sample = -1;
+}
+
+void decode_frame(struct snapshot_reader* reader, int64_t sample_num) {
+  const uint8_t* in = (const uint8_t*)reader->mmap + reader->index[sample_num].offset;
+  int32_t pov_per_topic = reader->header->pov_per_topic;
+  uint64_t value;
+  if (*(in++) == FULL_FRAME) {
+    for (int64_t revision_id = 0; revision_id < reader->header->count_revisions;
+	 ++revision_id) {
+      in = get_varint(in, &value);
+      unpack_cell(value, pov_per_topic, reader->current + revision_id);
+    }
+  } else {
+    uint64_t count_changed;
+    in = get_varint(in, &count_changed);
+    int64_t revision_id = 0;
+    for (uint64_t i = 0; i < count_changed; ++i) {
+      in = get_varint(in, &value);
+      revision_id += value;
+      in = get_varint(in, &value);
+      unpack_cell(value, pov_per_topic, reader->current + revision_id);
+    }
+  }
+  assert(in == (const uint8_t*)reader->mmap + reader->index[sample_num].offset
+	 + reader->index[sample_num].length);
+  reader->current_sample = sample_num;
+}
+
+const struct revision_assignment* read_snapshot(struct snapshot_reader* reader,
+						int64_t sample_num) {
+  assert(sample_num >= 0 && sample_num < reader->header->count_samples);
+  int64_t keyframe = sample_num - sample_num % reader->header->keyframe_interval;
+  if (reader->current_sample < keyframe || reader->current_sample > sample_num) {
+    decode_frame(reader, keyframe);
+  }
+  while (reader->current_sample < sample_num) {
+    decode_frame(reader, reader->current_sample + 1);
+  }
+  return reader->current;
+}
+
+void close_snapshot_reader(struct snapshot_reader* reader) {
+  munmap(reader->mmap, reader->mmap_size);
+  free(reader->current);
+}
@@ -0,0 +1,140 @@
+/* A store for a sequence of saved assignments (posterior samples),
+   much smaller than a full copy of revision_assignment_mmap per
+   sample. Late in a run only a few percent of assignments change
+   between samples, so most samples are stored as the list of
+   revisions that changed since the previous one. Every
+   keyframe_interval-th sample is stored in full, so that any sample
+   can be read by decoding at most keyframe_interval frames.
+
+   Assignments are packed as a single cell number, topic *
+   pov_per_topic + pov + 1 (0 if unassigned), written as a varint
+   (7 bits per byte, high bit set on all but the last byte). A full
+   frame is a 0 byte followed by one cell per revision; a diff frame is
+   a 1 byte, the number of changed revisions, then for each the gap
+   from the previous changed revision id and its new cell. The file
+   starts with a struct snapshot_header, followed by the frames.
+
+   An array of struct snapshot_index_entry (one per sample so far) is
+   written after the frames, and the header (index_offset and
+   count_samples) updated to point at it, after every keyframe and
+   when the writer is closed. Later frames are written after that copy
+   of the index rather than over it, so if a run is killed, its samples
+   up to the last keyframe can still be read. The stale copies are
+   small next to the keyframes. */
+
+#ifndef __SNAPSHOTS_H__
+#define __SNAPSHOTS_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "index.h"
+#include "parse_mmaps.h"
+
+// "WPSNAP01"
+#define SNAPSHOT_MAGIC 0x313050414e535057LL
+#define SNAPSHOT_KEYFRAME_INTERVAL 32
+// Samples an async_snapshot_writer holds at once (double buffering)
+#define SNAPSHOT_BUFFERS 2
+
+struct snapshot_header {
+  int64_t magic;
+  int32_t num_topics;
+  int32_t pov_per_topic;
+  int64_t count_revisions;
+  int64_t count_samples;
+  int64_t keyframe_interval;
+  int64_t index_offset;
+};
+
+struct snapshot_index_entry {
+  int64_t offset;
+  int64_t length;
+  // total_iterations when the sample was taken
+  int64_t iteration;
+};
+
+struct snapshot_writer {
+  FILE* file;
+  struct snapshot_header header;
+  // The last sample written, to diff the next one against
+  struct revision_assignment* previous;
+  struct snapshot_index_entry* index;
+  int64_t index_size;
+  int64_t file_position;
+  // Frames are encoded here a chunk at a time
+  uint8_t* buffer;
+};
+
+struct async_snapshot_writer {
+  struct snapshot_writer writer;
+  pthread_t thread;
+  // Protects everything below
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  /* A ring of max_in_flight buffers; count are queued, starting at
+     first. */
+  struct revision_assignment** buffers;
+  int64_t* iterations;
+  double* queued_times;
+  int max_in_flight;
+  int first;
+  int count;
+  int finishing;
+
+  /* Seconds from queue_snapshot to the sample being written, and
+     seconds the caller spent in queue_snapshot (waiting for a free
+     buffer, then copying into it). */
+  int64_t written;
+  double total_latency;
+  double max_latency;
+  double blocked_seconds;
+};
+
+struct snapshot_reader {
+  char* mmap;
+  int64_t mmap_size;
+  const struct snapshot_header* header;
+  const struct snapshot_index_entry* index;
+  // The decoded sample current_sample (-1 before the first read)
+  struct revision_assignment* current;
+  int64_t current_sample;
+};
+
+/* Create (or overwrite) a store for assignments to the model in
+   mmap_info. */
+void open_snapshot_writer(struct snapshot_writer* writer, const char* file_name,
+			  const struct mmap_info* mmap_info, int64_t keyframe_interval);
+/* Append one sample (count_revisions assignments). */
+void write_snapshot(struct snapshot_writer* writer,
+		    const struct revision_assignment* revision_assignments, int64_t iteration);
+/* Write the index and header, and close the file. */
+void close_snapshot_writer(struct snapshot_writer* writer);
+
+/* Writing snapshots from a background thread. queue_snapshot copies
+   the assignments into one of max_in_flight buffers and returns, and a
+   thread encodes and writes the buffers in order. If every buffer is
+   still waiting to be written, queue_snapshot blocks until one is
+   free, so at most max_in_flight samples are held in memory. */
+void start_async_snapshot_writer(struct async_snapshot_writer* async,
+				 const char* file_name, const struct mmap_info* mmap_info,
+				 int64_t keyframe_interval, int max_in_flight);
+void queue_snapshot(struct async_snapshot_writer* async,
+		    const struct revision_assignment* revision_assignments, int64_t iteration);
+/* Wait for queued snapshots to be written, then close the writer. The
+   latency counters remain valid. */
+void finish_async_snapshot_writer(struct async_snapshot_writer* async);
+
+/* Returns 1 if file_name is a snapshot store (rather than, for
+   example, a single raw revision_assignment_mmap copy). */
+int is_snapshot_file(const char* file_name);
+void open_snapshot_reader(struct snapshot_reader* reader, const char* file_name);
+/* Decode sample number sample_num (0 based). Reading samples in order
+   decodes one frame each. The reader retains ownership of the
+   returned array, which is overwritten by the next read. */
+const struct revision_assignment* read_snapshot(struct snapshot_reader* reader,
+						int64_t sample_num);
+void close_snapshot_reader(struct snapshot_reader* reader);
+
+#endif
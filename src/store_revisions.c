@@ -5,17 +5,29 @@
    be 't' or 'f'. Creates page_index_mmap, revisions_mmap, and
    user_index_mmap using this information. Currently the timestamp
    field is not used. Topic and POV assignments must then be
-   initialized before inference can take place. */
+   initialized before inference can take place.
+
+   If string_ids is 1, page_id and user_id are instead arbitrary page
+   titles and user names (fields must then be separated by single
+   tabs). They are interned to dense integer IDs, in order of first
+   appearance in the input, using a hash table shared between
+   num_threads parsing threads, and the mappings back to strings are
+   written to page_names_mmap and user_names_mmap (see
+   get_page_name/get_user_name in parse_mmaps.h). */
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "index.h"
 #include "parse_mmaps.h"
 
+#define DICTIONARY_SHARDS 256
+
 struct revision_stats {
   int64_t total_revisions;
   int64_t max_revision_id;
@@ -23,20 +35,365 @@ struct revision_stats {
   int32_t max_page_id;
 };
 
-void get_file_stats(const char* file, struct revision_stats* stats) {
+/* String interning */
+
+struct dictionary_entry {
+  // Points into the input file, which stays mapped until we are done
+  const char* name;
+  int64_t length;
+  uint64_t hash;
+  // Byte offset of the first line using this name
+  int64_t first_offset;
+  int32_t id;
+};
+
+/* Open addressing hash table for the names whose hash falls in this
+   shard. Threads only contend when they intern names in the same
+   shard. */
+struct dictionary_shard {
+  pthread_mutex_t lock;
+  struct dictionary_entry* entries;
+  int64_t capacity;
+  int64_t count;
+};
+
+struct dictionary {
+  struct dictionary_shard shards[DICTIONARY_SHARDS];
+  // Valid after assign_ids
+  int64_t count;
+  int64_t total_length;
+};
+
+uint64_t hash_name(const char* name, int64_t length) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (int64_t i = 0; i < length; ++i) {
+    hash ^= (unsigned char)name[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void init_dictionary(struct dictionary* dictionary) {
+  for (int i = 0; i < DICTIONARY_SHARDS; ++i) {
+    pthread_mutex_init(&(dictionary->shards[i].lock), NULL);
+    dictionary->shards[i].capacity = 64;
+    dictionary->shards[i].count = 0;
+    dictionary->shards[i].entries = calloc(64, sizeof(struct dictionary_entry));
+  }
+  dictionary->count = 0;
+  dictionary->total_length = 0;
+}
+
+void free_dictionary(struct dictionary* dictionary) {
+  for (int i = 0; i < DICTIONARY_SHARDS; ++i) {
+    pthread_mutex_destroy(&(dictionary->shards[i].lock));
+    free(dictionary->shards[i].entries);
+  }
+}
+
+struct dictionary_entry* find_entry(const struct dictionary_shard* shard, const char* name,
+				    int64_t length, uint64_t hash) {
+  // The low bits of the hash choose the shard, so probe with the high bits
+  int64_t mask = shard->capacity - 1;
+  for (int64_t slot = (hash >> 16) & mask; ; slot = (slot + 1) & mask) {
+    struct dictionary_entry* entry = shard->entries + slot;
+    if (entry->name == NULL
+	|| (entry->hash == hash && entry->length == length
+	    && memcmp(entry->name, name, length) == 0)) {
+      return entry;
+    }
+  }
+}
+
+// Requires the shard lock
+void grow_shard(struct dictionary_shard* shard) {
+  struct dictionary_entry* old_entries = shard->entries;
+  int64_t old_capacity = shard->capacity;
+  shard->capacity *= 2;
+  shard->entries = calloc(shard->capacity, sizeof(struct dictionary_entry));
+  for (int64_t i = 0; i < old_capacity; ++i) {
+    if (old_entries[i].name != NULL) {
+      *find_entry(shard, old_entries[i].name, old_entries[i].length,
+		  old_entries[i].hash) = old_entries[i];
+    }
+  }
+  free(old_entries);
+}
+
+void intern_name(struct dictionary* dictionary, const char* name, int64_t length,
+		 int64_t offset) {
+  uint64_t hash = hash_name(name, length);
+  struct dictionary_shard* shard = dictionary->shards + (hash % DICTIONARY_SHARDS);
+  pthread_mutex_lock(&(shard->lock));
+  struct dictionary_entry* entry = find_entry(shard, name, length, hash);
+  if (entry->name == NULL) {
+    entry->name = name;
+    entry->length = length;
+    entry->hash = hash;
+    entry->first_offset = offset;
+    if (++(shard->count) * 2 > shard->capacity) {
+      grow_shard(shard);
+    }
+  } else if (offset < entry->first_offset) {
+    entry->first_offset = offset;
+  }
+  pthread_mutex_unlock(&(shard->lock));
+}
+
+/* Only valid once interning is complete (no locking). Returns -1 for
+   names which were never interned. */
+int32_t lookup_name(const struct dictionary* dictionary, const char* name, int64_t length) {
+  uint64_t hash = hash_name(name, length);
+  const struct dictionary_shard* shard = dictionary->shards + (hash % DICTIONARY_SHARDS);
+  const struct dictionary_entry* entry = find_entry(shard, name, length, hash);
+  if (entry->name == NULL) {
+    return -1;
+  }
+  return entry->id;
+}
+
+int compare_first_offset(const void* a, const void* b) {
+  const struct dictionary_entry* first = *(const struct dictionary_entry* const*)a;
+  const struct dictionary_entry* second = *(const struct dictionary_entry* const*)b;
+  return (first->first_offset > second->first_offset)
+    - (first->first_offset < second->first_offset);
+}
+
+/* Number names in order of first appearance in the input, so that IDs
+   do not depend on the number of threads. Returns an array of entries
+   indexed by ID, which the caller takes ownership of. */
+struct dictionary_entry** assign_ids(struct dictionary* dictionary) {
+  dictionary->count = 0;
+  dictionary->total_length = 0;
+  for (int i = 0; i < DICTIONARY_SHARDS; ++i) {
+    dictionary->count += dictionary->shards[i].count;
+  }
+  struct dictionary_entry** by_id = malloc(sizeof(struct dictionary_entry*)
+					   * (dictionary->count + 1));
+  int64_t current = 0;
+  for (int i = 0; i < DICTIONARY_SHARDS; ++i) {
+    for (int64_t slot = 0; slot < dictionary->shards[i].capacity; ++slot) {
+      if (dictionary->shards[i].entries[slot].name != NULL) {
+	by_id[current++] = dictionary->shards[i].entries + slot;
+      }
+    }
+  }
+  qsort(by_id, dictionary->count, sizeof(struct dictionary_entry*), compare_first_offset);
+  for (int64_t id = 0; id < dictionary->count; ++id) {
+    by_id[id]->id = id;
+    dictionary->total_length += by_id[id]->length;
+  }
+  return by_id;
+}
+
+void write_string_table(const char* file_name, const struct dictionary* dictionary,
+			struct dictionary_entry** by_id) {
+  int64_t mmap_size = string_table_mmap_size(dictionary->count, dictionary->total_length);
+  char* string_table = create_mmap(file_name, mmap_size);
+  ((struct string_table_header*)string_table)->count_strings = dictionary->count;
+  int64_t* offsets = (int64_t*)(string_table + sizeof(struct string_table_header));
+  int64_t current_offset = sizeof(struct string_table_header)
+    + sizeof(int64_t) * (dictionary->count + 1);
+  for (int64_t id = 0; id < dictionary->count; ++id) {
+    offsets[id] = current_offset;
+    memcpy(string_table + current_offset, by_id[id]->name, by_id[id]->length);
+    // The terminating NUL is already there (create_mmap zeroes)
+    current_offset += by_id[id]->length + 1;
+  }
+  offsets[dictionary->count] = current_offset;
+  munmap(string_table, mmap_size);
+}
+
+/* Reading revisions, with either integer or string identifiers */
+
+struct revision_reader {
+  // Integer identifiers
+  const char* file;
+  FILE* revision_in;
+
+  // String identifiers
+  const char* input;
+  int64_t input_size;
+  int64_t position;
+  struct dictionary* pages;
+  struct dictionary* users;
+};
+
+/* Split the tab separated line starting at input + position into at
+   most max_fields fields, returning the number found and the offset
+   of the next line. */
+int split_line(const char* input, int64_t input_size, int64_t position,
+	       const char** fields, int64_t* lengths, int max_fields,
+	       int64_t* next_position) {
+  const char* end = input + input_size;
+  const char* line_end = memchr(input + position, '\n', input_size - position);
+  if (line_end == NULL) {
+    line_end = end;
+  }
+  *next_position = line_end - input + 1;
+  if (line_end > input + position && line_end[-1] == '\r') {
+    --line_end;
+  }
+  int count = 0;
+  const char* field = input + position;
+  while (count < max_fields) {
+    const char* field_end = memchr(field, '\t', line_end - field);
+    if (field_end == NULL) {
+      field_end = line_end;
+    }
+    fields[count] = field;
+    lengths[count] = field_end - field;
+    ++count;
+    if (field_end == line_end) {
+      break;
+    }
+    field = field_end + 1;
+  }
+  return count;
+}
+
+int64_t parse_integer(const char* field, int64_t length, const char* file, int64_t position) {
+  char buffer[32];
+  if (length <= 0 || length >= (int64_t)sizeof(buffer)) {
+    fprintf(stderr, "Could not parse line at byte %" PRId64 " of %s\n", position, file);
+    exit(1);
+  }
+  memcpy(buffer, field, length);
+  buffer[length] = '\0';
+  char* endptr;
+  int64_t ret = strtoll(buffer, &endptr, 10);
+  if (*endptr != '\0') {
+    fprintf(stderr, "Could not parse line at byte %" PRId64 " of %s\n", position, file);
+    exit(1);
+  }
+  return ret;
+}
+
+/* Read the next revision, returning 0 at the end of the input. */
+int read_revision(struct revision_reader* reader, int32_t* page_id, int64_t* timestamp,
+		  int32_t* user_id, int64_t* revision_id, int64_t* parent, char* disagrees) {
+  if (reader->pages == NULL) {
+    return fscanf(reader->revision_in, "%d\t%" PRId64 "\t%d\t%" PRId64 "\t%" PRId64 "\t%c",
+		  page_id, timestamp, user_id, revision_id, parent, disagrees) != EOF;
+  }
+  const char* fields[6] = {NULL};
+  int64_t lengths[6] = {0};
+  int count_fields = 0;
+  int64_t line_position = 0;
+  while (count_fields == 0 || (count_fields == 1 && lengths[0] == 0)) {
+    // Skip blank lines
+    if (reader->position >= reader->input_size) {
+      return 0;
+    }
+    line_position = reader->position;
+    count_fields = split_line(reader->input, reader->input_size, reader->position,
+			      fields, lengths, 6, &(reader->position));
+  }
+  if (count_fields != 6 || lengths[5] < 1) {
+    fprintf(stderr, "Could not parse line at byte %" PRId64 " of %s\n",
+	    line_position, reader->file);
+    exit(1);
+  }
+  *page_id = lookup_name(reader->pages, fields[0], lengths[0]);
+  *timestamp = parse_integer(fields[1], lengths[1], reader->file, line_position);
+  *user_id = lookup_name(reader->users, fields[2], lengths[2]);
+  *revision_id = parse_integer(fields[3], lengths[3], reader->file, line_position);
+  *parent = parse_integer(fields[4], lengths[4], reader->file, line_position);
+  *disagrees = fields[5][0];
+  return 1;
+}
+
+void open_reader(struct revision_reader* reader) {
+  if (reader->pages == NULL) {
+    reader->revision_in = fopen(reader->file, "r");
+    if (reader->revision_in == NULL) {
+      fprintf(stderr, "Could not open %s\n", reader->file);
+      exit(1);
+    }
+  } else {
+    reader->position = 0;
+  }
+}
+
+void close_reader(struct revision_reader* reader) {
+  if (reader->pages == NULL) {
+    fclose(reader->revision_in);
+    reader->revision_in = NULL;
+  }
+}
+
+struct intern_thread_args {
+  struct revision_reader* reader;
+  int thread_num;
+  int num_threads;
+};
+
+int64_t next_line_start(const char* input, int64_t input_size, int64_t offset) {
+  if (offset <= 0) {
+    return 0;
+  }
+  while (offset < input_size && input[offset - 1] != '\n') {
+    ++offset;
+  }
+  return offset;
+}
+
+/* Intern the page and user names of every line starting in this
+   thread's share of the input. */
+void* intern_names_shard(void* void_args) {
+  struct intern_thread_args* args = void_args;
+  struct revision_reader* reader = args->reader;
+  int64_t position = next_line_start(reader->input, reader->input_size,
+				     reader->input_size * args->thread_num / args->num_threads);
+  int64_t end = next_line_start(reader->input, reader->input_size,
+				reader->input_size * (args->thread_num + 1) / args->num_threads);
+  const char* fields[3];
+  int64_t lengths[3];
+  while (position < end) {
+    int64_t line_position = position;
+    int count_fields = split_line(reader->input, reader->input_size, position,
+				  fields, lengths, 3, &position);
+    if (count_fields == 3) {
+      intern_name(reader->pages, fields[0], lengths[0], line_position);
+      intern_name(reader->users, fields[2], lengths[2], line_position);
+    }
+    // Malformed lines are reported by read_revision
+  }
+  return NULL;
+}
+
+void intern_names(struct revision_reader* reader, int num_threads) {
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  struct intern_thread_args* thread_args = calloc(num_threads, sizeof(struct intern_thread_args));
+  for (int thread_num = 0; thread_num < num_threads; ++thread_num) {
+    thread_args[thread_num].reader = reader;
+    thread_args[thread_num].thread_num = thread_num;
+    thread_args[thread_num].num_threads = num_threads;
+    pthread_create(threads + thread_num, NULL,
+		   intern_names_shard, (void*)(thread_args + thread_num));
+  }
+  void* res;
+  for (int thread_num = 0; thread_num < num_threads; ++thread_num) {
+    pthread_join(threads[thread_num], &res);
+  }
+  free(threads);
+  free(thread_args);
+}
+
+void get_file_stats(struct revision_reader* reader, struct revision_stats* stats) {
   stats->total_revisions = 0;
   stats->max_revision_id = -1;
   stats->max_user_id = -1;
   stats->max_page_id = -1;
-  FILE* revision_in = fopen(file, "r");
+  open_reader(reader);
   int32_t page_id;
   int32_t user_id;
   int64_t revision_id;
   int64_t timestamp;
   int64_t parent;
   char disagrees;
-  while (fscanf(revision_in, "%d\t%" PRId64 "\t%d\t%" PRId64 "\t%" PRId64 "\t%c",
-		&page_id, &timestamp, &user_id, &revision_id, &parent, &disagrees) != EOF) {
+  while (read_revision(reader, &page_id, &timestamp, &user_id, &revision_id, &parent, &disagrees)) {
     if (user_id > stats->max_user_id) {
       stats->max_user_id = user_id;
     }
@@ -48,7 +405,7 @@ void get_file_stats(const char* file, struct revision_stats* stats) {
     }
     stats->total_revisions += 1;
   }
-  fclose(revision_in);
+  close_reader(reader);
 }
 
 int64_t user_index_mmap_size(const struct revision_stats* stats) {
@@ -68,7 +425,7 @@ int64_t revision_mmap_size(const struct revision_stats* stats) {
     + sizeof(struct revision) * (stats->max_revision_id + 1);
 }
 
-void fill_mmaps(const char* file,
+void fill_mmaps(struct revision_reader* reader,
 		const struct revision_stats* stats,
 		char* user_index_mmap,
 		char* page_index_mmap,
@@ -77,7 +434,7 @@ void fill_mmaps(const char* file,
   struct user_index* user_array = (struct user_index*)(user_index_mmap + sizeof(struct user_header));
   struct page_index* page_array = (struct page_index*)(page_index_mmap + sizeof(struct page_header));
   struct revision* revision_array = (struct revision*)(revisions_mmap + sizeof(struct revision_header));
-  FILE* revision_in = fopen(file, "r");
+  open_reader(reader);
   int32_t page_id;
   int32_t user_id;
   int64_t revision_id;
@@ -87,8 +444,7 @@ void fill_mmaps(const char* file,
   for (int64_t i = 0; i < revision_header->count_revisions; ++i) {
     revision_array[i].child = -1;
   }
-  while (fscanf(revision_in, "%d\t%" PRId64 "\t%d\t%" PRId64 "\t%" PRId64 "\t%c",
-		&page_id, &timestamp, &user_id, &revision_id, &parent, &disagrees) != EOF) {
+  while (read_revision(reader, &page_id, &timestamp, &user_id, &revision_id, &parent, &disagrees)) {
     revision_array[revision_id].article = page_id;
     revision_array[revision_id].user = user_id;
     revision_array[revision_id].parent = parent;
@@ -111,16 +467,15 @@ void fill_mmaps(const char* file,
     page_array[page_id].count_revisions++;
     user_array[user_id].count_revisions++;
   }
-  fclose(revision_in);
-  revision_in = fopen(file, "r");
+  close_reader(reader);
+  open_reader(reader);
   int64_t current_user_offset =
     sizeof(struct user_header)
     + sizeof(struct user_index) * (stats->max_user_id + 1);
   int64_t current_page_offset =
     sizeof(struct page_header)
     + sizeof(struct page_index) * (stats->max_page_id + 1);
-  while (fscanf(revision_in, "%d\t%" PRId64 "\t%d\t%" PRId64 "\t%" PRId64 "\t%c",
-		&page_id, &timestamp, &user_id, &revision_id, &parent, &disagrees) != EOF) {
+  while (read_revision(reader, &page_id, &timestamp, &user_id, &revision_id, &parent, &disagrees)) {
     if (page_array[page_id].revisions_offset == 0) {
       page_array[page_id].revisions_offset = current_page_offset;
       current_page_offset += sizeof(int64_t) * page_array[page_id].count_revisions;
@@ -139,17 +494,64 @@ void fill_mmaps(const char* file,
       + user_array[user_id].count_revisions) = revision_id;
     user_array[user_id].count_revisions++;
   }
-  fclose(revision_in);
+  close_reader(reader);
 }
 
 int main(int argc, char **argv) {
-  if (argc != 3) {
-    printf("Usage: %s mmap_directory revision_input_file\n",
+  if (argc < 3 || argc > 5) {
+    printf("Usage: %s mmap_directory revision_input_file [string_ids] [threads]\n",
            argv[0]);
     exit(1);
   }
+  int string_ids = 0;
+  if (argc >= 4) {
+    string_ids = atoi(argv[3]);
+  }
+  int num_threads = 1;
+  if (argc >= 5) {
+    num_threads = atoi(argv[4]);
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  struct revision_reader reader;
+  memset(&reader, 0, sizeof(struct revision_reader));
+  reader.file = argv[2];
+  struct dictionary pages;
+  struct dictionary users;
+  if (string_ids) {
+    reader.input = open_mmap_read(argv[2], &(reader.input_size));
+    if (reader.input == NULL) {
+      fprintf(stderr, "Could not open %s\n", argv[2]);
+      exit(1);
+    }
+    init_dictionary(&pages);
+    init_dictionary(&users);
+    reader.pages = &pages;
+    reader.users = &users;
+    intern_names(&reader, num_threads);
+    struct dictionary_entry** pages_by_id = assign_ids(&pages);
+    struct dictionary_entry** users_by_id = assign_ids(&users);
+    char *page_names_mmap_name = full_path(argv[1], PAGE_NAMES_MMAP_NAME);
+    char *user_names_mmap_name = full_path(argv[1], USER_NAMES_MMAP_NAME);
+    write_string_table(page_names_mmap_name, &pages, pages_by_id);
+    write_string_table(user_names_mmap_name, &users, users_by_id);
+    printf("%" PRId64 " page titles, %" PRId64 " user names\n", pages.count, users.count);
+    free(pages_by_id);
+    free(users_by_id);
+    free(page_names_mmap_name);
+    free(user_names_mmap_name);
+  } else {
+    // Remove string tables left over from a previous string ID ingest
+    char *page_names_mmap_name = full_path(argv[1], PAGE_NAMES_MMAP_NAME);
+    char *user_names_mmap_name = full_path(argv[1], USER_NAMES_MMAP_NAME);
+    unlink(page_names_mmap_name);
+    unlink(user_names_mmap_name);
+    free(page_names_mmap_name);
+    free(user_names_mmap_name);
+  }
   struct revision_stats stats;
-  get_file_stats(argv[2], &stats);
+  get_file_stats(&reader, &stats);
   printf("%d max user, %d max page, %"PRId64" max revision, %"PRId64" total revisions\n",
 	 stats.max_user_id, stats.max_page_id, stats.max_revision_id, stats.total_revisions);
   char *user_index_mmap_name = full_path(argv[1], USER_INDEX_MMAP_NAME);
@@ -161,7 +563,12 @@ int main(int argc, char **argv) {
   ((struct user_header*)user_index_mmap)->count_users = stats.max_user_id + 1;
   ((struct page_header*)page_index_mmap)->count_pages = stats.max_page_id + 1;
   ((struct revision_header*)revisions_mmap)->count_revisions = stats.max_revision_id + 1;
-  fill_mmaps(argv[2], &stats, user_index_mmap, page_index_mmap, revisions_mmap);
+  fill_mmaps(&reader, &stats, user_index_mmap, page_index_mmap, revisions_mmap);
+  if (string_ids) {
+    free_dictionary(&pages);
+    free_dictionary(&users);
+    munmap((void*)reader.input, reader.input_size);
+  }
   free(user_index_mmap_name);
   free(page_index_mmap_name);
   free(revisions_mmap_name);
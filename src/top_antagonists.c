@@ -0,0 +1,61 @@
+/* Find the k users most antagonistic towards a given user, or (if no
+   user is given) the k most antagonistic pairs of users overall,
+   under the current assignments, without scoring every pair (see
+   struct antagonism_search). Antagonism is as in compare_users. Each
+   output line is "first_user second_user antagonism", followed by the
+   user names (tab separated) if revisions were stored with string
+   identifiers. */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "comparisons.h"
+#include "index.h"
+#include "parse_mmaps.h"
+
+int main(int argc, char **argv) {
+  if (argc != 4 && argc != 5) {
+    printf("Usage: %s mmap_directory k threads [user]\n",
+	   argv[0]);
+    exit(1);
+  }
+  struct mmap_info mmap_info = open_mmaps_readonly(argv[1]);
+  const struct user_topic_header* user_topic_header
+    = (const struct user_topic_header*)mmap_info.user_topic_mmap;
+  int64_t k = atoll(argv[2]);
+  int num_threads = atoi(argv[3]);
+  assert(k > 0 && num_threads > 0);
+  struct antagonism_tables antagonism_tables;
+  init_antagonism_tables(&mmap_info, &antagonism_tables);
+  fill_antagonism_tables(&mmap_info, &antagonism_tables);
+  struct antagonism_search antagonism_search;
+  init_antagonism_search(&mmap_info, &antagonism_tables, &antagonism_search);
+  struct antagonist* antagonists = malloc(sizeof(struct antagonist) * k);
+  int64_t count;
+  if (argc == 5) {
+    int64_t user_id = atoll(argv[4]);
+    if (user_id < 0 || user_id >= user_topic_header->num_users) {
+      fprintf(stderr, "No user %" PRId64 "\n", user_id);
+      exit(1);
+    }
+    count = top_user_antagonists(&antagonism_search, user_id, k, antagonists);
+  } else {
+    count = top_antagonist_pairs(&antagonism_search, k, num_threads, antagonists);
+  }
+  for (int64_t i = 0; i < count; ++i) {
+    printf("%" PRId64 " %" PRId64 " %lf", antagonists[i].first_user,
+	   antagonists[i].second_user, antagonists[i].antagonism);
+    const char* first_name = get_user_name(&mmap_info, antagonists[i].first_user);
+    const char* second_name = get_user_name(&mmap_info, antagonists[i].second_user);
+    if (first_name != NULL && second_name != NULL) {
+      printf("\t%s\t%s", first_name, second_name);
+    }
+    printf("\n");
+  }
+  free(antagonists);
+  free_antagonism_search(&antagonism_search);
+  free_antagonism_tables(&antagonism_tables);
+  close_mmaps(mmap_info);
+}
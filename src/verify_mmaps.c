@@ -1,84 +1,557 @@
 /* Verify that the data stored in the current mmaps matches the
    revisions given in a text file. This only checks the work of
    store_revisions.c; for checking topic and POV assignment indexes,
-   see check_indexes.c. */
+   see check_indexes.c.
+
+   The text file is read once, split into num_threads shards at line
+   boundaries, and each shard is checked against the revision mmap in
+   parallel. The page and user indexes and the parent/child links are
+   then checked in parallel, sharded by ID. Rather than stopping at
+   the first problem, every mismatch is written to report_file (or
+   stdout) as one line:
+
+     kind id expected actual
+
+   where kind names the check that failed (see error_kind_names), id
+   is the revision, page or user ID the check was about (or a byte
+   offset into the input file for parse errors), and expected/actual
+   are the values that disagreed. Exits with status 1 if any mismatch
+   was found. */
 
-#include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "index.h"
 #include "parse_mmaps.h"
 
-void verify_mmaps(const char* file, struct mmap_info mmap_info) {
-  FILE* revision_in = fopen(file, "r");
-  int32_t page_id;
-  int32_t user_id;
-  int64_t revision_id;
-  int64_t timestamp;
-  int64_t parent;
-  char disagrees;
-
-  int32_t previous_user = -1;
-  int32_t previous_page = -1;
-  int64_t count_user_revisions;
-  int64_t count_page_revisions;
-  const int64_t* user_revisions;
-  const int64_t* current_user_revision = NULL;
-  const int64_t* page_revisions;
-  const int64_t* current_page_revision = NULL;
-  while (fscanf(revision_in, "%d\t%" PRId64 "\t%d\t%" PRId64 "\t%" PRId64 "\t%c",
-		&page_id, &timestamp, &user_id, &revision_id, &parent, &disagrees) != EOF) {
-    const struct revision* revision_mmap = get_revision(&mmap_info, revision_id);
-    assert(revision_mmap->article == page_id);
-    assert(revision_mmap->timestamp == timestamp);
-    assert(revision_mmap->user == user_id);
-    if (revision_mmap->parent == -1 && parent >= 0) {
-      // Could have multiple revisions reverting a single parent, 
-      // in which case it's OK that this revision was nulled out.
-      // The parent could also be on a different page.
-      assert((get_revision(&mmap_info, parent)->child >= 0
-              && get_revision(&mmap_info, parent)->child != revision_id)
-             || get_revision(&mmap_info, parent)->article != page_id);
+enum error_kind {
+  PARSE_ERROR,
+  REVISION_OUT_OF_RANGE,
+  DUPLICATE_REVISION,
+  ARTICLE_MISMATCH,
+  TIMESTAMP_MISMATCH,
+  USER_MISMATCH,
+  PARENT_MISMATCH,
+  DISAGREES_MISMATCH,
+  PARENT_LINK,
+  CHILD_LINK,
+  PAGE_OUT_OF_RANGE,
+  USER_OUT_OF_RANGE,
+  PAGE_COUNT,
+  USER_COUNT,
+  PAGE_LIST_BOUNDS,
+  USER_LIST_BOUNDS,
+  PAGE_LIST_ENTRY,
+  USER_LIST_ENTRY,
+  PAGE_LIST_ORDER,
+  USER_LIST_ORDER,
+  PAGE_LIST_MEMBERSHIP,
+  USER_LIST_MEMBERSHIP,
+  REVISION_HEADER_COUNT,
+  PAGE_HEADER_COUNT,
+  USER_HEADER_COUNT,
+};
+
+const char* error_kind_names[] = {
+  "parse_error",
+  "revision_out_of_range",
+  "duplicate_revision",
+  "article",
+  "timestamp",
+  "user",
+  "parent",
+  "disagrees",
+  "parent_link",
+  "child_link",
+  "page_out_of_range",
+  "user_out_of_range",
+  "page_count",
+  "user_count",
+  "page_list_bounds",
+  "user_list_bounds",
+  "page_list_entry",
+  "user_list_entry",
+  "page_list_order",
+  "user_list_order",
+  "page_list_membership",
+  "user_list_membership",
+  "revision_header_count",
+  "page_header_count",
+  "user_header_count",
+};
+
+struct verify_error {
+  enum error_kind kind;
+  int64_t id;
+  int64_t expected;
+  int64_t actual;
+};
+
+/* Mismatches found by a single thread, in the order it found them. */
+struct error_list {
+  struct verify_error* errors;
+  int64_t count;
+  int64_t allocated;
+};
+
+/* State shared between all verification threads. Arrays indexed by
+   revision, page or user ID are updated with atomic builtins. */
+struct verify_state {
+  const struct mmap_info* mmap_info;
+  const char* input;
+  int64_t input_size;
+  int64_t count_revisions;
+  int64_t count_pages;
+  int64_t count_users;
+
+  /* Byte offset in the input of the line describing each revision,
+     or -1 if the revision was not in the input. Offsets increase in
+     file order, so they double as line numbers for order checks. */
+  int64_t* input_offset;
+  // Number of input lines for each page and user
+  int64_t* page_lines;
+  int64_t* user_lines;
+  // Number of times each revision appears in page and user lists
+  int32_t* page_list_appearances;
+  int32_t* user_list_appearances;
+};
+
+struct verify_thread_args {
+  struct verify_state* state;
+  struct error_list errors;
+  int thread_num;
+  int num_threads;
+
+  // Input shard statistics, reduced after parsing
+  int64_t input_lines;
+  int64_t max_revision_id;
+  int64_t max_user_id;
+  int64_t max_page_id;
+};
+
+void add_error(struct error_list* error_list, enum error_kind kind,
+	       int64_t id, int64_t expected, int64_t actual) {
+  if (error_list->count == error_list->allocated) {
+    error_list->allocated = error_list->allocated * 2 + 16;
+    error_list->errors = realloc(error_list->errors,
+				 sizeof(struct verify_error) * error_list->allocated);
+  }
+  struct verify_error* error = error_list->errors + error_list->count;
+  error->kind = kind;
+  error->id = id;
+  error->expected = expected;
+  error->actual = actual;
+  ++(error_list->count);
+}
+
+/* Parse a (possibly negative) integer starting at *position, skipping
+   leading blanks but not newlines. Returns 0 if there is no integer
+   before end or the end of the line. */
+int parse_field(const char** position, const char* end, int64_t* value) {
+  const char* p = *position;
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    ++p;
+  }
+  int negative = 0;
+  if (p < end && *p == '-') {
+    negative = 1;
+    ++p;
+  }
+  if (p >= end || *p < '0' || *p > '9') {
+    return 0;
+  }
+  int64_t ret = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    ret = ret * 10 + (*p - '0');
+    ++p;
+  }
+  *value = negative ? -ret : ret;
+  *position = p;
+  return 1;
+}
+
+/* Find the start of the first line beginning at or after offset. */
+int64_t line_start(const char* input, int64_t input_size, int64_t offset) {
+  if (offset <= 0) {
+    return 0;
+  }
+  while (offset < input_size && input[offset - 1] != '\n') {
+    ++offset;
+  }
+  return offset;
+}
+
+void verify_line(struct verify_thread_args* args, int64_t line_offset,
+		 int64_t page_id, int64_t timestamp, int64_t user_id,
+		 int64_t revision_id, int64_t parent, char disagrees) {
+  struct verify_state* state = args->state;
+  struct error_list* errors = &(args->errors);
+  if (revision_id > args->max_revision_id) {
+    args->max_revision_id = revision_id;
+  }
+  if (user_id > args->max_user_id) {
+    args->max_user_id = user_id;
+  }
+  if (page_id > args->max_page_id) {
+    args->max_page_id = page_id;
+  }
+  ++(args->input_lines);
+  if (page_id < 0 || page_id >= state->count_pages) {
+    add_error(errors, PAGE_OUT_OF_RANGE, revision_id, state->count_pages, page_id);
+  } else {
+    __sync_fetch_and_add(state->page_lines + page_id, 1);
+  }
+  if (user_id < 0 || user_id >= state->count_users) {
+    add_error(errors, USER_OUT_OF_RANGE, revision_id, state->count_users, user_id);
+  } else {
+    __sync_fetch_and_add(state->user_lines + user_id, 1);
+  }
+  if (revision_id < 0 || revision_id >= state->count_revisions) {
+    add_error(errors, REVISION_OUT_OF_RANGE, revision_id, state->count_revisions, revision_id);
+    return;
+  }
+  int64_t previous_offset
+    = __sync_val_compare_and_swap(state->input_offset + revision_id, -1, line_offset);
+  if (previous_offset != -1) {
+    add_error(errors, DUPLICATE_REVISION, revision_id, previous_offset, line_offset);
+    return;
+  }
+  const struct revision* revision_mmap = get_revision(state->mmap_info, revision_id);
+  if (revision_mmap->article != page_id) {
+    add_error(errors, ARTICLE_MISMATCH, revision_id, page_id, revision_mmap->article);
+  }
+  if (revision_mmap->timestamp != timestamp) {
+    add_error(errors, TIMESTAMP_MISMATCH, revision_id, timestamp, revision_mmap->timestamp);
+  }
+  if (revision_mmap->user != user_id) {
+    add_error(errors, USER_MISMATCH, revision_id, user_id, revision_mmap->user);
+  }
+  if (revision_mmap->disagrees != (disagrees == 't')) {
+    add_error(errors, DISAGREES_MISMATCH, revision_id, disagrees == 't',
+	      revision_mmap->disagrees);
+  }
+  if (revision_mmap->parent == -1 && parent >= 0) {
+    // Could have multiple revisions reverting a single parent,
+    // in which case it's OK that this revision was nulled out.
+    // The parent could also be on a different page.
+    if (parent >= state->count_revisions) {
+      add_error(errors, PARENT_MISMATCH, revision_id, parent, revision_mmap->parent);
     } else {
-      assert(revision_mmap->parent == parent);
+      const struct revision* parent_mmap = get_revision(state->mmap_info, parent);
+      if (!((parent_mmap->child >= 0 && parent_mmap->child != revision_id)
+	    || parent_mmap->article != page_id)) {
+	add_error(errors, PARENT_MISMATCH, revision_id, parent, revision_mmap->parent);
+      }
     }
-    if (revision_mmap->child >= 0) {
-      assert(get_revision(&mmap_info, revision_mmap->child)->parent == revision_id);
+  } else if (revision_mmap->parent != parent) {
+    add_error(errors, PARENT_MISMATCH, revision_id, parent, revision_mmap->parent);
+  }
+}
+
+/* Parse and check every line starting in this thread's byte range of
+   the input. */
+void* verify_input_shard(void* void_args) {
+  struct verify_thread_args* args = void_args;
+  struct verify_state* state = args->state;
+  int64_t start = line_start(state->input, state->input_size,
+			     state->input_size * args->thread_num / args->num_threads);
+  int64_t end = line_start(state->input, state->input_size,
+			   state->input_size * (args->thread_num + 1) / args->num_threads);
+  const char* input_end = state->input + state->input_size;
+  const char* position = state->input + start;
+  while (position < state->input + end) {
+    int64_t line_offset = position - state->input;
+    const char* line_end = memchr(position, '\n', input_end - position);
+    if (line_end == NULL) {
+      line_end = input_end;
     }
-    if (revision_mmap->parent >= 0) {
-      assert(get_revision(&mmap_info, revision_mmap->parent)->child == revision_id);
+    int64_t page_id;
+    int64_t timestamp;
+    int64_t user_id;
+    int64_t revision_id;
+    int64_t parent;
+    const char* p = position;
+    while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+      ++p;
     }
-    if (previous_user != user_id) {
-      get_user(&mmap_info, user_id, &count_user_revisions, &user_revisions);
-      previous_user = user_id;
-      current_user_revision = user_revisions;
+    if (p == line_end) {
+      // Blank line
+    } else if (parse_field(&p, line_end, &page_id)
+	       && parse_field(&p, line_end, &timestamp)
+	       && parse_field(&p, line_end, &user_id)
+	       && parse_field(&p, line_end, &revision_id)
+	       && parse_field(&p, line_end, &parent)) {
+      while (p < line_end && (*p == ' ' || *p == '\t')) {
+	++p;
+      }
+      if (p < line_end) {
+	verify_line(args, line_offset, page_id, timestamp, user_id,
+		    revision_id, parent, *p);
+      } else {
+	add_error(&(args->errors), PARSE_ERROR, line_offset, 0, 0);
+      }
+    } else {
+      add_error(&(args->errors), PARSE_ERROR, line_offset, 0, 0);
     }
-    while (*current_user_revision != revision_id) {
-      assert(current_user_revision - user_revisions < count_user_revisions);
-      current_user_revision++;
+    position = line_end + 1;
+  }
+  return NULL;
+}
+
+/* Check the parent/child links of revisions with ID % num_threads ==
+   thread_num. */
+void* verify_links_modn(void* void_args) {
+  struct verify_thread_args* args = void_args;
+  struct verify_state* state = args->state;
+  for (int64_t revision_id = args->thread_num; revision_id < state->count_revisions;
+       revision_id += args->num_threads) {
+    const struct revision* revision = get_revision(state->mmap_info, revision_id);
+    if (state->input_offset[revision_id] < 0) {
+      continue;
+    }
+    if (revision->child >= 0) {
+      int64_t child_parent = -1;
+      if (revision->child < state->count_revisions) {
+	child_parent = get_revision(state->mmap_info, revision->child)->parent;
+      }
+      if (child_parent != revision_id) {
+	add_error(&(args->errors), CHILD_LINK, revision_id, revision_id, child_parent);
+      }
     }
-    if (previous_page != page_id) {
-      get_page(&mmap_info, page_id, &count_page_revisions, &page_revisions);
-      previous_page = page_id;
-      current_page_revision = page_revisions;
+    if (revision->parent >= 0) {
+      int64_t parent_child = -1;
+      if (revision->parent < state->count_revisions) {
+	parent_child = get_revision(state->mmap_info, revision->parent)->child;
+      }
+      if (parent_child != revision_id) {
+	add_error(&(args->errors), PARENT_LINK, revision_id, revision_id, parent_child);
+      }
     }
-    assert(current_page_revision - page_revisions < count_page_revisions);
-    assert(*current_page_revision == revision_id);
-    current_page_revision++;
   }
-  fclose(revision_in);
+  return NULL;
+}
+
+/* Check one page or user revision list against the input: the
+   number of revisions, that each revision belongs to this page or
+   user, and that revisions are listed in input file order. */
+void verify_list(struct verify_thread_args* args, int is_page, int64_t id,
+		 int64_t list_mmap_size,
+		 void (*get_revisions)(const struct mmap_info*, int64_t, int64_t*, const int64_t**),
+		 int64_t expected_count, int32_t* appearances) {
+  struct verify_state* state = args->state;
+  struct error_list* errors = &(args->errors);
+  int64_t count_revisions;
+  const int64_t* revision_ids;
+  get_revisions(state->mmap_info, id, &count_revisions, &revision_ids);
+  if (count_revisions != expected_count) {
+    add_error(errors, is_page ? PAGE_COUNT : USER_COUNT, id, expected_count, count_revisions);
+  }
+  if (count_revisions == 0) {
+    return;
+  }
+  const char* list_base = is_page ? state->mmap_info->page_mmap : state->mmap_info->user_mmap;
+  int64_t list_offset = (const char*)revision_ids - list_base;
+  if (count_revisions < 0 || list_offset < 0
+      || list_offset + count_revisions * (int64_t)sizeof(int64_t) > list_mmap_size) {
+    add_error(errors, is_page ? PAGE_LIST_BOUNDS : USER_LIST_BOUNDS, id,
+	      list_mmap_size, list_offset);
+    return;
+  }
+  int64_t previous_offset = -1;
+  for (int64_t i = 0; i < count_revisions; ++i) {
+    int64_t revision_id = revision_ids[i];
+    if (revision_id < 0 || revision_id >= state->count_revisions
+	|| state->input_offset[revision_id] < 0) {
+      add_error(errors, is_page ? PAGE_LIST_ENTRY : USER_LIST_ENTRY, id, -1, revision_id);
+      continue;
+    }
+    __sync_fetch_and_add(appearances + revision_id, 1);
+    const struct revision* revision = get_revision(state->mmap_info, revision_id);
+    int64_t owner = is_page ? revision->article : revision->user;
+    if (owner != id) {
+      add_error(errors, is_page ? PAGE_LIST_ENTRY : USER_LIST_ENTRY, id, owner, revision_id);
+    }
+    if (state->input_offset[revision_id] <= previous_offset) {
+      add_error(errors, is_page ? PAGE_LIST_ORDER : USER_LIST_ORDER, id,
+		previous_offset, state->input_offset[revision_id]);
+    }
+    previous_offset = state->input_offset[revision_id];
+  }
+}
+
+/* Check page and user lists with ID % num_threads == thread_num. */
+void* verify_lists_modn(void* void_args) {
+  struct verify_thread_args* args = void_args;
+  struct verify_state* state = args->state;
+  for (int64_t page_id = args->thread_num; page_id < state->count_pages;
+       page_id += args->num_threads) {
+    verify_list(args, 1, page_id, state->mmap_info->page_mmap_size, get_page,
+		state->page_lines[page_id], state->page_list_appearances);
+  }
+  for (int64_t user_id = args->thread_num; user_id < state->count_users;
+       user_id += args->num_threads) {
+    verify_list(args, 0, user_id, state->mmap_info->user_mmap_size, get_user,
+		state->user_lines[user_id], state->user_list_appearances);
+  }
+  return NULL;
+}
+
+/* Check that every revision in the input is in exactly one page list
+   and one user list, and revisions not in the input are in none. */
+void* verify_membership_modn(void* void_args) {
+  struct verify_thread_args* args = void_args;
+  struct verify_state* state = args->state;
+  for (int64_t revision_id = args->thread_num; revision_id < state->count_revisions;
+       revision_id += args->num_threads) {
+    int32_t expected = state->input_offset[revision_id] >= 0 ? 1 : 0;
+    if (state->page_list_appearances[revision_id] != expected) {
+      add_error(&(args->errors), PAGE_LIST_MEMBERSHIP, revision_id, expected,
+		state->page_list_appearances[revision_id]);
+    }
+    if (state->user_list_appearances[revision_id] != expected) {
+      add_error(&(args->errors), USER_LIST_MEMBERSHIP, revision_id, expected,
+		state->user_list_appearances[revision_id]);
+    }
+  }
+  return NULL;
+}
+
+void run_phase(struct verify_thread_args* thread_args, int num_threads,
+	       void* (*worker)(void*)) {
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  for (int thread_num = 0; thread_num < num_threads; ++thread_num) {
+    pthread_create(threads + thread_num, NULL, worker, (void*)(thread_args + thread_num));
+  }
+  void* res;
+  for (int thread_num = 0; thread_num < num_threads; ++thread_num) {
+    pthread_join(threads[thread_num], &res);
+  }
+  free(threads);
+}
+
+/* Returns the number of mismatches written to report_out. */
+int64_t verify_mmaps(const char* file, const struct mmap_info* mmap_info,
+		     int num_threads, FILE* report_out) {
+  struct verify_state state;
+  state.mmap_info = mmap_info;
+  state.input = open_mmap_read(file, &(state.input_size));
+  if (state.input == NULL) {
+    fprintf(stderr, "Could not open revision input file %s\n", file);
+    exit(1);
+  }
+  state.count_revisions = ((const struct revision_header*)mmap_info->revision_mmap)->count_revisions;
+  state.count_pages = ((const struct page_header*)mmap_info->page_mmap)->count_pages;
+  state.count_users = ((const struct user_header*)mmap_info->user_mmap)->count_users;
+  state.input_offset = malloc(sizeof(int64_t) * state.count_revisions);
+  memset(state.input_offset, 0xff, sizeof(int64_t) * state.count_revisions);
+  state.page_lines = calloc(state.count_pages, sizeof(int64_t));
+  state.user_lines = calloc(state.count_users, sizeof(int64_t));
+  state.page_list_appearances = calloc(state.count_revisions, sizeof(int32_t));
+  state.user_list_appearances = calloc(state.count_revisions, sizeof(int32_t));
+
+  struct verify_thread_args* thread_args
+    = calloc(num_threads, sizeof(struct verify_thread_args));
+  for (int thread_num = 0; thread_num < num_threads; ++thread_num) {
+    thread_args[thread_num].state = &state;
+    thread_args[thread_num].thread_num = thread_num;
+    thread_args[thread_num].num_threads = num_threads;
+    thread_args[thread_num].max_revision_id = -1;
+    thread_args[thread_num].max_user_id = -1;
+    thread_args[thread_num].max_page_id = -1;
+  }
+  run_phase(thread_args, num_threads, verify_input_shard);
+  run_phase(thread_args, num_threads, verify_links_modn);
+  run_phase(thread_args, num_threads, verify_lists_modn);
+  run_phase(thread_args, num_threads, verify_membership_modn);
+
+  // Header counts are those store_revisions derives from the input
+  int64_t max_revision_id = -1;
+  int64_t max_user_id = -1;
+  int64_t max_page_id = -1;
+  for (int thread_num = 0; thread_num < num_threads; ++thread_num) {
+    if (thread_args[thread_num].max_revision_id > max_revision_id) {
+      max_revision_id = thread_args[thread_num].max_revision_id;
+    }
+    if (thread_args[thread_num].max_user_id > max_user_id) {
+      max_user_id = thread_args[thread_num].max_user_id;
+    }
+    if (thread_args[thread_num].max_page_id > max_page_id) {
+      max_page_id = thread_args[thread_num].max_page_id;
+    }
+  }
+  struct error_list header_errors = {NULL, 0, 0};
+  if (state.count_revisions != max_revision_id + 1) {
+    add_error(&header_errors, REVISION_HEADER_COUNT, 0, max_revision_id + 1, state.count_revisions);
+  }
+  if (state.count_pages != max_page_id + 1) {
+    add_error(&header_errors, PAGE_HEADER_COUNT, 0, max_page_id + 1, state.count_pages);
+  }
+  if (state.count_users != max_user_id + 1) {
+    add_error(&header_errors, USER_HEADER_COUNT, 0, max_user_id + 1, state.count_users);
+  }
+
+  int64_t total_errors = 0;
+  for (int thread_num = 0; thread_num <= num_threads; ++thread_num) {
+    struct error_list* errors
+      = thread_num < num_threads ? &(thread_args[thread_num].errors) : &header_errors;
+    for (int64_t i = 0; i < errors->count; ++i) {
+      fprintf(report_out, "%s %" PRId64 " %" PRId64 " %" PRId64 "\n",
+	      error_kind_names[errors->errors[i].kind],
+	      errors->errors[i].id,
+	      errors->errors[i].expected,
+	      errors->errors[i].actual);
+    }
+    total_errors += errors->count;
+    free(errors->errors);
+  }
+
+  free(thread_args);
+  free(state.input_offset);
+  free(state.page_lines);
+  free(state.user_lines);
+  free(state.page_list_appearances);
+  free(state.user_list_appearances);
+  munmap((void*)state.input, state.input_size);
+  return total_errors;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 3) {
-    printf("Usage: %s mmap_directory revision_input_file\n",
+  if (argc < 3 || argc > 5) {
+    printf("Usage: %s mmap_directory revision_input_file [threads] [report_file]\n",
            argv[0]);
     exit(1);
   }
+  int num_threads;
+  if (argc >= 4) {
+    num_threads = atoi(argv[3]);
+  } else {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  FILE* report_out = stdout;
+  if (argc >= 5) {
+    report_out = fopen(argv[4], "w");
+    if (report_out == NULL) {
+      fprintf(stderr, "Could not open report file %s\n", argv[4]);
+      exit(1);
+    }
+  }
   struct mmap_info mmap_info = open_mmaps_readonly(argv[1]);
-  verify_mmaps(argv[1], mmap_info);
+  int64_t total_errors = verify_mmaps(argv[2], &mmap_info, num_threads, report_out);
+  if (report_out != stdout) {
+    fclose(report_out);
+  }
   close_mmaps(mmap_info);
+  if (total_errors != 0) {
+    fprintf(stderr, "%" PRId64 " mismatches found\n", total_errors);
+    return 1;
+  }
+  return 0;
 }
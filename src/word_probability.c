@@ -7,11 +7,20 @@
    Information Processing Systems 21. 1137–1144. 
 
    Useful for estimating the number of topics and/or POVs per topic to
-   use when modeling a given dataset. */
+   use when modeling a given dataset. The high-probability assignment
+   z* is found by annealing from initial_temperature (default 1, see
+   anneal_maximize), whose progress is written to stderr.
+
+   Up to parallel_trials trials (default 1) run at once, each on its
+   own in-memory copy of the z* assignments and indexes (sharing the
+   data mmaps) and using threads threads. Each trial's estimate is
+   printed as soon as it finishes, so with several parallel trials the
+   lines are in order of completion rather than of trial number. */
 
 #include <assert.h>
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,9 +38,70 @@ double sum_logs(double log_a, double log_b) {
   }
 }
 
+struct trial_worker {
+  struct mmap_info mmap_info;
+  struct sample_threads sample_threads;
+  pthread_t thread;
+  // Shared by all workers
+  const struct revision_assignment* max_assignments;
+  double maximized_likelihood;
+  int trials;
+  int do_iterations;
+  int* next_trial;
+  pthread_mutex_t* output_lock;
+};
+
+/* One estimate of the log probability of the data, starting from and
+   returning to z* (max_assignments). */
+double run_trial(struct trial_worker* worker) {
+  struct sample_threads* sample_threads = &(worker->sample_threads);
+  int s = 1 + gsl_rng_uniform_int(sample_threads->thread_info[0].rand_gen,
+				  worker->do_iterations);
+  // Iterate once to get assignments h_s
+  resample(sample_threads);
+  // Copy out the h_s assignments for restoring later
+  struct revision_assignment* hs_assignments 
+    = copy_revision_assignments(&(worker->mmap_info));
+  double transition_sum = transition_probability(sample_threads, worker->max_assignments);
+    
+  // Sample forward
+  for (int it_num = s + 1; it_num <= worker->do_iterations; ++it_num) {
+    resample(sample_threads);
+    transition_sum = sum_logs(transition_sum, 
+			      transition_probability(sample_threads, 
+						     worker->max_assignments));
+  }
+  // Restore h_s assignments
+  restore_changes(sample_threads, hs_assignments);
+  free(hs_assignments);
+  // Sample backward
+  for (int it_num = s - 1; it_num >= 1; --it_num) {
+    resample_reverse(sample_threads);
+    transition_sum = sum_logs(transition_sum, 
+			      transition_probability(sample_threads, 
+						     worker->max_assignments));
+  }
+  transition_sum -= log(worker->do_iterations);
+  restore_changes(sample_threads, worker->max_assignments);
+  return worker->maximized_likelihood - transition_sum;
+}
+
+void* trial_thread(void* void_worker) {
+  struct trial_worker* worker = void_worker;
+  while (__sync_fetch_and_add(worker->next_trial, 1) < worker->trials) {
+    double estimate = run_trial(worker);
+    pthread_mutex_lock(worker->output_lock);
+    printf("%lf\n", estimate);
+    fflush(stdout);
+    pthread_mutex_unlock(worker->output_lock);
+  }
+  return NULL;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 6) {
-    printf("Usage: %s mmap_directory trials iterations_per_trial maximization_iterations threads\n",
+  if (argc < 6 || argc > 8) {
+    printf("Usage: %s mmap_directory trials iterations_per_trial maximization_iterations threads "
+	   "[initial_temperature] [parallel_trials]\n",
            argv[0]);
     exit(1);
   }
@@ -41,55 +111,67 @@ int main(int argc, char **argv) {
   int do_iterations = atoi(argv[3]);
   int num_threads = atoi(argv[5]);
   int maximization_iterations = atoi(argv[4]);
+  double initial_temperature;
+  if (argc >= 7) {
+    initial_temperature = atof(argv[6]);
+  } else {
+    initial_temperature = 1.0;
+  }
+  int parallel_trials = 1;
+  if (argc >= 8) {
+    parallel_trials = atoi(argv[7]);
+  }
+  assert(parallel_trials > 0);
+  if (parallel_trials > trials) {
+    parallel_trials = trials > 0 ? trials : 1;
+  }
 
-  struct sample_threads sample_threads;
-  initialize_threads(&sample_threads, num_threads, &mmap_info);
+  struct trial_worker* workers = malloc(sizeof(struct trial_worker) * parallel_trials);
+  workers[0].mmap_info = mmap_info;
+  initialize_threads(&(workers[0].sample_threads), num_threads, &(workers[0].mmap_info));
 
   // First we need a high-probability estimate z*
-  for (int i = 0; i < maximization_iterations; ++i) {
-    resample_maximize(&sample_threads);
-  }
-  double maximized_likelihood = parallel_log_likelihood(&sample_threads);
+  double maximized_likelihood = anneal_maximize(&(workers[0].sample_threads),
+						maximization_iterations,
+						initial_temperature, stderr);
 
   // Copy out the z* assignments for reference
   struct revision_assignment* max_assignments 
     = copy_revision_assignments(&mmap_info);
-  for (int trial_number = 0; trial_number < trials; ++trial_number) {
-    int s = 1 + gsl_rng_uniform_int(sample_threads.thread_info[0].rand_gen,
-				    do_iterations);
-    // Iterate once to get assignments h_s
-    resample(&sample_threads);
-    // Copy out the h_s assignments for restoring later
-    struct revision_assignment* hs_assignments 
-      = copy_revision_assignments(&mmap_info);
-    double transition_sum = transition_probability(&sample_threads, max_assignments);
-    
-    // Sample forward
-    for (int it_num = s + 1; it_num <= do_iterations; ++it_num) {
-      resample(&sample_threads);
-      transition_sum = sum_logs(transition_sum, 
-				transition_probability(&sample_threads, 
-						       max_assignments));
-    }
-    // Restore h_s assignments
-    resample_restore(&sample_threads, hs_assignments);
-    free(hs_assignments);
-    // Sample backward
-    for (int it_num = s - 1; it_num >= 1; --it_num) {
-      resample_reverse(&sample_threads);
-      transition_sum = sum_logs(transition_sum, 
-				transition_probability(&sample_threads, 
-						       max_assignments));
-    }
-    transition_sum -= log(do_iterations);
-    printf("%lf\n", maximized_likelihood - transition_sum);
-    fflush(stdout);
-    if (trial_number < trials - 1) {
-      resample_restore(&sample_threads, max_assignments);
+  int next_trial = 0;
+  pthread_mutex_t output_lock;
+  pthread_mutex_init(&output_lock, NULL);
+  for (int w = 0; w < parallel_trials; ++w) {
+    if (w > 0) {
+      // Copies are taken before any trial changes the z* state
+      workers[w].mmap_info = copy_model_mmaps(&mmap_info);
+      initialize_threads(&(workers[w].sample_threads), num_threads, &(workers[w].mmap_info));
+      // Threads are seeded from the time, so keep workers' streams apart
+      offset_thread_seeds(&(workers[w].sample_threads), w);
     }
+    workers[w].max_assignments = max_assignments;
+    workers[w].maximized_likelihood = maximized_likelihood;
+    workers[w].trials = trials;
+    workers[w].do_iterations = do_iterations;
+    workers[w].next_trial = &next_trial;
+    workers[w].output_lock = &output_lock;
+  }
+  for (int w = 0; w < parallel_trials; ++w) {
+    pthread_create(&(workers[w].thread), NULL, trial_thread, (void*)(workers + w));
+  }
+  void* res;
+  for (int w = 0; w < parallel_trials; ++w) {
+    pthread_join(workers[w].thread, &res);
   }
 
+  for (int w = parallel_trials - 1; w >= 0; --w) {
+    destroy_threads(&(workers[w].sample_threads));
+    if (w > 0) {
+      close_mmaps(workers[w].mmap_info);
+    }
+  }
+  pthread_mutex_destroy(&output_lock);
+  free(workers);
   free(max_assignments);
-  destroy_threads(&sample_threads);
   close_mmaps(mmap_info);
 }
@@ -9,7 +9,8 @@ mkdir -p $MMAP_DIR
 # Record the text-formatted data in memory maps
 bin/store_revisions $MMAP_DIR synth_data.txt
 # (Optional) check to make sure the memory maps match the text data
-bin/verify_mmaps $MMAP_DIR synth_data.txt
+# (prints one line per mismatch, exits non-zero if any are found)
+bin/verify_mmaps $MMAP_DIR synth_data.txt $THREADS
 # Initialize topic and POV assignments (hyper-parameters are listed in
 # initialize.sh, and should match those in synth.py)
 bin/initialize.sh $MMAP_DIR $TOPICS $POV $THREADS